@@ -0,0 +1,57 @@
+#!/bin/sh
+# Compares commands-per-second of wsh's two launch backends (posix_spawnp and fork).
+#
+# Usage: bench/launch_bench.sh [commands] [pipeline stages]
+#   WSH=path/to/wsh selects the binary under test (built from src/wsh.c if unset).
+
+set -e
+
+COMMANDS=${1:-5000}
+STAGES=${2:-4}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$WSH" ]; then
+    WSH="$WORK/wsh"
+    ${CC:-gcc} -O2 -o "$WSH" "$ROOT/src/wsh.c"
+fi
+
+# One trivial external command per line, and the same count as short pipelines. The binary is
+# named by path, since a plain 'true' would run inside the shell.
+i=0
+: > "$WORK/single.wsh"
+: > "$WORK/piped.wsh"
+PIPE="/bin/true"
+s=1
+while [ "$s" -lt "$STAGES" ]; do
+    PIPE="$PIPE | /bin/true"
+    s=$((s + 1))
+done
+while [ "$i" -lt "$COMMANDS" ]; do
+    echo "/bin/true" >> "$WORK/single.wsh"
+    echo "$PIPE" >> "$WORK/piped.wsh"
+    i=$((i + 1))
+done
+
+now_ns() {
+    date +%s%N
+}
+
+run() {
+    backend=$1
+    script=$2
+    launches=$3
+    start=$(now_ns)
+    WSH_LAUNCH=$backend "$WSH" "$script" > /dev/null
+    end=$(now_ns)
+    elapsed=$((end - start))
+    rate=$((launches * 1000000000 / elapsed))
+    printf "%-6s %-8s %8d launches %8d.%03d s %8d cmds/s\n" "$backend" "$(basename "$script" .wsh)" \
+        "$launches" $((elapsed / 1000000000)) $((elapsed / 1000000 % 1000)) "$rate"
+}
+
+for backend in fork spawn; do
+    run "$backend" "$WORK/single.wsh" "$COMMANDS"
+    run "$backend" "$WORK/piped.wsh" $((COMMANDS * STAGES))
+done
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Measures pipeline throughput (MB/s) with the default pipe buffer and with WSH_PIPE_SIZE.
+#
+# Usage: bench/pipe_bench.sh [megabytes] [pipeline stages] [pipe sizes...]
+#   WSH=path/to/wsh selects the binary under test (built from src/wsh.c if unset).
+
+set -e
+
+MEGABYTES=${1:-1024}
+STAGES=${2:-4}
+shift 2 2>/dev/null || shift $#
+SIZES=${*:-"256K 1M"}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ -z "$WSH" ]; then
+    WSH="$WORK/wsh"
+    ${CC:-gcc} -O2 -o "$WSH" "$ROOT/src/wsh.c"
+fi
+
+# Stream zeros through a chain of cat stages into a sink.
+PIPE="head -c $((MEGABYTES * 1024 * 1024)) /dev/zero"
+s=1
+while [ "$s" -lt "$STAGES" ]; do
+    PIPE="$PIPE | cat"
+    s=$((s + 1))
+done
+PIPE="$PIPE | wc -c"
+
+now_ns() {
+    date +%s%N
+}
+
+run() {
+    size=$1
+    if [ "$size" = "default" ]; then
+        echo "$PIPE" > "$WORK/pipe.wsh"
+    else
+        printf 'local WSH_PIPE_SIZE=%s\n%s\n' "$size" "$PIPE" > "$WORK/pipe.wsh"
+    fi
+    start=$(now_ns)
+    "$WSH" "$WORK/pipe.wsh" > /dev/null
+    end=$(now_ns)
+    elapsed=$((end - start))
+    printf "%-8s %6d MB %2d stages %8d.%03d s %8d MB/s\n" "$size" "$MEGABYTES" "$STAGES" \
+        $((elapsed / 1000000000)) $((elapsed / 1000000 % 1000)) $((MEGABYTES * 1000000000 / elapsed))
+}
+
+run default
+for size in $SIZES; do
+    run "$size"
+done
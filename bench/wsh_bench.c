@@ -0,0 +1,847 @@
+/**
+ * Benchmark harness for wsh.
+ *
+ * Generates synthetic workloads, runs each one twice against the wsh binary under test and
+ * appends one JSON object per workload to a results file:
+ *
+ *   - as a batch file, timing the whole run for commands/sec;
+ *   - interactively over pipes, timing each line from write() until the next prompt arrives,
+ *     for p50/p99 per-command latency.
+ *
+ * Peak RSS of the wsh process comes from wait4(). The results file holds one JSON object per
+ * line, so runs from different commits can be compared with standard tools.
+ *
+ * With -s it runs the stress suite instead (see run_stress()): deep pipelines, a million-line
+ * batch file and random lines of shell syntax, checked for crashes, sanitizer reports and
+ * descriptor leaks. Nothing is appended to the results file.
+ *
+ * Usage: wsh_bench [-n commands] [-o results.jsonl] [-l label] path/to/wsh
+ *        wsh_bench -s [-p stages] [-b lines] path/to/wsh
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <limits.h>
+
+#define PROMPT "wsh> "
+#define PROMPT_LENGTH (sizeof(PROMPT) - 1)
+#define PIPELINE_STAGES 16
+#define VAR_REFERENCES 32
+#define STRESS_STAGES 10000       // Default stages of a stress pipeline.
+#define STRESS_PIPELINES 3        // Deep pipelines per stress run.
+#define STRESS_LINES 1000000      // Default length of the long stress batch file.
+#define STRESS_RANDOM_LINES 20000 // Random lines per stress run.
+#define STRESS_LONG_WORD 100000   // Length of the long word in the random lines.
+
+// A generated workload: the setup lines run once, then the measured body lines.
+typedef struct
+{
+    char **lines;
+    int count;
+    int capacity;
+} Script;
+
+// One workload of the suite.
+typedef struct
+{
+    const char *name;
+    void (*generate)(Script *script, int commands);
+} Workload;
+
+// Measurements of one workload.
+typedef struct
+{
+    double batch_seconds;
+    double p50_us;
+    double p99_us;
+    long batch_max_rss_kb;
+    long interactive_max_rss_kb;
+} Result;
+
+// Outcome of one stress workload.
+typedef struct
+{
+    double seconds;
+    int first_fds;   // open_fds of the first WSH_STATS report, or -1 if there was none.
+    int last_fds;    // open_fds of the last report.
+    long first_heap; // heap_in_use of the first report.
+    long last_heap;  // heap_in_use of the last report.
+    char problem[2048];
+} StressResult;
+
+void script_add(Script *script, const char *line);
+void script_free(Script *script);
+void generate_trivial(Script *script, int commands);
+void generate_pipeline(Script *script, int commands);
+void generate_variables(Script *script, int commands);
+void generate_history(Script *script, int commands);
+double now_seconds();
+bool run_batch(const char *wsh, const Script *script, Result *result);
+bool run_interactive(const char *wsh, const Script *script, Result *result);
+bool wait_for_prompt(int fd);
+int compare_doubles(const void *a, const void *b);
+void write_result(FILE *out, const char *label, const char *workload, int commands, const Result *result);
+void generate_deep_pipeline(Script *script, int stages);
+void generate_long_batch(Script *script, int lines);
+void generate_random_lines(Script *script, int lines);
+int run_stress(const char *wsh, int stages, int lines);
+bool run_stress_workload(const char *wsh, const Script *script, int stats_every, const char *expected, bool suffix,
+                         StressResult *result);
+char *read_memfd(int fd);
+void remove_scratch_dir(const char *dir);
+
+// The suite, in reporting order.
+const Workload workloads[] = {
+    {"trivial", generate_trivial},
+    {"pipeline", generate_pipeline},
+    {"variables", generate_variables},
+    {"history", generate_history},
+};
+
+int main(int argc, char *argv[])
+{
+    int commands = 2000;
+    const char *output = "bench/results.jsonl";
+    const char *label = "";
+    bool stress = false;
+    int stages = STRESS_STAGES;
+    int lines = STRESS_LINES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:l:sp:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            stress = true;
+            break;
+        case 'p':
+            stages = atoi(optarg);
+            break;
+        case 'b':
+            lines = atoi(optarg);
+            break;
+        case 'n':
+            commands = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n commands] [-o results.jsonl] [-l label] [-s [-p stages] [-b lines]] path/to/wsh\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || commands <= 0 || stages <= 0 || lines <= 0)
+    {
+        fprintf(stderr, "Usage: %s [-n commands] [-o results.jsonl] [-l label] [-s [-p stages] [-b lines]] path/to/wsh\n", argv[0]);
+        return 1;
+    }
+    const char *wsh = argv[optind];
+    if (stress)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        return run_stress(wsh, stages, lines) == 0 ? 0 : 1;
+    }
+
+    FILE *out = fopen(output, "a");
+    if (out == NULL)
+    {
+        perror(output);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%-10s %12s %10s %10s %10s\n", "workload", "cmds/sec", "p50 (us)", "p99 (us)", "RSS (KB)");
+
+    int failures = 0;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        Script script = {0};
+        Result result = {0};
+        workloads[i].generate(&script, commands);
+
+        if (!run_batch(wsh, &script, &result) || !run_interactive(wsh, &script, &result))
+        {
+            fprintf(stderr, "%s: benchmark run failed\n", workloads[i].name);
+            failures++;
+        }
+        else
+        {
+            long rss = result.batch_max_rss_kb > result.interactive_max_rss_kb ? result.batch_max_rss_kb
+                                                                              : result.interactive_max_rss_kb;
+            printf("%-10s %12.0f %10.1f %10.1f %10ld\n", workloads[i].name, script.count / result.batch_seconds,
+                   result.p50_us, result.p99_us, rss);
+            write_result(out, label, workloads[i].name, script.count, &result);
+        }
+        script_free(&script);
+    }
+
+    fclose(out);
+    printf("Results appended to %s\n", output);
+    return failures == 0 ? 0 : 1;
+}
+
+/**
+ * Appends a line to a script.
+ *
+ * @param script The script to extend.
+ * @param line The command line, without a trailing newline.
+ */
+void script_add(Script *script, const char *line)
+{
+    if (script->count == script->capacity)
+    {
+        script->capacity = script->capacity == 0 ? 256 : script->capacity * 2;
+        script->lines = realloc(script->lines, script->capacity * sizeof(char *));
+        if (script->lines == NULL)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    script->lines[script->count++] = strdup(line);
+}
+
+/**
+ * Releases the lines of a script.
+ *
+ * @param script The script to release.
+ */
+void script_free(Script *script)
+{
+    for (int i = 0; i < script->count; i++)
+    {
+        free(script->lines[i]);
+    }
+    free(script->lines);
+}
+
+/**
+ * N trivial external commands: measures the bare launch path. The binary is named by path,
+ * since a plain 'true' would run inside the shell.
+ *
+ * @param script The script to fill.
+ * @param commands Number of command lines.
+ */
+void generate_trivial(Script *script, int commands)
+{
+    for (int i = 0; i < commands; i++)
+    {
+        script_add(script, "/bin/true");
+    }
+}
+
+/**
+ * Deep pipelines of trivial commands: measures pipe setup and per-stage launch.
+ *
+ * @param script The script to fill.
+ * @param commands Number of command lines.
+ */
+void generate_pipeline(Script *script, int commands)
+{
+    char line[PIPELINE_STAGES * 16] = "/bin/true";
+    for (int s = 1; s < PIPELINE_STAGES; s++)
+    {
+        strcat(line, " | /bin/true");
+    }
+    for (int i = 0; i < commands / PIPELINE_STAGES + 1; i++)
+    {
+        script_add(script, line);
+    }
+}
+
+/**
+ * Heavy $VAR substitution: local variable updates and lines with many references.
+ *
+ * @param script The script to fill.
+ * @param commands Number of command lines.
+ */
+void generate_variables(Script *script, int commands)
+{
+    char line[VAR_REFERENCES * 8 + 16];
+    for (int v = 0; v < VAR_REFERENCES; v++)
+    {
+        snprintf(line, sizeof(line), "local V%d=value%d", v, v);
+        script_add(script, line);
+    }
+    for (int i = 0; i < commands; i++)
+    {
+        if (i % 4 == 0)
+        {
+            snprintf(line, sizeof(line), "local V%d=value%d", i % VAR_REFERENCES, i);
+        }
+        else
+        {
+            strcpy(line, "true");
+            for (int v = 0; v < VAR_REFERENCES; v++)
+            {
+                snprintf(line + strlen(line), sizeof(line) - strlen(line), " $V%d", v);
+            }
+        }
+        script_add(script, line);
+    }
+}
+
+/**
+ * History-heavy session: commands interleaved with history listing, resizing and replay.
+ *
+ * @param script The script to fill.
+ * @param commands Number of command lines.
+ */
+void generate_history(Script *script, int commands)
+{
+    script_add(script, "history set 64");
+    for (int i = 0; i < commands; i++)
+    {
+        switch (i % 8)
+        {
+        case 3:
+            script_add(script, "history");
+            break;
+        case 5:
+            script_add(script, "history 2");
+            break;
+        case 7:
+            script_add(script, i % 64 == 7 ? "history set 32" : "history set 64");
+            break;
+        default:
+            script_add(script, i % 2 == 0 ? "true" : "true x");
+            break;
+        }
+    }
+}
+
+/**
+ * Reads the monotonic clock.
+ *
+ * @return Seconds since an arbitrary fixed point.
+ */
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Runs a script as a wsh batch file and times the whole run.
+ *
+ * @param wsh Path to the wsh binary.
+ * @param script The workload.
+ * @param result Receives batch_seconds and batch_max_rss_kb.
+ * @return True on success.
+ */
+bool run_batch(const char *wsh, const Script *script, Result *result)
+{
+    char path[] = "/tmp/wsh_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        perror("mkstemp");
+        return false;
+    }
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < script->count; i++)
+    {
+        fprintf(file, "%s\n", script->lines[i]);
+    }
+    fclose(file);
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execl(wsh, wsh, path, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    bool ok = pid > 0 && wait4(pid, &status, 0, &usage) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    result->batch_seconds = now_seconds() - start;
+    result->batch_max_rss_kb = ok ? usage.ru_maxrss : 0;
+    unlink(path);
+    return ok;
+}
+
+/**
+ * Drives wsh interactively: writes one line at a time and waits for the next prompt, recording
+ * the latency of every line.
+ *
+ * @param wsh Path to the wsh binary.
+ * @param script The workload.
+ * @param result Receives p50_us, p99_us and interactive_max_rss_kb.
+ * @return True on success.
+ */
+bool run_interactive(const char *wsh, const Script *script, Result *result)
+{
+    int to_shell[2], from_shell[2];
+    if (pipe(to_shell) == -1 || pipe(from_shell) == -1)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(to_shell[0], STDIN_FILENO);
+        dup2(from_shell[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        close(to_shell[0]);
+        close(to_shell[1]);
+        close(from_shell[0]);
+        close(from_shell[1]);
+        execl(wsh, wsh, (char *)NULL);
+        _exit(127);
+    }
+    close(to_shell[0]);
+    close(from_shell[1]);
+
+    double *latencies = malloc(script->count * sizeof(double));
+    bool ok = pid > 0 && latencies != NULL && wait_for_prompt(from_shell[0]);
+    for (int i = 0; ok && i < script->count; i++)
+    {
+        char line[4096];
+        int len = snprintf(line, sizeof(line), "%s\n", script->lines[i]);
+        double start = now_seconds();
+        ok = write(to_shell[1], line, len) == len && wait_for_prompt(from_shell[0]);
+        latencies[i] = (now_seconds() - start) * 1e6;
+    }
+    close(to_shell[1]); // End of input makes the shell exit.
+    close(from_shell[0]);
+
+    int status;
+    struct rusage usage;
+    ok = pid > 0 && wait4(pid, &status, 0, &usage) == pid && ok;
+    if (ok)
+    {
+        qsort(latencies, script->count, sizeof(double), compare_doubles);
+        result->p50_us = latencies[script->count / 2];
+        result->p99_us = latencies[(int)(script->count * 0.99)];
+        result->interactive_max_rss_kb = usage.ru_maxrss;
+    }
+    free(latencies);
+    return ok;
+}
+
+/**
+ * Reads shell output until it ends with a prompt.
+ *
+ * @param fd Read end of the shell's stdout.
+ * @return True once a prompt has arrived, false if the shell closed its output first.
+ */
+bool wait_for_prompt(int fd)
+{
+    char tail[PROMPT_LENGTH] = {0};
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        // Keep the last PROMPT_LENGTH bytes seen, across reads.
+        if ((size_t)n >= PROMPT_LENGTH)
+        {
+            memcpy(tail, buf + n - PROMPT_LENGTH, PROMPT_LENGTH);
+        }
+        else
+        {
+            memmove(tail, tail + n, PROMPT_LENGTH - n);
+            memcpy(tail + PROMPT_LENGTH - n, buf, n);
+        }
+        if (memcmp(tail, PROMPT, PROMPT_LENGTH) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * qsort() comparator for doubles.
+ */
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Appends one workload result as a JSON object on its own line.
+ *
+ * @param out The results file.
+ * @param label Free-form run label, typically the commit.
+ * @param workload Workload name.
+ * @param commands Number of lines in the workload.
+ * @param result The measurements.
+ */
+void write_result(FILE *out, const char *label, const char *workload, int commands, const Result *result)
+{
+    fprintf(out,
+            "{\"label\": \"%s\", \"time\": %ld, \"workload\": \"%s\", \"commands\": %d, "
+            "\"commands_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+            "\"batch_max_rss_kb\": %ld, \"interactive_max_rss_kb\": %ld}\n",
+            label, (long)time(NULL), workload, commands, commands / result->batch_seconds, result->p50_us,
+            result->p99_us, result->batch_max_rss_kb, result->interactive_max_rss_kb);
+}
+
+/**
+ * Deep pipelines: a word travels through every stage of a long chain of cats, several times.
+ *
+ * @param script The script to fill.
+ * @param stages Number of stages per pipeline.
+ */
+void generate_deep_pipeline(Script *script, int stages)
+{
+    size_t size = stages * 8 + 32;
+    char *line = malloc(size);
+    strcpy(line, "echo stress");
+    for (int s = 1; s < stages; s++)
+    {
+        strcat(line, " | cat");
+    }
+    for (int i = 0; i < STRESS_PIPELINES; i++)
+    {
+        script_add(script, line);
+    }
+    free(line);
+    script_add(script, "echo survived");
+}
+
+/**
+ * A million-line batch file, mostly built-ins with variables, redirections and lists, so the
+ * per-line paths run many times over; every ten thousandth line also forks a substitution and
+ * a pipeline. The last lines check that a failed cd fails the list it is in.
+ *
+ * @param script The script to fill.
+ * @param lines Number of lines.
+ */
+void generate_long_batch(Script *script, int lines)
+{
+    char line[128];
+    for (int i = 0; i < lines; i++)
+    {
+        switch (i % 8)
+        {
+        case 0:
+            snprintf(line, sizeof(line), "local V%d=value%d", i % 64, i);
+            break;
+        case 1:
+            snprintf(line, sizeof(line), "echo $V%d ${V%d}x > /dev/null", i % 64, (i + 1) % 64);
+            break;
+        case 2:
+            strcpy(line, "test -n $V0 && true || false");
+            break;
+        case 3:
+            strcpy(line, "printf '%s\\n' a b >> /dev/null; true");
+            break;
+        case 4:
+            strcpy(line, "echo $? $PIPESTATUS 2>&1 > /dev/null");
+            break;
+        case 5:
+            strcpy(line, i % 10000 == 5 ? "echo $(echo sub) | cat > /dev/null" : "false || true");
+            break;
+        case 6:
+            strcpy(line, "pwd > /dev/null");
+            break;
+        default:
+            strcpy(line, "true");
+            break;
+        }
+        script_add(script, line);
+    }
+    // A failed cd must fail the list, or 'cd dir && rm *' runs where it should not.
+    script_add(script, "cd /nonexistent/wsh-stress 2> /dev/null && echo cd-ran || echo cd-failed");
+    script_add(script, "cd /nonexistent/wsh-stress 2> /dev/null; echo cd-status=$?");
+    // Negated unary tests and empty quoted operands, with any complaint sent to the output.
+    script_add(script, "[ ! -z x ] 2>&1 && echo not-empty");
+    script_add(script, "[ \"\" = x ] 2>&1 || echo empty-differs");
+    script_add(script, "echo survived");
+}
+
+/**
+ * Random lines drawn from the shell's own syntax: operators, quotes, redirections and every
+ * kind of expansion, glued together with and without blanks. Most lines are syntax errors or
+ * odd commands; the shell must report them and keep going. The generator is seeded, so a
+ * failure can be reproduced. A very long word and a line of many references come last.
+ *
+ * @param script The script to fill.
+ * @param lines Number of random lines.
+ */
+void generate_random_lines(Script *script, int lines)
+{
+    static const char *const tokens[] = {
+        "true", "echo", "printf", "test", "-n", "x", "y", "%s", "local", "V=1", "$V", "${V}", "${", "}", "$?",
+        "$PIPESTATUS", "$", "'q z'", "\"d $V\"", "'", "\"", "\\", "\\$V", "|", "||", "&&", ";", "&", "<",
+        "< /dev/null", ">", "> /dev/null", ">>", "2>&1", ">&2", "<&", ">&$V", "3>", "<(", ">(", "$(", "(", ")",
+        "time", "memo", "false", "[", "]", "=", "\001", "\002", "\0010",
+    };
+    int num_tokens = sizeof(tokens) / sizeof(tokens[0]);
+    char line[1024];
+    srand(537);
+    for (int i = 0; i < lines; i++)
+    {
+        line[0] = '\0';
+        int count = 1 + rand() % 12;
+        for (int t = 0; t < count; t++)
+        {
+            const char *token = tokens[rand() % num_tokens];
+            if (strlen(line) + strlen(token) + 2 < sizeof(line))
+            {
+                strcat(line, rand() % 3 == 0 ? "" : " ");
+                strcat(line, token);
+            }
+        }
+        script_add(script, line);
+    }
+
+    size_t size = STRESS_LONG_WORD + 32;
+    char *long_line = malloc(size);
+    strcpy(long_line, "echo ");
+    memset(long_line + 5, 'w', STRESS_LONG_WORD);
+    strcpy(long_line + 5 + STRESS_LONG_WORD, " > /dev/null");
+    script_add(script, long_line);
+    strcpy(long_line, "true");
+    while (strlen(long_line) + 4 < size)
+    {
+        strcat(long_line, " $V");
+    }
+    script_add(script, long_line);
+    free(long_line);
+    script_add(script, "echo survived");
+}
+
+/**
+ * Runs the stress suite against a wsh binary, ideally one built with 'make asan'. Each workload
+ * runs as a batch file in a scratch directory with WSH_STATS reports along the way. It fails if
+ * the shell dies from a signal, a sanitizer reports anything, the output is not what the script
+ * prints, or the descriptor count grows between the first and the last report.
+ *
+ * @param wsh Path to the wsh binary.
+ * @param stages Number of stages of the deep pipelines.
+ * @param lines Number of lines of the long batch file.
+ * @return Number of failed workloads.
+ */
+int run_stress(const char *wsh, int stages, int lines)
+{
+    char wsh_path[PATH_MAX]; // Workloads run in a scratch directory.
+    if (realpath(wsh, wsh_path) == NULL)
+    {
+        perror(wsh);
+        return 1;
+    }
+    printf("%-14s %6s %10s %12s %14s\n", "workload", "result", "seconds", "open fds", "heap growth");
+    int failures = 0;
+    for (int w = 0; w < 3; w++)
+    {
+        Script script = {0};
+        StressResult result = {0};
+        const char *name = w == 0 ? "deep-pipeline" : w == 1 ? "long-batch" : "random-lines";
+        char *expected = NULL;
+        size_t expected_size = 0;
+        FILE *out = open_memstream(&expected, &expected_size);
+        if (w == 0)
+        {
+            generate_deep_pipeline(&script, stages);
+            for (int i = 0; i < STRESS_PIPELINES; i++)
+            {
+                fputs("stress\n", out);
+            }
+        }
+        else if (w == 1)
+        {
+            generate_long_batch(&script, lines);
+            fputs("cd-failed\ncd-status=1\nnot-empty\nempty-differs\n", out);
+        }
+        else
+        {
+            generate_random_lines(&script, STRESS_RANDOM_LINES);
+        }
+        fputs("survived\n", out);
+        fclose(out);
+
+        // Random lines print all sorts of things; only the last line's output is known.
+        bool ok = run_stress_workload(wsh_path, &script, script.count / 10 + 1, expected, w == 2, &result);
+        if (result.first_fds >= 0 && result.last_fds > result.first_fds)
+        {
+            snprintf(result.problem, sizeof(result.problem), "descriptor leak: %d open at first, %d at last",
+                     result.first_fds, result.last_fds);
+            ok = false;
+        }
+        printf("%-14s %6s %10.2f %5d -> %-5d %11ld KB\n", name, ok ? "ok" : "FAIL", result.seconds, result.first_fds,
+               result.last_fds, (result.last_heap - result.first_heap) / 1024);
+        fflush(stdout);
+        if (!ok)
+        {
+            fprintf(stderr, "%s: %s\n", name, result.problem);
+            failures++;
+        }
+        free(expected);
+        script_free(&script);
+    }
+    return failures;
+}
+
+/**
+ * Runs one stress workload and checks how the shell fared.
+ *
+ * @param wsh Path to the wsh binary.
+ * @param script The workload.
+ * @param stats_every Lines between WSH_STATS reports.
+ * @param expected What the script prints.
+ * @param suffix Whether the output only has to end with expected.
+ * @param result Receives the measurements, and a description of the first problem found.
+ * @return True if the shell survived with the expected output and no sanitizer report.
+ */
+bool run_stress_workload(const char *wsh, const Script *script, int stats_every, const char *expected, bool suffix,
+                         StressResult *result)
+{
+    char path[] = "/tmp/wsh_stress_XXXXXX";
+    char dir[] = "/tmp/wsh_stress_dir_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1 || mkdtemp(dir) == NULL)
+    {
+        perror("mkstemp");
+        return false;
+    }
+    FILE *file = fdopen(fd, "w");
+    for (int i = 0; i < script->count; i++)
+    {
+        fprintf(file, "%s\n", script->lines[i]);
+    }
+    fclose(file);
+
+    int output = memfd_create("wsh-stress-out", MFD_CLOEXEC);
+    int errors = memfd_create("wsh-stress-err", MFD_CLOEXEC);
+    char every[16];
+    snprintf(every, sizeof(every), "%d", stats_every);
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Sanitizer reports get their own exit status; the scratch directory takes stray files.
+        setenv("WSH_STATS", every, 1);
+        setenv("ASAN_OPTIONS", "exitcode=86:detect_leaks=1", 0);
+        setenv("UBSAN_OPTIONS", "exitcode=86:print_stacktrace=1", 0);
+        int null = open("/dev/null", O_RDONLY);
+        dup2(null, STDIN_FILENO);
+        dup2(output, STDOUT_FILENO);
+        dup2(errors, STDERR_FILENO);
+        if (chdir(dir) != 0)
+        {
+            _exit(127);
+        }
+        execl(wsh, wsh, path, (char *)NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+    bool ok = pid > 0 && waitpid(pid, &status, 0) == pid;
+    result->seconds = now_seconds() - start;
+    unlink(path);
+    remove_scratch_dir(dir);
+
+    char *out = read_memfd(output);
+    char *err = read_memfd(errors);
+    close(output);
+    close(errors);
+
+    // Descriptor and heap counts of the first and the last report.
+    result->first_fds = result->last_fds = -1;
+    for (const char *report = err; (report = strstr(report, "wsh: stats ")) != NULL; report++)
+    {
+        const char *fds = strstr(report, "open_fds=");
+        const char *heap = strstr(report, "heap_in_use=");
+        if (fds == NULL || heap == NULL)
+        {
+            break;
+        }
+        result->last_fds = atoi(fds + 9);
+        result->last_heap = atol(heap + 12);
+        if (result->first_fds < 0)
+        {
+            result->first_fds = result->last_fds;
+            result->first_heap = result->last_heap;
+        }
+    }
+
+    size_t out_len = strlen(out), expected_len = strlen(expected);
+    if (!ok || WIFSIGNALED(status))
+    {
+        snprintf(result->problem, sizeof(result->problem), "shell killed by signal %d", WTERMSIG(status));
+        ok = false;
+    }
+    else if (WEXITSTATUS(status) == 86 || strstr(err, "Sanitizer") != NULL || strstr(err, "runtime error:") != NULL)
+    {
+        const char *report = strstr(err, "==ERROR");
+        report = report != NULL ? report : strstr(err, "runtime error:");
+        snprintf(result->problem, sizeof(result->problem), "sanitizer report:\n%.1500s", report != NULL ? report : err);
+        ok = false;
+    }
+    else if (suffix ? out_len < expected_len || strcmp(out + out_len - expected_len, expected) != 0
+                    : strcmp(out, expected) != 0)
+    {
+        snprintf(result->problem, sizeof(result->problem), "unexpected output (%zu bytes), ending:\n%s", out_len,
+                 out + (out_len > 200 ? out_len - 200 : 0));
+        ok = false;
+    }
+    free(out);
+    free(err);
+    return ok;
+}
+
+/**
+ * Reads the whole contents of a memfd.
+ *
+ * @param fd The memfd.
+ * @return Its contents as a heap string.
+ */
+char *read_memfd(int fd)
+{
+    off_t size = lseek(fd, 0, SEEK_END);
+    char *data = malloc(size > 0 ? size + 1 : 1);
+    ssize_t n = size > 0 ? pread(fd, data, size, 0) : 0;
+    data[n > 0 ? n : 0] = '\0';
+    return data;
+}
+
+/**
+ * Removes a scratch directory and the files a workload left in it.
+ *
+ * @param dir The directory.
+ */
+void remove_scratch_dir(const char *dir)
+{
+    DIR *scratch = opendir(dir);
+    struct dirent *entry;
+    while (scratch != NULL && (entry = readdir(scratch)) != NULL)
+    {
+        if (entry->d_name[0] != '.' || (entry->d_name[1] != '\0' && strcmp(entry->d_name, "..") != 0))
+        {
+            unlinkat(dirfd(scratch), entry->d_name, 0);
+        }
+    }
+    if (scratch != NULL)
+    {
+        closedir(scratch);
+    }
+    rmdir(dir);
+}
@@ -1,62 +1,776 @@
 // Include standard libraries for input/output, standard functions, string manipulation,
 // UNIX-specific functions like fork() and exec(), and boolean type definitions.
+#define _GNU_SOURCE // Exposes GNU extensions such as strchrnul().
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <spawn.h>
+#include <errno.h>
+#include <malloc.h>
+#include <limits.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <termios.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <fnmatch.h>
 
-// Define constants for maximum input line length, maximum number of arguments in a command,
-// maximum number of commands to keep in history, a placeholder for the 'history set' command,
-// and the maximum number of local variables supported.
+extern char **environ; // Environment handed to every launched command.
+
+// Define constants for maximum input line length, the inline capacity of command words and
+// pipeline stages, maximum number of commands to keep in history, a placeholder for the 'history set' command,
+// and the initial size of the variable table.
 #define MAX_LINE_LENGTH 1024
-#define MAX_ARGS 128
+#define COMMAND_INLINE_WORDS 8 // Word slots a command holds before its argv moves into the arena.
+#define PIPELINE_INLINE_CMDS 4 // Command slots a pipeline holds before its list moves into the arena.
 #define MAX_HISTORY 5
 #define HISTORY_SET "history set"
-#define MAX_LOCAL_VARS 128
+#define VAR_TABLE_MIN_SLOTS 16
+#define PATH_CACHE_BUCKETS 64
+#define DIR_CACHE_SLOTS 32          // Directory listings kept for pathname expansion.
+#define DIR_CACHE_RACY_NS 20000000L // A listing read this soon after its directory changed is not reused.
+#define DIR_READ_BUFFER 32768       // Bytes of entries asked of each getdents64() call.
+#define BATCH_STREAM_BUFFER (256 * 1024)
+#define BATCH_DROP_INTERVAL (1024 * 1024)
+#define MAX_REDIRECTS 8
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define PIPE_SIZE_VAR "WSH_PIPE_SIZE" // Setting that overrides the kernel's pipe buffer size.
+#define CGROUP_ROOT "/sys/fs/cgroup"   // Mount point of the cgroup v2 hierarchy that 'with cgroup=' names.
+#define COMPILED_MAGIC "WSHC"  // First bytes of a compiled batch script.
+#define COMPILED_VERSION 8     // Bumped whenever the AST or its encoding changes.
+#define STARTUP_BUDGET_US 1000 // Time-to-first-exec 'wsh --startup-bench' holds the shell to.
+#define MEMO_BUCKETS 64
+#define MEMO_DEFAULT_TTL 60                  // Seconds a memoized result stays valid.
+#define MEMO_DEFAULT_SIZE (16L * 1024 * 1024) // Bytes of output the memo cache may hold.
+#define CTLESC '\001' // Lexer marker: the next character of a word was quoted.
+#define CTLPROC '\002' // Lexer marker: the word is process substitution number <next character>.
+#define CTLQUOTE '\003' // Lexer marker: first byte of a quoted word that stays an argument if empty.
+#define GLOB_CHARS "*?[" // Characters that start a pattern, and are marked with CTLESC when quoted.
+#define BUILTIN_MAX_NAME 7                            // Length of the longest built-in name.
+#define BUILTIN_KEY(len, first) ((len) << 8 | (first)) // Dispatch key: name length and first character.
+
+// Backends available for launching external commands. posix_spawn lets libc use a
+// vfork-style clone, so the cost of a launch does not grow with the shell's heap;
+// plain fork is kept for cases that need to run shell code in the child.
+typedef enum
+{
+    LAUNCH_SPAWN,
+    LAUNCH_FORK
+} LaunchBackend;
+
+// Built-in commands, in the order of the dispatch table.
+typedef enum
+{
+    BUILTIN_CD,
+    BUILTIN_EXIT,
+    BUILTIN_HISTORY,
+    BUILTIN_EXPORT,
+    BUILTIN_LOCAL,
+    BUILTIN_VARS,
+    BUILTIN_HASH,
+    BUILTIN_JOBS,
+    BUILTIN_WAIT,
+    BUILTIN_FG,
+    BUILTIN_BG,
+    BUILTIN_ECHO,
+    BUILTIN_PRINTF,
+    BUILTIN_TRUE,
+    BUILTIN_FALSE,
+    BUILTIN_TEST,
+    BUILTIN_BRACKET,
+    BUILTIN_PWD,
+    BUILTIN_COPROC,
+    NUM_BUILTINS
+} BuiltinId;
+
+// Descriptor of a built-in command: how to check its arguments and how to run it.
+typedef struct
+{
+    const char *name;               // Command name.
+    int (*handler)(char *argv[]);   // Runs the command; returns its exit status.
+    bool (*validator)(char *argv[]); // Reports usage errors before running, or NULL.
+    bool utility;                   // Leaves shell state alone, so it can run as any pipeline stage
+                                    // and does not need to be a barrier in parallel batch mode.
+} Builtin;
+
+// Kinds of I/O redirection a command can carry.
+typedef enum
+{
+    REDIR_INPUT,  // [n]< file
+    REDIR_OUTPUT, // [n]> file
+    REDIR_APPEND, // [n]>> file
+    REDIR_DUP,     // [n]>&m or [n]<&m: descriptor n becomes a copy of m
+    REDIR_PROC_IN, // <(cmd): a word naming a pipe that carries the output of cmd
+    REDIR_PROC_OUT // >(cmd): a word naming a pipe that feeds the input of cmd
+} RedirectType;
+
+// A single redirection attached to a command.
+typedef struct
+{
+    RedirectType type; // How the target is opened.
+    int fd;            // Descriptor of the command that is redirected.
+    char *target;      // File name as produced by the lexer, the source descriptor for REDIR_DUP, or
+                       // the command line of a process substitution.
+} Redirect;
+
+// One simple command of a pipeline: its words and redirections. The words start out in the
+// inline slots and move to a larger block of the same arena when they outgrow them (see
+// small_vec_push()), so typical commands need no allocation for their argv and long ones have
+// no limit.
+typedef struct
+{
+    char **argv;                    // Null-terminated words, in lexer form (see CTLESC).
+    int argc;                       // Number of words.
+    int argv_cap;                   // Slots in argv, the terminator included.
+    Redirect redirs[MAX_REDIRECTS]; // Redirections in the order they were written.
+    int num_redirs;                 // Number of redirections.
+    char *argv_inline[COMMAND_INLINE_WORDS]; // Initial storage of argv.
+} Command;
+
+// How a pipeline is joined to the one before it in a command list.
+typedef enum
+{
+    LIST_SEQ, // First in the list, or after ';' or '&': always runs.
+    LIST_AND, // After '&&': runs if the previous pipeline succeeded.
+    LIST_OR   // After '||': runs if the previous pipeline failed.
+} ListOp;
+
+// Launch settings from a 'with' prefix, applied in the child to every process of a pipeline.
+typedef struct
+{
+    bool set_cpus;      // Whether to pin the processes to cpus.
+    cpu_set_t cpus;     // CPUs the processes may run on.
+    bool set_nice;      // Whether to give the processes a nice value.
+    int nice;           // The nice value, -20 to 19.
+    const char *cgroup; // Cgroup to move the processes into, below CGROUP_ROOT, or NULL.
+} LaunchAttrs;
+
+// Parsed form of an input line: a list of pipelines, each made of commands connected by pipes and
+// optionally run in the background.
+typedef struct Pipeline
+{
+    Command **cmds;          // Commands in pipeline order; grows like Command's argv.
+    int num_cmds;            // Number of commands.
+    int cmds_cap;            // Slots in cmds.
+    bool background;         // Whether the line ended with '&'.
+    bool timed;              // Whether the line started with the 'time' prefix.
+    bool memo;               // Whether the line started with the 'memo' prefix.
+    LaunchAttrs *attrs;      // Settings of a 'with' prefix, or NULL.
+    const char *text;        // Source line, shown in job listings.
+    long parse_ns;           // Time spent parsing the line, for profiles (first pipeline only).
+    ListOp op;               // Operator that joins this pipeline to the previous one.
+    struct Pipeline *next;   // Next pipeline of the list, or NULL.
+    Command *cmds_inline[PIPELINE_INLINE_CMDS]; // Initial storage of cmds.
+} Pipeline;
+
+// Block of memory owned by an arena.
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next; // Next chunk in the arena; kept around for reuse after a release.
+    size_t size;             // Usable bytes in data.
+    size_t used;             // Bytes handed out so far.
+    char data[];             // The memory itself.
+} ArenaChunk;
+
+// Bump allocator for per-line data. Everything allocated while handling one line is released
+// at once, so the parser never frees individual nodes.
+typedef struct
+{
+    ArenaChunk *first;   // First chunk, or NULL before the first allocation.
+    ArenaChunk *current; // Chunk allocations are currently served from.
+    size_t in_use;       // Bytes handed out and not yet released.
+    size_t peak;         // Highest value in_use has reached.
+} Arena;
+
+// Saved arena position, used to release everything allocated after it.
+typedef struct
+{
+    ArenaChunk *chunk; // Chunk that was current.
+    size_t used;       // Its fill level at the time.
+    size_t in_use;     // The arena's in_use at the time.
+} ArenaMark;
+
+// Counters reported when WSH_STATS is set, used to confirm that memory stays flat over long runs.
+typedef struct
+{
+    bool enabled;              // Whether WSH_STATS was set.
+    pid_t owner;               // Process that reports; forked children stay quiet.
+    unsigned long report_every; // Also report after every this many lines (0: only at exit).
+    unsigned long lines;       // Lines handed to parse_and_execute().
+    unsigned long arena_allocs; // Allocations served by the line arena.
+    unsigned long chunk_mallocs; // Heap allocations the arena itself had to make.
+    unsigned long env_rebuilds; // Times the envp snapshot had to be rebuilt after an export.
+    unsigned long dir_scans;   // Directories read for pathname expansion.
+    unsigned long dir_cache_hits; // Directory listings reused instead of read again.
+    long start_rss_kb;         // Resident set size when counting started.
+} ShellStats;
+
+// A directory's entries as read for pathname expansion, reused while the directory is unchanged.
+typedef struct
+{
+    char *path;              // Directory as named in the pattern, "." for the current one; NULL if unused.
+    dev_t dev;               // Device and inode of the directory when it was read.
+    ino_t ino;
+    struct timespec mtime;   // Its modification time then; adding, removing or renaming an entry moves it.
+    struct timespec scanned; // When the entries were read.
+    char *names;             // The entries, each a d_type byte followed by the NUL-terminated name.
+    size_t size;             // Bytes used in names.
+    size_t cap;              // Bytes allocated for names.
+} DirListing;
+
+// Descriptor moved into place in the child: dup2(from, to). Files are opened close-on-exec, so
+// the original never leaks into the command.
+typedef struct
+{
+    int from;   // Descriptor opened by the shell, or the command's own descriptor for a dup.
+    int to;     // Descriptor number the command sees.
+    bool owned; // Whether 'from' was opened by the shell and must be closed after the launch.
+} FdMove;
+
+// Descriptor plumbing applied in the child before the command is executed.
+typedef struct
+{
+    int fd_in;                     // Descriptor to install as stdin, or -1 to inherit the shell's.
+    int fd_out;                    // Descriptor to install as stdout, or -1 to inherit the shell's.
+    int fd_close;                  // Additional descriptor the child must close, or -1.
+    FdMove moves[MAX_REDIRECTS + 2]; // Redirections, applied after the pipe plumbing; two spare
+                                     // slots hold the pipe ends of a stage run in the shell.
+    int num_moves;                 // Number of redirections.
+    pid_t pgid;                    // Process group to join: 0 to lead a new one, -1 to stay in the shell's.
+    const LaunchAttrs *attrs;      // CPU, nice and cgroup settings to apply, or NULL.
+} LaunchSpec;
+
+// Entry in the PATH lookup cache, mapping a command name to the binary it resolved to.
+typedef struct PathCacheEntry
+{
+    char *name;                  // Command name as typed.
+    char *path;                  // Absolute path found by searching PATH.
+    int hits;                    // Number of launches served from this entry.
+    struct PathCacheEntry *next; // Next entry in the same bucket.
+} PathCacheEntry;
+
+// Result of a memoized command: its output and exit status, valid for WSH_MEMO_TTL. Entries are
+// chained per bucket and kept on a most-recently-used list for eviction.
+typedef struct MemoEntry
+{
+    char *key;                  // Argument vector, working directory and selected environment.
+    size_t key_len;             // Length of the key, which contains NUL separators.
+    unsigned int hash;          // Hash of the key.
+    char *output;               // Captured standard output.
+    size_t size;                // Length of the output.
+    int status;                 // Exit status.
+    time_t stored;              // CLOCK_MONOTONIC second at which the result was cached.
+    struct MemoEntry *next;     // Next entry in the same bucket.
+    struct MemoEntry *newer;    // Neighbour on the use list, towards the most recently used.
+    struct MemoEntry *older;    // Neighbour on the use list, towards the least recently used.
+} MemoEntry;
+
+// Output cache behind the 'memo' prefix.
+typedef struct
+{
+    MemoEntry *buckets[MEMO_BUCKETS]; // Hash table of entries.
+    MemoEntry *newest;                // Most recently used entry.
+    MemoEntry *oldest;                // Least recently used entry, evicted first.
+    size_t bytes;                     // Output bytes held by all entries.
+    unsigned long hits;               // Runs served from the cache.
+    unsigned long misses;             // Runs that had to launch the command.
+} MemoCache;
+
+// Line reader for batch files. Regular files are memory-mapped and split in place, so each
+// line is handed out as a view into the mapping; other inputs fall back to getline().
+typedef struct
+{
+    char *data;   // Private writable mapping of the file, or NULL when streaming.
+    size_t size;  // Size of the mapping in bytes.
+    size_t pos;   // Offset of the next unread byte in the mapping.
+    size_t dropped; // Offset up to which consumed pages have been given back to the kernel.
+    char *tail;   // Copy of an unterminated last line that ends exactly on a page boundary.
+    FILE *stream; // Stream used when the input cannot be mapped.
+    char *line;   // Growable getline() buffer for the streaming fallback.
+    size_t cap;   // Capacity of the getline() buffer.
+} BatchReader;
+
+// Header of a compiled batch script ('script.wshc'). The body that follows holds one record per
+// non-blank line: the line, then either its parsed pipeline list or a marker that it does not
+// parse. The cache is only used while the script still has the identity recorded here.
+typedef struct
+{
+    char magic[4];       // COMPILED_MAGIC.
+    uint32_t version;    // COMPILED_VERSION.
+    uint64_t dev;        // Device of the script.
+    uint64_t ino;        // Inode of the script.
+    int64_t size;        // Size of the script in bytes.
+    int64_t mtime_sec;   // Modification time of the script.
+    int64_t mtime_nsec;  // Sub-second part of the modification time.
+    uint64_t body_size;  // Bytes of records after the header, to catch truncated files.
+    uint32_t num_lines;  // Number of records.
+    uint32_t body_hash;  // hash_bytes() of the records, to catch overwritten ones.
+} CompiledHeader;
+
+// Compiled batch script being executed. The records are a private writable mapping of the cache
+// file, or a heap buffer if the cache could not be written, so decoded words can be expanded in
+// place like the parser's own.
+typedef struct
+{
+    char *data;  // Header and records.
+    size_t size; // Size of data.
+    bool mapped; // Whether data is a mapping rather than a heap buffer.
+    char *pos;   // Next record.
+    char *end;   // End of the records.
+    bool bad;    // Set once a record runs past the end or holds an impossible value.
+} CompiledScript;
+
+// Job slot scheduler for parallel batch mode ('wsh -j N'). Each external line runs in its own
+// child; with ordered output the children write to temporary files that are replayed in
+// submission order through a sliding window of pending jobs.
+typedef struct
+{
+    int max_jobs;   // Upper bound on concurrently running jobs.
+    int running;    // Number of jobs currently running.
+    bool ordered;   // Whether output is replayed in submission order.
+    int window;     // Capacity of the pending-output ring (ordered mode only).
+    int head;       // Index of the oldest pending job in the ring.
+    int count;      // Number of pending jobs in the ring.
+    pid_t *pids;    // PID of each pending job, or 0 once it has exited.
+    FILE **outputs; // Captured output of each pending job.
+    int num_cpus;   // CPUs jobs are pinned to in turn ('-P'), or 0 to leave them unpinned.
+    int *cpus;      // Those CPUs, taken from the shell's own affinity mask.
+    pid_t *cpu_jobs; // Job pinned to each of them, or 0 once it has exited.
+    int next_cpu;   // Index in cpus where the search for a free CPU starts.
+} BatchScheduler;
+
+// One process of a job, as last reported by the SIGCHLD reaper.
+typedef struct
+{
+    pid_t pid;           // Process ID, or 0 for a stage that ran inside the shell.
+    int status;          // Wait status once the process has exited.
+    bool exited;         // Whether the process has terminated.
+    bool stopped;        // Whether the process is currently stopped.
+    bool in_shell;       // Whether the stage ran inside the shell instead of a process.
+    char name[32];       // Command name, possibly truncated, for profiles.
+    long launch_ns;      // Time spent starting the process, or running the stage in the shell.
+    struct rusage usage; // Resources the process used, from wait4().
+} JobProcess;
+
+// A pipeline started by the shell. Jobs live in job_table, indexed by job number - 1, until
+// whoever waits for them removes them: the foreground wait, 'wait', 'jobs', the prompt-time
+// notifier, or the batch scheduler for jobs it started itself.
+typedef struct
+{
+    int id;              // Job number, as used in '%n'.
+    pid_t pgid;          // Process group; the PID of the first process.
+    char *command;       // Command line, for listings.
+    bool background;     // Whether the shell is not waiting for the job.
+    bool batch;          // Started by the parallel batch scheduler, which reaps it itself.
+    bool timed;          // Whether to print a 'time' summary once the job is done.
+    long parse_ns;       // Time spent parsing the line.
+    struct timespec started;  // When the job was created.
+    struct timespec finished; // When its last process exited, once it has.
+    int num_procs;       // Processes started so far.
+    int max_procs;       // Capacity of procs.
+    JobProcess procs[];  // Processes in pipeline order.
+} Job;
+
+// Command stored in the history ring. Entries loaded from the history file point straight into
+// its mapping and are not NUL-terminated; entries added during the session own a heap copy.
+typedef struct
+{
+    const char *text; // Command text.
+    size_t len;       // Length of the text.
+    bool owned;       // Whether text was allocated by the shell and must be freed.
+} HistoryEntry;
+
+// Posting list of the history search index: the commands containing one trigram.
+typedef struct
+{
+    uint32_t key;      // The trigram's three bytes plus 1; 0 marks a free slot.
+    uint32_t count;    // Number of serials.
+    uint32_t cap;      // Allocated size of serials.
+    uint32_t *serials; // Serial numbers of the commands containing the trigram, ascending.
+} TrigramPosting;
+
+// Trigram index over the history ring, built on the first Ctrl-R search and kept up to date as
+// commands are added. Commands are known by serial number: command number N (1 is the most
+// recent) has serial top - N + 1. Postings of evicted commands stay until the next rebuild.
+typedef struct
+{
+    TrigramPosting *slots; // Open-addressing table of posting lists.
+    size_t num_slots;      // Size of slots; a power of two, or 0 while the index is not built.
+    size_t used;           // Number of slots in use.
+    unsigned long top;     // Serial of the most recent command.
+    unsigned long indexed; // Commands added since the index was built.
+} HistoryIndex;
+
+// Line being edited at the interactive prompt.
+typedef struct
+{
+    char *buf;     // Text, NUL-terminated.
+    size_t len;    // Length of the text.
+    size_t cap;    // Allocated size of buf.
+    size_t cursor; // Byte offset of the cursor.
+} EditLine;
+
+// Growable list of names, used for completion candidates.
+typedef struct
+{
+    char **names; // Heap copies of the names.
+    int count;    // Number of names.
+    int cap;      // Allocated size of names.
+} Completion;
+
+// Keys of the line editor beyond single bytes, decoded from escape sequences.
+typedef enum
+{
+    KEY_LEFT = 1000,
+    KEY_RIGHT,
+    KEY_UP,
+    KEY_DOWN,
+    KEY_HOME,
+    KEY_END,
+    KEY_DELETE
+} EditorKey;
+
+#define CTRL_KEY(c) ((c) & 0x1f)
 
 // Global variables for managing command history and local variables.
-char **history;                     // Dynamically allocated array of strings to store command history.
+HistoryEntry *history = NULL;       // Circular buffer of history entries, allocated on first use.
+int history_head = 0;               // Index of the oldest entry in the buffer.
 int current_history_count = 0;      // Current number of commands in the history.
 int history_capacity = MAX_HISTORY; // Maximum number of commands history can hold.
 bool add_to_history_enabled = true; // Flag to enable/disable adding commands to history.
+HistoryIndex history_index;         // Trigram index for Ctrl-R search.
+EditLine edit_line;                 // Line being edited at the prompt.
+Completion path_commands;           // Commands on PATH, listed for completion.
+char *path_commands_path = NULL;    // PATH that path_commands was listed from.
+
+int history_file_fd = -1;        // Append-only descriptor of the history file, or -1.
+const char *history_map = NULL;  // Read-only mapping of the history file as it was at startup.
+size_t history_map_size = 0;     // Size of that mapping.
+size_t history_file_floor = 0;   // Offset of the oldest mapped line loaded into the ring.
+bool history_file_contiguous = false; // Whether the ring still starts with mapped lines ending at history_file_floor.
+
+LaunchBackend launch_backend = LAUNCH_SPAWN; // Backend used to start external commands.
 
-// Structure to represent a local variable with a name and a value.
+Job **job_table = NULL;   // Jobs by number - 1; NULL marks a free number.
+int job_table_size = 0;   // Number of slots in job_table.
+bool parse_quiet = false;       // Whether parse_line() keeps its syntax errors to itself.
+bool interactive_shell = false; // Whether commands come from the user rather than a batch file.
+bool job_control = false; // Whether jobs get their own process group and the terminal.
+int coproc_in = -1;  // Shell's end of the pipe into the coprocess, or -1 if there is none.
+int coproc_out = -1; // Shell's end of the pipe out of the coprocess.
+sigset_t child_sigmask;   // Signal mask launched commands start with.
+sigset_t child_sigdefault; // Signals the shell ignores that launched commands must not.
+int profile_fd = -1;      // Append-only descriptor of the WSH_PROFILE trace, or -1.
+int server_conn = -1;     // In a server child: the connection its "exit N" reply goes to, or -1.
+pid_t server_conn_owner;  // The server child that owns server_conn; its own children never reply.
+int last_status = 0;          // Exit status of the last pipeline, as '$?'.
+int *pipe_status = NULL;      // Exit status of each stage of the last pipeline, as '$PIPESTATUS'.
+int pipe_status_count = 0;    // Number of entries in pipe_status.
+int pipe_status_cap = 0;      // Allocated size of pipe_status.
+unsigned long pipe_status_serial = 0; // Bumped whenever a job records pipe_status.
+
+PathCacheEntry *path_cache[PATH_CACHE_BUCKETS]; // Hash table of resolved command paths, chained per bucket.
+MemoCache memo_cache; // Results of commands run with the 'memo' prefix.
+char *memo_ttl_reported = NULL; // Last invalid WSH_MEMO_TTL reported, so each is reported once.
+
+Arena line_arena; // Holds the parsed form of the line being executed.
+ShellStats stats; // Allocation and memory counters for WSH_STATS.
+DirListing dir_cache[DIR_CACHE_SLOTS]; // Directory listings reused by pathname expansion.
+
+// Structure to represent a variable with a name and a value. Both are heap strings sized to fit;
+// the value buffer is reused when a new value fits in it.
+typedef struct
+{
+    char *name;        // Variable name, owned by the entry.
+    char *value;       // Current value, owned by the entry.
+    size_t value_cap;  // Size of the value buffer.
+    unsigned int hash; // Hash of the name, kept for rehashing.
+    bool live;         // False once the variable has been unset.
+} VarEntry;
+
+// Hash-indexed variable store. Entries sit in a dense array in insertion order, which is what
+// 'vars' prints; an open-addressing index with linear probing maps names to entries.
 typedef struct
 {
-    char name[MAX_LINE_LENGTH];
-    char value[MAX_LINE_LENGTH];
-} LocalVar;
+    VarEntry *entries; // Entries in insertion order, including unset ones awaiting compaction.
+    int count;         // Number of entries used in the array.
+    int live;          // Number of entries that are still set.
+    int capacity;      // Allocated size of the entry array.
+    int *slots;        // Index: entry number + 1, 0 for an empty slot, -1 for a tombstone.
+    int num_slots;     // Size of the index; always a power of two.
+    int tombstones;    // Number of tombstone slots in the index.
+} VarTable;
 
-LocalVar localVars[MAX_LOCAL_VARS]; // Array to store local variables.
-int localVarCount = 0;              // Current number of local variables stored.
+VarTable local_vars; // Table of local (shell) variables.
+VarTable env_vars;   // The shell's copy of the environment, loaded on first use (see env_table()).
+bool env_loaded = false;
+unsigned long env_generation = 0; // Bumped by every change to env_vars.
+char **env_snapshot_envp = NULL;  // envp built from env_vars, shared by every launch.
+unsigned long env_snapshot_generation = 0; // env_generation the snapshot was built at.
 
 // Function prototypes for processing and executing commands, managing history and local variables.
-void process_input(char *input, char *argv[], int *background);             // Parses input into command arguments.
-void execute_command(char *argv[], int background);                         // Executes a given command.
+Pipeline *parse_line(const char *input, Arena *arena);                      // Lexes and parses a line into a pipeline list.
+Pipeline *parse_new_pipeline(Pipeline *prev, ListOp op, Arena *arena);      // Starts the next pipeline of a list.
+Pipeline *parse_timed(const char *input);                                   // Parses a line into the line arena, timing it.
+void parse_error(const char *format, ...);                                  // Reports a syntax error.
+bool lex_word(const char **src, char **dst);                                // Lexes one word, handling quotes.
+char **prepare_argv(Command *cmd);                                          // Expands a command's words into its argv.
+Command *command_new(Arena *arena);                                         // Allocates an empty command.
+void command_add_word(Command *cmd, char *word, Arena *arena);              // Appends a word to a command.
+void pipeline_add_command(Pipeline *pipeline, Command *cmd, Arena *arena);  // Appends a command to a pipeline.
+void **small_vec_push(void **items, int count, int *cap, Arena *arena);     // Makes room for one more vector entry.
+void remove_quote_escapes(char *word);                                      // Strips lexer quote markers from a word.
+bool word_is_pattern(const char *word);                                     // Tells whether a word has unquoted glob characters.
+bool glob_has_meta(const char *text, size_t len);                           // Tells whether part of a pattern has active glob characters.
+void glob_word(Command *cmd, const char *pattern);                          // Appends the paths a pattern matches to a command.
+void glob_walk(Command *cmd, char *path, size_t len, const char *rest);    // Matches the rest of a pattern below a directory.
+DirListing *dir_listing(const char *path);                                  // Reads a directory, or reuses its listing.
+bool open_redirects(Command *cmd, char *argv[], LaunchSpec *spec);          // Opens a command's redirection targets.
+int start_process_substitution(Redirect *redir);                           // Starts the command of '<(cmd)' or '>(cmd)'.
+int proc_marker(const char *word, char *paths[]);                           // Recognises a process substitution marker.
+const char *parse_substitution(const char *p);                             // Finds the ')' closing a '(' in a line.
+void close_redirects(LaunchSpec *spec);                                     // Closes the shell's copies of redirections.
+int redirect_shell(const LaunchSpec *spec, FdMove saved[]);                 // Applies redirections to the shell itself.
+void restore_shell_fds(FdMove saved[], int count);                          // Undoes redirect_shell().
+int open_cat_input(Command *cmd, char *argv[]);                             // Opens the file of a 'cat file' stage.
+int run_builtin_in_shell(const Builtin *builtin, char *argv[], Command *cmd, LaunchSpec *spec); // Runs a built-in with its plumbing.
+pid_t fork_builtin(const Builtin *builtin, char *argv[], const LaunchSpec *spec); // Runs a built-in as a pipeline stage.
+void apply_launch_spec(const LaunchSpec *spec);                             // Sets up a forked child's descriptors.
+bool apply_launch_attrs(const LaunchAttrs *attrs);                          // Applies 'with' settings to this process.
+bool launch_attrs_set(LaunchAttrs *attrs, char *setting);                   // Parses one 'with' setting.
+bool parse_cpu_list(const char *text, cpu_set_t *set);                      // Parses a CPU list such as 0-3,8.
+int execute_pipeline(Pipeline *pipeline, const Builtin *builtin);          // Executes one pipeline of a list.
+int execute_command(Pipeline *pipeline);                                    // Executes a single-command pipeline.
 int built_in_command(char *argv[]);                                         // Checks and executes built-in commands.
+const Builtin *find_builtin(const char *name);                              // Looks up a built-in command by name.
+int run_builtin(const Builtin *builtin, char *argv[]);                      // Validates and runs a built-in command.
 void print_history();                                                       // Displays the command history.
 void add_to_history(const char *cmd);                                       // Adds a command to the history.
 void set_history_size(int size);                                            // Adjusts the size of the command history.
 void execute_history_command(int command_number);                           // Executes a command from the history.
-void execute_piped_commands(char **commands, int num_cmds, int background); // Executes piped commands.
+HistoryEntry *history_at(int command_number);                               // Returns the Nth most recent history entry.
+void init_history_file(const char *path);                                   // Loads and opens the persistent history file.
+bool history_reserve();                                                     // Allocates the history ring on first use.
+int history_backfill(HistoryEntry *entries, int wanted);                    // Collects older commands from the history file.
+int history_search(const char *query, int after);                           // Finds an older command containing a string.
+void history_index_build();                                                 // Builds the trigram index of the history.
+void history_index_add(const char *text, size_t len);                      // Indexes the newest history entry.
+TrigramPosting *history_index_slot(uint32_t key, bool create);              // Finds the posting list of a trigram.
+void history_index_reset();                                                 // Drops the trigram index.
+uint32_t trigram_key(const char *text);                                     // Packs three bytes into a trigram key.
+
+// Interactive line editor.
+bool editor_available();                                                    // Checks whether the prompt is on a capable terminal.
+char *editor_read_line(const char *prompt);                                 // Reads a line in raw mode with editing.
+int editor_read_key();                                                      // Reads one key, decoding escape sequences.
+void editor_refresh(const char *prompt, const EditLine *line);              // Redraws the prompt and the line.
+size_t editor_columns(const char *text, size_t len);                        // Counts the columns UTF-8 text takes.
+size_t editor_next(const EditLine *line, size_t pos);                       // Moves to the next character.
+size_t editor_prev(const EditLine *line, size_t pos);                       // Moves to the previous character.
+void editor_set(EditLine *line, const char *text, size_t len);              // Replaces the line being edited.
+void editor_insert(EditLine *line, const char *text, size_t len);           // Inserts text at the cursor.
+void editor_delete(EditLine *line, size_t from, size_t to);                 // Deletes a range of the line.
+bool editor_search(EditLine *line);                                         // Runs Ctrl-R incremental search.
+void editor_complete(EditLine *line, bool list);                            // Completes the word before the cursor.
+void completion_add(Completion *found, const char *name, const char *prefix, bool is_dir); // Adds a matching candidate.
+void completion_load_commands();                                            // Lists the commands on PATH.
+int compare_strings(const void *a, const void *b);                          // qsort() comparator for strings.
+int execute_piped_commands(Pipeline *pipeline);                             // Executes piped commands.
+long pipe_buffer_size();                                                    // Reads the WSH_PIPE_SIZE setting.
+const char *shell_setting(const char *name);                                // Reads a local or environment setting.
+long parse_size(const char *value);                                         // Parses a byte count with a K/M/G suffix.
 void parse_and_execute(char *input);                                        // Parses and executes an input command.
+void execute_parsed(char *input, Pipeline *pipeline);                       // Executes a parsed line.
 void set_local_var(char *name, char *value);                                // Sets a local variable.
-void substitute_variable(char **arg);                                       // Substitutes variables in a command argument.
+unsigned int hash_string(const char *str);                                  // Hashes a string (FNV-1a).
+VarEntry *var_table_find(VarTable *table, const char *name);                // Looks up a variable.
+VarEntry *var_table_lookup(VarTable *table, const char *name, size_t len);  // Looks up a variable by a name that is not NUL-terminated.
+void var_table_set(VarTable *table, const char *name, const char *value);   // Sets or adds a variable.
+void var_table_unset(VarTable *table, const char *name);                    // Removes a variable.
+void var_table_rebuild(VarTable *table, int num_slots);                     // Compacts entries and rebuilds the index.
+void expand_word(char **word, bool pattern);                                // Expands variables and removes quote markers in a word.
+const char *lookup_variable(const char *name, size_t len);                  // Value of a variable as expansion sees it.
+char *command_substitution(const char *text, size_t len, size_t *out_len);  // Runs '$(cmd)' and captures its output.
+const char *special_variable(const char *name, size_t len);                 // Value of '$?' or '$PIPESTATUS'.
+VarTable *env_table();                                                      // The shell's indexed copy of the environment.
+const char *env_value(const char *name);                                    // Value of an environment variable.
+char **env_snapshot();                                                      // envp for launched commands.
 bool isValidCommand(char *argv[]);                                          // Checks if a command is valid.
 void substitute_variables_in_command(char *argv[]);                         // Substitutes variables in all command arguments.
 bool isBuiltInCommand(char *command);                                       // Checks if a command is a built-in command.
+void init_launch_backend();                                                 // Selects the launch backend from WSH_LAUNCH.
+pid_t launch_process(char *argv[], const LaunchSpec *spec);                 // Starts an external command.
+pid_t spawn_process(const char *path, char *argv[], const LaunchSpec *spec); // Launch backend built on posix_spawn.
+pid_t fork_process(const char *path, char *argv[], const LaunchSpec *spec);  // Launch backend built on fork + execv.
+const char *resolve_command(const char *name);                              // Finds a command's binary via the PATH cache.
+unsigned int path_cache_bucket(const char *name);                           // Hashes a command name to a bucket.
+PathCacheEntry *path_cache_lookup(const char *name, bool insert);           // Looks up or inserts a PATH cache entry.
+void path_cache_forget(const char *name);                                   // Drops one command from the PATH cache.
+void path_cache_clear();                                                    // Empties the PATH cache.
+int execute_memoized(Pipeline *pipeline);                                   // Runs a command through the memo cache.
+char *memo_key(char *argv[], size_t *len);                                  // Builds the memo cache key of a command.
+MemoEntry *memo_lookup(const char *key, size_t len, unsigned int hash);     // Finds a live memo cache entry.
+void memo_store(char *key, size_t len, unsigned int hash, char *output, size_t size, int status); // Caches a result.
+void memo_unlink(MemoEntry *entry);                                         // Takes an entry off the use list.
+long memo_max_bytes();                                                      // Reads the WSH_MEMO_SIZE setting.
+long memo_ttl();                                                            // Reads the WSH_MEMO_TTL setting.
+bool write_all(int fd, const char *data, size_t len);                       // Writes a buffer, retrying short writes.
+void memo_evict(MemoEntry *entry);                                          // Removes and frees a memo cache entry.
+unsigned int hash_bytes(const char *data, size_t len);                      // Hashes a byte string (FNV-1a).
+bool batch_reader_open(BatchReader *reader, const char *path);              // Opens a batch file for reading.
+char *batch_reader_next(BatchReader *reader, size_t *len);                  // Returns the next line of a batch file.
+void batch_reader_close(BatchReader *reader);                               // Releases a batch file reader.
+void run_batch_file(const char *path, int max_jobs, bool ordered, bool pin, bool compiled); // Executes every line of a batch file.
+void batch_pin_init(BatchScheduler *sched);                                 // Lists the CPUs batch jobs may be pinned to.
+int batch_pick_cpu(BatchScheduler *sched);                                  // Chooses the CPU for the next batch job.
+bool compiled_script_open(const char *path, CompiledScript *script);        // Loads a script's up-to-date compiled form.
+bool compile_script(const char *path, CompiledScript *script);              // Compiles a script and caches the result.
+char *compiled_script_next(CompiledScript *script, Pipeline **pipeline);    // Decodes the next line of a compiled script.
+void compiled_script_close(CompiledScript *script);                         // Releases a compiled script.
+void compile_pipeline(FILE *out, const char *line, const Pipeline *pipeline); // Encodes a parsed pipeline list.
+void compile_string(FILE *out, const char *str);                            // Encodes a string.
+uint32_t compiled_number(CompiledScript *script, size_t width);             // Decodes a number.
+char *compiled_string(CompiledScript *script);                              // Decodes a string in place.
+bool compiled_path(const char *path, char *cache, size_t size);             // Names the cache file of a script.
+bool compiled_script_check(CompiledScript *script, uint32_t num_lines);     // Decodes every record once to validate it.
+bool batch_first_word(const char *line, char *buf, size_t size);            // Extracts the first word of a batch line.
+void batch_schedule_line(BatchScheduler *sched, char *line, Pipeline *pipeline); // Runs one batch line under the scheduler.
+bool batch_list_is_barrier(const Pipeline *pipeline);                       // Whether a batch line runs a shell built-in.
+void batch_reap_one(BatchScheduler *sched);                                 // Waits for any running batch job.
+void batch_barrier(BatchScheduler *sched);                                  // Waits for all running batch jobs.
+void init_job_control(bool interactive);                                    // Installs the reaper and takes the terminal.
+void sigchld_handler(int sig);                                              // Reaps children without blocking.
+void job_update(pid_t pid, int status, const struct rusage *usage);         // Records a wait status in the job table.
+void block_child_signals(sigset_t *saved);                                  // Holds SIGCHLD while the job table changes.
+Job *job_create(const char *command, bool background, int max_procs);       // Adds a job to the table.
+JobProcess *job_add_process(Job *job, pid_t pid, const char *name);         // Records a started process of a job.
+void job_remove(Job *job);                                                  // Removes a job from the table.
+void job_table_reset();                                                     // Forgets every job (in forked children).
+bool job_is_done(const Job *job);                                           // Whether every process has exited.
+bool job_is_stopped(const Job *job);                                        // Whether every live process is stopped.
+int job_status(const Job *job);                                             // Exit status of a job's last process.
+int job_launched(Job *job);                                                 // Announces or waits for a new job.
+void job_record_status(const Job *job);                                     // Sets '$PIPESTATUS' from a finished job.
+bool pipe_status_reserve(int count);                                        // Grows pipe_status to hold count entries.
+int wait_status_code(int status);                                           // Converts a wait status to an exit status.
+int job_wait_foreground(Job *job);                                          // Gives a job the terminal and waits for it.
+void job_wait(Job *job);                                                    // Sleeps until a job exits or stops.
+Job *job_wait_batch();                                                      // Sleeps until a batch scheduler job exits.
+void job_signal(Job *job, int sig);                                         // Sends a signal to every process of a job.
+void job_notify();                                                          // Reports and drops finished background jobs.
+void job_print(const Job *job);                                             // Prints one line of a job listing.
+Job *job_current(bool stopped_only);                                        // Most recent job fg or bg acts on.
+Job *job_from_spec(const char *command, const char *spec);                  // Resolves '%n' or a PID to a job.
+Job *job_for_pipeline(Pipeline *pipeline, int max_procs);                   // Creates the job that runs a pipeline.
+int run_stage_in_shell(const Builtin *builtin, char *argv[], Command *cmd, LaunchSpec *spec, JobProcess *proc); // Runs and measures an in-shell stage.
+void init_profile();                                                        // Opens the WSH_PROFILE trace file.
+int startup_probe();                                                        // Prints the time at which the process started.
+int startup_bench(int runs);                                                // Measures time to first exec of a batch run.
+long startup_run(char *const argv[], long *first_exec_ns);                  // Times one run for startup_bench().
+int compare_long(const void *a, const void *b);                             // qsort() comparator for longs.
+int run_server(const char *path);                                           // Serves scripts over a UNIX socket.
+void server_handle_client(int conn);                                        // Runs one client's script in a forked shell.
+void server_reply();                                                        // Sends a client its script's exit status.
+int run_client(const char *path, const char *script);                       // Runs a script on a wsh server.
+void job_report(const Job *job);                                            // Prints 'time' output and profile records.
+void json_write_string(FILE *out, const char *str);                         // Writes a JSON string literal.
+long elapsed_ns(const struct timespec *from, const struct timespec *to);    // Difference of two timestamps.
+long timeval_us(const struct timeval *tv);                                  // Converts a timeval to microseconds.
+void batch_emit_ready(BatchScheduler *sched);                               // Replays finished output in order.
+void *arena_alloc(Arena *arena, size_t size);                               // Allocates memory from an arena.
+ArenaMark arena_mark(Arena *arena);                                         // Records an arena's current position.
+void arena_release(Arena *arena, ArenaMark mark);                           // Frees everything allocated after a mark.
+char *arena_strdup(Arena *arena, const char *str);                          // Copies a string into an arena.
+char *arena_strndup(Arena *arena, const char *str, size_t len);             // Copies part of a string into an arena.
+void init_stats();                                                          // Enables the WSH_STATS counters.
+void report_stats();                                                        // Prints the WSH_STATS counters.
+long current_rss_kb();                                                      // Reads the shell's resident set size.
+int count_open_fds();                                                       // Counts the shell's open descriptors.
 
 // Handlers for built-in commands.
-void cmd_cd(char *path);                  // Changes the current directory.
+int cmd_cd(char *path);                   // Changes the current directory.
 void cmd_exit(char *argv[]);              // Exits the shell.
 void cmd_history_control(char *argv[]);   // Manages history commands.
-void cmd_export(char *name, char *value); // Sets an environment variable.
-void cmd_local(char *name, char *value);  // Sets a local variable.
+int cmd_export(char *name, char *value);  // Sets an environment variable.
+int cmd_local(char *name, char *value);   // Sets a local variable.
 void cmd_vars();                          // Displays all local variables.
+void cmd_hash(char *argv[]);              // Lists, fills or resets the PATH lookup cache.
+
+// Dispatch-table adapters around the handlers, and argument validators.
+int builtin_cd(char *argv[]);           // Runs 'cd'.
+int builtin_exit(char *argv[]);         // Runs 'exit'.
+int builtin_history(char *argv[]);      // Runs 'history'.
+int builtin_export(char *argv[]);       // Runs 'export'.
+int builtin_local(char *argv[]);        // Runs 'local'.
+int builtin_vars(char *argv[]);         // Runs 'vars'.
+int builtin_hash(char *argv[]);         // Runs 'hash'.
+bool validate_cd(char *argv[]);         // 'cd' takes exactly one directory.
+bool validate_exit(char *argv[]);       // 'exit' takes no arguments.
+bool validate_assignment(char *argv[]); // 'export' and 'local' take a single VAR=value.
+bool validate_history(char *argv[]);    // 'history' takes nothing, a number, or 'set <size>'.
+bool validate_hash(char *argv[]);       // 'hash' takes '-r' alone or command names.
+int builtin_jobs(char *argv[]);         // Lists jobs.
+int builtin_wait(char *argv[]);         // Waits for background jobs.
+int builtin_fg(char *argv[]);           // Moves a job to the foreground.
+int builtin_bg(char *argv[]);           // Resumes a stopped job in the background.
+int builtin_coproc(char *argv[]);       // Starts or ends the coprocess.
 
+// Utilities run inside the shell instead of being launched.
+int builtin_echo(char *argv[]);                       // Prints its arguments.
+int builtin_printf(char *argv[]);                     // Formats and prints its arguments.
+int printf_format(const char *format, char ***args); // Prints one pass over a printf format.
+const char *printf_escape(const char *p);             // Prints one backslash escape sequence.
+int builtin_true(char *argv[]);                       // Succeeds.
+int builtin_false(char *argv[]);                      // Fails.
+int builtin_test(char *argv[]);                       // Evaluates a 'test' or '[' expression.
+int test_expression(int argc, char *argv[]);          // Evaluates test operands by count.
+int test_unary(const char *op, const char *operand);  // Evaluates a unary test operator.
+int test_binary(const char *left, const char *op, const char *right); // Evaluates a binary test operator.
+bool test_is_binary(const char *op);                  // Tells whether a word is a binary test operator.
+int test_integer_op(const char *op);                  // Finds an integer comparison operator.
+int builtin_pwd(char *argv[]);                        // Prints the working directory.
+
+// Dispatch table of built-in commands, indexed by BuiltinId.
+const Builtin builtins[NUM_BUILTINS] = {
+    [BUILTIN_CD] = {"cd", builtin_cd, validate_cd},
+    [BUILTIN_EXIT] = {"exit", builtin_exit, validate_exit},
+    [BUILTIN_HISTORY] = {"history", builtin_history, validate_history},
+    [BUILTIN_EXPORT] = {"export", builtin_export, validate_assignment},
+    [BUILTIN_LOCAL] = {"local", builtin_local, validate_assignment},
+    [BUILTIN_VARS] = {"vars", builtin_vars, NULL},
+    [BUILTIN_HASH] = {"hash", builtin_hash, validate_hash},
+    [BUILTIN_JOBS] = {"jobs", builtin_jobs, NULL},
+    [BUILTIN_WAIT] = {"wait", builtin_wait, NULL},
+    [BUILTIN_FG] = {"fg", builtin_fg, NULL},
+    [BUILTIN_BG] = {"bg", builtin_bg, NULL},
+    [BUILTIN_ECHO] = {"echo", builtin_echo, NULL, true},
+    [BUILTIN_PRINTF] = {"printf", builtin_printf, NULL, true},
+    [BUILTIN_TRUE] = {"true", builtin_true, NULL, true},
+    [BUILTIN_FALSE] = {"false", builtin_false, NULL, true},
+    [BUILTIN_TEST] = {"test", builtin_test, NULL, true},
+    [BUILTIN_BRACKET] = {"[", builtin_test, NULL, true},
+    [BUILTIN_PWD] = {"pwd", builtin_pwd, NULL, true},
+    [BUILTIN_COPROC] = {"coproc", builtin_coproc, NULL},
+};
+
+#ifndef WSH_FUZZ
 /**
  * Entry point of the shell program.
  *
@@ -66,66 +780,122 @@ void cmd_vars();                          // Displays all local variables.
  */
 int main(int argc, char *argv[])
 {
-    char input[MAX_LINE_LENGTH]; // Buffer to hold user input.
-    // Allocate memory for storing command history.
-    history = malloc(history_capacity * sizeof(char *));
-    // Check for memory allocation failure.
-    if (!history)
+    char *input = NULL;          // Buffer to hold user input, grown by getline().
+    size_t input_cap = 0;        // Allocated size of input.
+    int max_jobs = 1;            // Number of batch lines allowed to run at once.
+    bool ordered = false;        // Whether parallel batch output keeps submission order.
+    bool pin = false;            // Whether parallel batch jobs are pinned to CPUs in turn.
+
+    // Startup measurement modes; see startup_bench().
+    if (argc == 2 && strcmp(argv[1], "--startup-probe") == 0)
     {
-        perror("Failed to allocate memory for history");
-        return 1;
+        return startup_probe();
     }
-    // Initialize history array with NULL.
-    for (int i = 0; i < history_capacity; i++)
+    if (argc >= 2 && strcmp(argv[1], "--startup-bench") == 0)
     {
-        history[i] = NULL;
+        return startup_bench(argc > 2 ? atoi(argv[2]) : 200);
     }
 
-    // Check for batch file mode.
-    if (argc == 2)
+    // Server mode and its client; see run_server().
+    if (argc >= 3 && argc <= 4 && strcmp(argv[1], "--client") == 0)
+    {
+        return run_client(argv[2], argc == 4 ? argv[3] : NULL);
+    }
+
+    // Nothing else is allocated up front: the history ring appears with its first command, and
+    // batch mode never sets up the prompt.
+    init_launch_backend(); // Pick how external commands are started.
+    init_stats();          // Start counting if WSH_STATS is set.
+    init_profile();        // Trace every command if WSH_PROFILE is set.
+    if (argc == 3 && strcmp(argv[1], "--serve") == 0)
     {
-        FILE *batchFile = fopen(argv[1], "r"); // Try to open the batch file.
-        if (!batchFile)
+        init_job_control(false); // Reap children; clients never get the terminal.
+        return run_server(argv[2]);
+    }
+
+    // Parse options: '-j N' runs up to N batch lines at once, '-k' keeps their output in order,
+    // '-P' pins each of them to a CPU, '-C' runs the batch file from its compiled form.
+    int opt;
+    bool compiled = false; // Whether '-C' asked for the compiled script cache.
+    while ((opt = getopt(argc, argv, "+j:kPC")) != -1)
+    {
+        if (opt == 'j' && atoi(optarg) > 0)
         {
-            perror("Error opening batch file");
-            exit(-1);
+            max_jobs = atoi(optarg);
         }
-
-        // Read and execute commands from the batch file.
-        while (fgets(input, MAX_LINE_LENGTH, batchFile) != NULL)
+        else if (opt == 'k')
         {
-            if (input[strlen(input) - 1] == '\n')
-            {
-                input[strlen(input) - 1] = '\0'; // Remove newline character.
-            }
-            parse_and_execute(input);
+            ordered = true;
+        }
+        else if (opt == 'P')
+        {
+            pin = true;
         }
+        else if (opt == 'C')
+        {
+            compiled = true;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-j jobs [-k] [-P]] [-C] [batch file]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Reap children as they exit; interactive sessions on a terminal also get job control.
+    init_job_control(argc == optind);
 
-        fclose(batchFile);
-        exit(EXIT_SUCCESS);
+    // Check for batch file mode.
+    if (argc - optind == 1)
+    {
+        run_batch_file(argv[optind], max_jobs, ordered, pin, compiled);
+        exit(last_status);
     }
-    else if (argc > 2) // Incorrect usage of the program.
+    else if (argc - optind > 1 || max_jobs > 1 || ordered || pin || compiled) // Incorrect usage of the program.
     {
-        fprintf(stderr, "Usage: %s [batch file]\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-j jobs [-k] [-P]] [-C] [batch file]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // Interactive mode: read and execute commands from stdin.
+    // Interactive sessions keep their history across restarts when WSH_HISTFILE names a file.
+    const char *histfile = getenv("WSH_HISTFILE");
+    if (histfile != NULL && *histfile != '\0')
+    {
+        init_history_file(histfile);
+    }
+
+    // Interactive mode: read and execute commands from stdin, with line editing on a terminal.
+    bool editing = editor_available();
     while (1)
     {
+        job_notify(); // Report background jobs that finished since the last prompt.
+        if (editing)
+        {
+            char *line = editor_read_line("wsh> ");
+            if (line == NULL)
+            {
+                exit(last_status);
+            }
+            if (*line != '\0')
+            {
+                parse_and_execute(line);
+            }
+            continue;
+        }
         printf("wsh> ");
         fflush(stdout);
-        if (!fgets(input, MAX_LINE_LENGTH, stdin))
+        if (getline(&input, &input_cap, stdin) < 0)
         {
-            if (feof(stdin)) // Check for end of input.
+            if (!feof(stdin) && errno == EINTR)
             {
-                exit(0);
+                clearerr(stdin); // A child changed state while we waited; prompt again.
+                continue;
             }
-            else
+            if (!feof(stdin))
             {
-                perror("fgets error");
-                continue;
+                perror("read error");
             }
+            exit(last_status); // End of input, or input that can no longer be read.
         }
 
         if (strcmp(input, "\n") == 0) // Ignore empty lines.
@@ -137,793 +907,8042 @@ int main(int argc, char *argv[])
     // Cleanup: free allocated memory for command history.
     for (int i = 0; i < current_history_count; i++)
     {
-        free(history[i]);
+        HistoryEntry *entry = &history[(history_head + i) % history_capacity];
+        if (entry->owned)
+        {
+            free((char *)entry->text);
+        }
     }
     free(history);
     return 0;
 }
-
+#else
 /**
- * Parses the input string into command arguments.
+ * Sets up the variables the fuzzer's words expand: one empty, one with blanks and glob characters.
  *
- * @param input The input string to be parsed.
- * @param argv Array to store the parsed arguments.
- * @param background Pointer to an integer to indicate background execution.
+ * @param argc Unused.
+ * @param argv Unused.
+ * @return Always 0.
  */
-void process_input(char *input, char *argv[], int *background)
+int LLVMFuzzerInitialize(int *argc, char ***argv)
 {
-    char *token = strtok(input, " \n"); // Tokenize the input.
-    int index = 0;                      // Index for storing arguments.
-
-    // Loop through all tokens and add them to argv.
-    while (token != NULL && index < MAX_ARGS - 1)
-    {
-        argv[index++] = token;
-        token = strtok(NULL, " \n");
-    }
-    argv[index] = NULL; // Null-terminate the argument list.
-
-    // Check for background execution flag '&'.
-    if (index > 0 && strcmp(argv[index - 1], "&") == 0)
-    {
-        *background = 1;      // Set background execution flag.
-        argv[--index] = NULL; // Remove '&' from arguments.
-    }
+    (void)argc;
+    (void)argv;
+    set_local_var("E", "");
+    set_local_var("V", "a b*c?[d] $E");
+    return 0;
 }
 
 /**
- * Executes a command.
+ * Compares a parsed line with its decoded copy: the same pipelines, commands, words and
+ * redirections.
  *
- * @param argv Array containing command and arguments.
- * @param background Integer indicating if the command should run in the background.
+ * @param a The parsed line, or NULL.
+ * @param b The decoded line, or NULL.
+ * @return True if they match.
  */
-void execute_command(char *argv[], int background)
+bool fuzz_same_pipelines(const Pipeline *a, const Pipeline *b)
 {
-    char *filtered_argv[MAX_ARGS]; // Array for filtered arguments after substitution.
-    int filtered_index = 0;        // Index for filtered arguments.
-
-    // Perform variable substitution for each argument.
-    for (int i = 0; argv[i] != NULL; i++)
-    {
-        substitute_variable(&argv[i]);
-    }
-
-    // Copy non-empty strings to filtered_argv.
-    for (int i = 0; argv[i] != NULL; i++)
-    {
-        if (strcmp(argv[i], "") != 0)
-        {
-            filtered_argv[filtered_index++] = argv[i];
-        }
-    }
-    filtered_argv[filtered_index] = NULL; // Terminate the filtered argument list.
-
-    // Validate the command after substitution.
-    if (!isValidCommand(filtered_argv))
-    {
-        printf("Error: Command validation failed.\n");
-        return; // Exit if the command is invalid.
-    }
-
-    pid_t pid = fork(); // Create a new process.
-    if (pid == 0)       // Child process.
-    {
-        // Execute the command with execvp.
-        if (execvp(filtered_argv[0], filtered_argv) == -1)
-        {
-            perror("execvp");
-            exit(-1);
-        }
-    }
-    else if (pid > 0) // Parent process.
+    for (; a != NULL && b != NULL; a = a->next, b = b->next)
     {
-        if (!background) // Wait for the child process if not running in background.
+        if (a->num_cmds != b->num_cmds || a->background != b->background || a->timed != b->timed ||
+            a->memo != b->memo || a->op != b->op)
         {
-            int status;
-            waitpid(pid, &status, 0);
+            return false;
         }
-        else
+        for (int i = 0; i < a->num_cmds; i++)
         {
-            printf("[PID %d running in background]\n", pid);
+            const Command *x = a->cmds[i];
+            const Command *y = b->cmds[i];
+            if (x->argc != y->argc || x->num_redirs != y->num_redirs || y->argv[y->argc] != NULL)
+            {
+                return false;
+            }
+            for (int j = 0; j < x->argc; j++)
+            {
+                if (strcmp(x->argv[j], y->argv[j]) != 0)
+                {
+                    return false;
+                }
+            }
+            for (int j = 0; j < x->num_redirs; j++)
+            {
+                if (x->redirs[j].type != y->redirs[j].type || x->redirs[j].fd != y->redirs[j].fd ||
+                    strcmp(x->redirs[j].target, y->redirs[j].target) != 0)
+                {
+                    return false;
+                }
+            }
         }
     }
-    else // Fork failed.
-    {
-        perror("fork failed");
-        exit(-1);
-    }
-}
-
-/**
- * Checks and executes built-in commands such as exit, cd, history, export, local, and vars.
- *
- * @param argv Array of command and arguments.
- * @return Returns 1 if a built-in command is executed, 0 otherwise.
- */
-int built_in_command(char *argv[])
-{
-    // Handling 'exit' command.
-    if (strcmp(argv[0], "exit") == 0)
-    {
-        cmd_exit(argv); // Call the exit command handler.
-        return 1;
-    }
-    // Handling 'cd' command for changing directory.
-    else if (strcmp(argv[0], "cd") == 0)
-    {
-        cmd_cd(argv[1]); // Call the cd command handler with the directory path.
-        return 1;
-    }
-    // Handling 'history' command to display or set history size.
-    else if (strcmp(argv[0], "history") == 0)
-    {
-        cmd_history_control(argv); // Call the history command handler.
-        return 1;
-    }
-    // Handling 'export' command for setting environment variables.
-    else if (strcmp(argv[0], "export") == 0 && argv[1] != NULL)
-    {
-        char *name = strtok(argv[1], "=");
-        char *value = strtok(NULL, "");
-        cmd_export(name, value); // Call the export command handler with name and value.
-        return 1;
-    }
-    // Handling 'local' command for setting local (shell) variables.
-    else if (strcmp(argv[0], "local") == 0 && argv[1] != NULL)
-    {
-        char *name = strtok(argv[1], "=");
-        char *value = strtok(NULL, "");
-        cmd_local(name, value); // Call the local command handler with name and value.
-        return 1;
-    }
-    // Handling 'vars' command to list all local variables.
-    else if (strcmp(argv[0], "vars") == 0)
-    {
-        cmd_vars(); // Call the vars command handler.
-        return 1;
-    }
-    return 0; // Indicate that the command is not a built-in command.
+    return a == b; // Both ended together.
 }
 
 /**
- * Adds a command to the history, avoiding duplicates and managing history size.
+ * Fuzz target for 'make fuzz': parses the input as a line, encodes the result the way a compiled
+ * script stores it and decodes it again, then expands every word. The decoded line must match the
+ * parsed one. Command substitutions are not expanded, since they would run the input.
  *
- * @param cmd Command string to be added to the history.
+ * @param data The input; it ends at the first NUL byte, like a line would.
+ * @param size Length of the input.
+ * @return Always 0.
  */
-void add_to_history(const char *cmd)
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
-    // Ignore if history is disabled, or cmd is NULL, empty, or all whitespace.
-    if (!add_to_history_enabled || cmd == NULL || *cmd == '\0' || strspn(cmd, " \t\n\v\f\r") == strlen(cmd))
+    if (size > UINT16_MAX)
     {
-        return;
+        return 0; // Could hold more pipelines than a compiled line, which is then stored unparsed.
     }
+    ArenaMark mark = arena_mark(&line_arena);
+    char *line = arena_strndup(&line_arena, (const char *)data, size);
+    parse_quiet = true;
+    Pipeline *head = parse_line(line, &line_arena);
+    parse_quiet = false;
 
-    // Avoid adding if the last command in history is the same.
-    if (current_history_count > 0 && strcmp(history[current_history_count - 1], cmd) == 0)
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+    FILE *out = open_memstream(&encoded, &encoded_size);
+    compile_string(out, line);
+    compile_pipeline(out, line, head);
+    fclose(out);
+    CompiledScript script = {encoded, encoded_size, false, encoded, encoded + encoded_size, false};
+    Pipeline *decoded;
+    if (compiled_script_next(&script, &decoded) == NULL || script.pos != script.end ||
+        !fuzz_same_pipelines(head, decoded))
     {
-        return;
+        abort(); // The decoder rejected or changed what the encoder wrote.
     }
 
-    // Remove the oldest command if history is at capacity.
-    if (current_history_count == history_capacity)
+    for (Pipeline *pipeline = head; pipeline != NULL; pipeline = pipeline->next)
     {
-        free(history[0]);
-        memmove(history, history + 1, sizeof(char *) * (current_history_count - 1));
-        current_history_count--;
+        for (int i = 0; i < pipeline->num_cmds; i++)
+        {
+            Command *cmd = pipeline->cmds[i];
+            for (int j = 0; j < cmd->argc; j++)
+            {
+                if (strstr(cmd->argv[j], "$(") == NULL)
+                {
+                    expand_word(&cmd->argv[j], word_is_pattern(cmd->argv[j]));
+                }
+            }
+            for (int j = 0; j < cmd->num_redirs; j++)
+            {
+                if (cmd->redirs[j].type != REDIR_PROC_IN && cmd->redirs[j].type != REDIR_PROC_OUT &&
+                    strstr(cmd->redirs[j].target, "$(") == NULL)
+                {
+                    expand_word(&cmd->redirs[j].target, false);
+                }
+            }
+        }
     }
 
-    // Add the new command to history.
-    history[current_history_count++] = strdup(cmd);
+    free(encoded);
+    arena_release(&line_arena, mark);
+    return 0;
 }
+#endif
 
 /**
- * Sets the size of the command history buffer. This function allows dynamically adjusting
- * the number of commands that can be stored in the shell's history. If the new size is smaller
- * than the current number of commands in the history, the oldest commands are discarded. If the
- * new size is larger, the history capacity is increased.
+ * Lexes and parses a line in a single pass. The result is a list of pipelines, each a series of
+ * commands with their words and redirections, plus the background flag. Words are copied into
+ * the arena with their quotes removed; characters that were quoted and would otherwise be special
+ * during expansion are preceded by CTLESC. The input itself is not modified.
  *
- * @param newSize The new size for the command history buffer.
+ * Grammar: words separated by blanks, '|' between commands, '<', '>', '>>', optionally preceded
+ * by a descriptor number, before a file name. '<(cmd)' and '>(cmd)' are words naming a pipe from
+ * or to cmd; they are kept as a redirection holding cmd and a CTLPROC marker word that is
+ * replaced by the pipe's /dev/fd path at launch. Pipelines are separated by ';', '&&', '||' or '&',
+ * the last of which runs the pipeline before it in the background. Single quotes keep everything
+ * literal, double quotes and backslashes work as in sh.
+ *
+ * @param input The line to parse.
+ * @param arena Arena that receives every node and word of the result.
+ * @return The first pipeline of the list (with no commands for a blank line), or NULL after a
+ *         syntax error has been reported.
  */
-void set_history_size(int newSize)
+Pipeline *parse_line(const char *input, Arena *arena)
 {
-    // Validate the new size to ensure it's not negative.
-    if (newSize < 0)
-    {
-        fprintf(stderr, "Invalid history size.\n");
-        return; // Exit if the new size is invalid.
-    }
+    Pipeline *head = parse_new_pipeline(NULL, LIST_SEQ, arena);
+    Pipeline *pipeline = head;  // Pipeline receiving commands.
+    const char *start = input;  // Where the source text of that pipeline begins.
 
-    // Enable or disable adding commands to history based on the new size.
-    if (newSize == 0)
-    {
-        add_to_history_enabled = false; // Disable history if size is set to 0.
-    }
-    else
-    {
-        add_to_history_enabled = true; // Enable history for any size greater than 0.
-    }
+    // Cooked words can be at most twice as long as the input (one CTLESC per quoted character).
+    char *out = arena_alloc(arena, strlen(input) * 2 + 1);
+    const char *p = input;
+    Command *cmd = NULL;       // Command receiving words, or NULL right after a '|'.
+    Redirect *pending = NULL; // Redirection still waiting for its file name.
+    bool ended = false;       // Whether a list operator has closed the current pipeline.
+    ListOp next_op = LIST_SEQ; // Operator that closed it.
+    bool in_with = false;      // Whether words are 'with' settings, up to the '--'.
 
-    // If the current history count exceeds the new size, remove the oldest entries.
-    while (current_history_count > newSize)
+    while (true)
     {
-        free(history[0]); // Free the memory of the oldest command.
-        // Shift the remaining commands towards the beginning of the array.
-        for (int i = 1; i < current_history_count; i++)
+        p += strspn(p, " \t\r\n"); // Skip blanks between tokens.
+        if (*p == '\0')
         {
-            history[i - 1] = history[i];
+            break;
         }
-        current_history_count--; // Decrement the count to reflect the removed command.
-    }
 
-    // Attempt to reallocate the history array to match the new size.
-    char **temp = realloc(history, newSize * sizeof(char *));
-    if (!temp && newSize > 0) // Check for reallocation failure.
-    {
-        perror("Unable to resize history");
+        // List operators end the current pipeline: ';', '&&', '||' and a '&' that is not '&&'.
+        bool is_and_or = (p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|');
+        if (*p == ';' || *p == '&' || is_and_or)
+        {
+            if (pending != NULL || cmd == NULL || ended || in_with)
+            {
+                parse_error("syntax error near unexpected token '%.*s'", is_and_or ? 2 : 1, p);
+                return NULL;
+            }
+            pipeline->background = *p == '&' && !is_and_or;
+            next_op = !is_and_or ? LIST_SEQ : *p == '&' ? LIST_AND : LIST_OR;
+            const char *end = p + (pipeline->background ? 1 : 0); // Listings show the '&'.
+            while (end > start && strchr(" \t\r\n", end[-1]) != NULL)
+            {
+                end--;
+            }
+            pipeline->text = arena_strndup(arena, start, end - start);
+            p += is_and_or ? 2 : 1;
+            start = p + strspn(p, " \t\r\n");
+            cmd = NULL;
+            ended = true;
+            continue;
+        }
+
+        // The first token after a list operator starts the next pipeline.
+        if (ended)
+        {
+            pipeline = parse_new_pipeline(pipeline, next_op, arena);
+            ended = false;
+        }
+
+        // Pipe operator: ends the current command.
+        if (*p == '|')
+        {
+            if (pending != NULL || cmd == NULL || in_with)
+            {
+                parse_error("syntax error near unexpected token '|'");
+                return NULL;
+            }
+            cmd = NULL; // The next word starts a new pipeline stage.
+            p++;
+            continue;
+        }
+
+        // Open a new command for the first word or redirection of a stage.
+        if (cmd == NULL)
+        {
+            cmd = command_new(arena);
+            pipeline_add_command(pipeline, cmd, arena);
+        }
+
+        // Redirection operators: '<', '>', '>>', '<&m' and '>&m', each optionally preceded by a
+        // single digit.
+        const char *op = p;
+        int fd = -1;
+        if (*op >= '0' && *op <= '9' && (op[1] == '<' || op[1] == '>'))
+        {
+            fd = *op - '0';
+            op++;
+        }
+        if ((*op == '<' || *op == '>') && op[1] == '(' && fd < 0)
+        {
+            // Process substitution: the command runs in a subshell, so only its extent matters.
+            const char *close = parse_substitution(op + 1);
+            if (close == NULL)
+            {
+                parse_error("syntax error: unterminated '%.2s'", op);
+                return NULL;
+            }
+            if (cmd->num_redirs == MAX_REDIRECTS)
+            {
+                parse_error("too many redirections");
+                return NULL;
+            }
+            Redirect *redir = &cmd->redirs[cmd->num_redirs];
+            redir->type = *op == '<' ? REDIR_PROC_IN : REDIR_PROC_OUT;
+            redir->fd = STDIN_FILENO; // Unused: the pipe keeps its own descriptor number.
+            redir->target = arena_strndup(arena, op + 2, close - op - 2);
+            char *word = out;
+            *out++ = CTLPROC;
+            *out++ = '0' + cmd->num_redirs++;
+            *out++ = '\0';
+            if (pending != NULL)
+            {
+                pending->target = word; // 'cmd < <(producer)'.
+                pending = NULL;
+            }
+            else
+            {
+                command_add_word(cmd, word, arena);
+            }
+            p = close + 1;
+            continue;
+        }
+        if (*op == '<' || *op == '>')
+        {
+            if (pending != NULL)
+            {
+                parse_error("syntax error near unexpected token '%c'", *op);
+                return NULL;
+            }
+            if (cmd->num_redirs == MAX_REDIRECTS)
+            {
+                parse_error("too many redirections");
+                return NULL;
+            }
+            pending = &cmd->redirs[cmd->num_redirs++];
+            if (op[1] == '&' && op[2] == '$')
+            {
+                // Descriptor duplication from a variable, such as '>&$COPROC_IN': the word is
+                // expanded and checked at launch.
+                pending->type = REDIR_DUP;
+                pending->fd = fd >= 0 ? fd : *op == '<' ? STDIN_FILENO : STDOUT_FILENO;
+                p = op + 2;
+            }
+            else if (op[1] == '&')
+            {
+                // Descriptor duplication: the source is a number, not a word.
+                size_t digits = strspn(op + 2, "0123456789");
+                if (digits == 0)
+                {
+                    parse_error("syntax error: '%.2s' needs a descriptor number", op);
+                    return NULL;
+                }
+                pending->type = REDIR_DUP;
+                pending->fd = fd >= 0 ? fd : *op == '<' ? STDIN_FILENO : STDOUT_FILENO;
+                pending->target = arena_alloc(arena, digits + 1);
+                memcpy(pending->target, op + 2, digits);
+                pending->target[digits] = '\0';
+                pending = NULL;
+                p = op + 2 + digits;
+            }
+            else if (*op == '<')
+            {
+                pending->type = REDIR_INPUT;
+                pending->fd = fd >= 0 ? fd : STDIN_FILENO;
+                p = op + 1;
+            }
+            else
+            {
+                pending->type = op[1] == '>' ? REDIR_APPEND : REDIR_OUTPUT;
+                pending->fd = fd >= 0 ? fd : STDOUT_FILENO;
+                p = op + (op[1] == '>' ? 2 : 1);
+            }
+            continue;
+        }
+
+        // Anything else is a word.
+        char *word = out;
+        if (!lex_word(&p, &out))
+        {
+            parse_error("syntax error: unterminated quote or '$('");
+            return NULL;
+        }
+        if (pending != NULL)
+        {
+            pending->target = word;
+            pending = NULL;
+        }
+        else if (in_with)
+        {
+            in_with = strcmp(word, "--") != 0;
+            if (in_with && !launch_attrs_set(pipeline->attrs, word))
+            {
+                return NULL;
+            }
+        }
+        else if (pipeline->num_cmds == 1 && cmd->argc == 0 && cmd->num_redirs == 0 && pipeline->attrs == NULL &&
+                 strcmp(word, "with") == 0)
+        {
+            // 'with' settings, like 'time', apply to the whole pipeline.
+            pipeline->attrs = arena_alloc(arena, sizeof(LaunchAttrs));
+            memset(pipeline->attrs, 0, sizeof(LaunchAttrs));
+            in_with = true;
+        }
+        else if (pipeline->num_cmds == 1 && cmd->argc == 0 && cmd->num_redirs == 0 && !pipeline->timed &&
+                 strcmp(word, "time") == 0)
+        {
+            pipeline->timed = true; // 'time' prefixes the whole pipeline rather than naming a command.
+        }
+        else if (pipeline->num_cmds == 1 && cmd->argc == 0 && cmd->num_redirs == 0 && !pipeline->memo &&
+                 strcmp(word, "memo") == 0)
+        {
+            pipeline->memo = true; // So does 'memo'.
+        }
+        else
+        {
+            command_add_word(cmd, word, arena);
+        }
+    }
+
+    // A line may not end in the middle of a redirection or right after '|', '&&' or '||'. A
+    // final ';' or '&' just ends the last pipeline.
+    if (pending != NULL || in_with || (!ended && cmd == NULL && pipeline->num_cmds > 0) || (ended && next_op != LIST_SEQ))
+    {
+        parse_error("syntax error near unexpected end of line");
+        return NULL;
+    }
+    if (head->next == NULL)
+    {
+        head->text = input; // A plain pipeline is shown exactly as typed.
+    }
+    else if (!ended)
+    {
+        size_t len = strlen(start);
+        while (len > 0 && strchr(" \t\r\n", start[len - 1]) != NULL)
+        {
+            len--;
+        }
+        pipeline->text = arena_strndup(arena, start, len);
+    }
+    return head;
+}
+
+/**
+ * Finds the end of a parenthesised command, skipping nested parentheses and quoted text.
+ *
+ * @param p The opening '('.
+ * @return The matching ')', or NULL if there is none.
+ */
+const char *parse_substitution(const char *p)
+{
+    int depth = 0;
+    char quote = '\0';
+    for (; *p != '\0'; p++)
+    {
+        if (quote != '\0')
+        {
+            quote = *p == quote ? '\0' : quote;
+        }
+        else if (*p == '\'' || *p == '"')
+        {
+            quote = *p;
+        }
+        else if (*p == '\\' && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (*p == '(')
+        {
+            depth++;
+        }
+        else if (*p == ')' && --depth == 0)
+        {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocates an empty pipeline and appends it to a list.
+ *
+ * @param prev The pipeline it follows, or NULL for the first of a line.
+ * @param op The operator between the two.
+ * @param arena Arena to allocate from.
+ * @return The new pipeline.
+ */
+Pipeline *parse_new_pipeline(Pipeline *prev, ListOp op, Arena *arena)
+{
+    Pipeline *pipeline = arena_alloc(arena, sizeof(Pipeline));
+    pipeline->cmds = pipeline->cmds_inline;
+    pipeline->num_cmds = 0;
+    pipeline->cmds_cap = PIPELINE_INLINE_CMDS;
+    pipeline->background = false;
+    pipeline->timed = false;
+    pipeline->memo = false;
+    pipeline->attrs = NULL;
+    pipeline->text = "";
+    pipeline->parse_ns = 0;
+    pipeline->op = op;
+    pipeline->next = NULL;
+    if (prev != NULL)
+    {
+        prev->next = pipeline;
+    }
+    return pipeline;
+}
+
+/**
+ * Allocates a command with no words or redirections.
+ *
+ * @param arena Arena to allocate from.
+ * @return The command.
+ */
+Command *command_new(Arena *arena)
+{
+    Command *cmd = arena_alloc(arena, sizeof(Command));
+    cmd->argv = cmd->argv_inline;
+    cmd->argc = 0;
+    cmd->argv_cap = COMMAND_INLINE_WORDS;
+    cmd->argv[0] = NULL;
+    cmd->num_redirs = 0;
+    return cmd;
+}
+
+/**
+ * Appends a word to a command's argv, keeping it null-terminated.
+ *
+ * @param cmd The command.
+ * @param word The word.
+ * @param arena Arena the command lives in.
+ */
+void command_add_word(Command *cmd, char *word, Arena *arena)
+{
+    if (cmd->argc + 1 == cmd->argv_cap)
+    {
+        cmd->argv = (char **)small_vec_push((void **)cmd->argv, cmd->argc + 1, &cmd->argv_cap, arena);
+    }
+    cmd->argv[cmd->argc++] = word;
+    cmd->argv[cmd->argc] = NULL;
+}
+
+/**
+ * Appends a command to a pipeline.
+ *
+ * @param pipeline The pipeline.
+ * @param cmd The command.
+ * @param arena Arena the pipeline lives in.
+ */
+void pipeline_add_command(Pipeline *pipeline, Command *cmd, Arena *arena)
+{
+    if (pipeline->num_cmds == pipeline->cmds_cap)
+    {
+        pipeline->cmds = (Command **)small_vec_push((void **)pipeline->cmds, pipeline->num_cmds, &pipeline->cmds_cap, arena);
+    }
+    pipeline->cmds[pipeline->num_cmds++] = cmd;
+}
+
+/**
+ * Grows a small vector: an array of pointers that starts in inline slots of its owner and moves
+ * to a block twice the size in the owner's arena when it is full. The old storage is simply
+ * left behind; it is released with the arena.
+ *
+ * @param items The current storage.
+ * @param count Number of slots in use.
+ * @param cap In: size of the current storage. Out: size of the new one.
+ * @param arena Arena to allocate from.
+ * @return The new storage, holding the first count entries.
+ */
+void **small_vec_push(void **items, int count, int *cap, Arena *arena)
+{
+    *cap *= 2;
+    void **grown = arena_alloc(arena, *cap * sizeof(void *));
+    memcpy(grown, items, count * sizeof(void *));
+    return grown;
+}
+
+/**
+ * Parses a line into the line arena and records how long that took, for profiles.
+ *
+ * @param input The line to parse.
+ * @return The parsed line, or NULL after a syntax error has been reported.
+ */
+Pipeline *parse_timed(const char *input)
+{
+    struct timespec parse_start, parse_end;
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    Pipeline *pipeline = parse_line(input, &line_arena);
+    clock_gettime(CLOCK_MONOTONIC, &parse_end);
+    if (pipeline != NULL)
+    {
+        pipeline->parse_ns = elapsed_ns(&parse_start, &parse_end);
+    }
+    return pipeline;
+}
+
+/**
+ * Reports a syntax error found by parse_line(), unless parse_quiet is set because the line is
+ * only being compiled and will report its error when it runs.
+ *
+ * @param format printf-style message, without the "wsh: " prefix or a newline.
+ */
+void parse_error(const char *format, ...)
+{
+    if (parse_quiet)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fputs("wsh: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+/**
+ * Lexes one word starting at *src and writes its cooked form to *dst. Quotes and backslashes are
+ * removed; a '$' or glob character that was quoted is written after a CTLESC, so expansion leaves
+ * it alone. A '$(cmd)'
+ * command substitution is copied exactly as written, blanks and operators included. A word with
+ * quotes that is empty or may expand to nothing, such as "" or "$E", starts with a CTLQUOTE, so
+ * prepare_argv() keeps it as an empty argument rather than dropping it.
+ *
+ * @param src In: start of the word. Out: first character after it.
+ * @param dst In: where to write the word. Out: just past its terminating NUL.
+ * @return False if a quote was left unterminated.
+ */
+bool lex_word(const char **src, char **dst)
+{
+    const char *p = *src;
+    char *out = *dst;
+    bool quoted = false; // Whether the word had quotes.
+
+    while (*p != '\0' && strchr(" \t\r\n|&;<>", *p) == NULL)
+    {
+        if (*p == '$' && p[1] == '(')
+        {
+            // Command substitution: copied as written, up to its ')', for expand_word().
+            const char *close = parse_substitution(p + 1);
+            if (close == NULL)
+            {
+                return false;
+            }
+            memcpy(out, p, close + 1 - p);
+            out += close + 1 - p;
+            p = close + 1;
+        }
+        else if (*p == '\'')
+        {
+            // Single quotes: everything up to the closing quote is literal.
+            quoted = true;
+            for (p++; *p != '\''; p++)
+            {
+                if (*p == '\0')
+                {
+                    return false;
+                }
+                if (*p == '$' || *p == CTLESC || strchr(GLOB_CHARS, *p) != NULL)
+                {
+                    *out++ = CTLESC;
+                }
+                *out++ = *p;
+            }
+            p++;
+        }
+        else if (*p == '"')
+        {
+            // Double quotes: literal except for backslash escapes of ", \ and $.
+            quoted = true;
+            for (p++; *p != '"'; p++)
+            {
+                if (*p == '\0')
+                {
+                    return false;
+                }
+                if (*p == '$' && p[1] == '(')
+                {
+                    // Command substitution, possibly with quotes of its own.
+                    const char *close = parse_substitution(p + 1);
+                    if (close == NULL)
+                    {
+                        return false;
+                    }
+                    memcpy(out, p, close - p);
+                    out += close - p;
+                    p = close; // The loop copies the ')'.
+                }
+                else if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$'))
+                {
+                    p++;
+                    if (*p == '$')
+                    {
+                        *out++ = CTLESC;
+                    }
+                }
+                else if (*p == CTLESC || strchr(GLOB_CHARS, *p) != NULL)
+                {
+                    *out++ = CTLESC;
+                }
+                *out++ = *p;
+            }
+            p++;
+        }
+        else if (*p == '\\')
+        {
+            // Backslash outside quotes: the next character is literal.
+            p++;
+            if (*p == '\0')
+            {
+                break;
+            }
+            if (*p == '$' || *p == CTLESC || strchr(GLOB_CHARS, *p) != NULL)
+            {
+                *out++ = CTLESC;
+            }
+            *out++ = *p++;
+        }
+        else
+        {
+            if (*p == CTLESC || *p == CTLQUOTE)
+            {
+                *out++ = CTLESC;
+            }
+            *out++ = *p++;
+        }
+    }
+
+    // A word without a '$' cannot become empty unless it already is; the rest are marked.
+    if (quoted && (out == *dst || memchr(*dst, '$', out - *dst) != NULL))
+    {
+        memmove(*dst + 1, *dst, out - *dst);
+        **dst = CTLQUOTE;
+        out++;
+    }
+    *out++ = '\0';
+    *src = p;
+    *dst = out;
+    return true;
+}
+
+/**
+ * Removes the CTLQUOTE and CTLESC markers the lexer left in a word, in place.
+ *
+ * @param word The word to clean.
+ */
+void remove_quote_escapes(char *word)
+{
+    char *out = word[0] == CTLQUOTE ? word : strchr(word, CTLESC);
+    if (out == NULL)
+    {
+        return; // Nothing was quoted.
+    }
+    for (char *in = out + (*out == CTLQUOTE); *in != '\0'; in++)
+    {
+        if (*in == CTLESC && in[1] != '\0')
+        {
+            in++;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+}
+
+/**
+ * Turns a parsed command into the argv that is executed: variables are substituted, quote markers
+ * removed, and unquoted words that expanded to nothing dropped. The command's own argv is compacted in
+ * place, so nothing is copied however many words there are. Words with unquoted glob characters
+ * then go through pathname expansion, which rebuilds the argv since a pattern can stand for any
+ * number of paths. Redirection targets are expanded as well, but never globbed.
+ *
+ * @param cmd The parsed command; its words and argc are updated in place.
+ * @return The null-terminated argv, which is cmd->argv.
+ */
+char **prepare_argv(Command *cmd)
+{
+    char *patterns = NULL; // One flag per word, allocated when the first pattern is seen.
+    for (int i = 0; i < cmd->argc; i++)
+    {
+        bool pattern = word_is_pattern(cmd->argv[i]);
+        if (pattern && patterns == NULL)
+        {
+            patterns = arena_alloc(&line_arena, cmd->argc);
+            memset(patterns, 0, cmd->argc);
+        }
+        if (pattern)
+        {
+            patterns[i] = 1;
+        }
+        bool quoted = cmd->argv[i][0] == CTLQUOTE;
+        expand_word(&cmd->argv[i], pattern);
+        if (!quoted && cmd->argv[i][0] == '\0')
+        {
+            cmd->argv[i] = NULL; // Dropped below.
+        }
+    }
+
+    if (patterns != NULL)
+    {
+        char **words = cmd->argv;
+        int num_words = cmd->argc;
+        cmd->argv_cap = num_words + 1;
+        cmd->argv = arena_alloc(&line_arena, cmd->argv_cap * sizeof(char *));
+        cmd->argc = 0;
+        cmd->argv[0] = NULL;
+        for (int i = 0; i < num_words; i++)
+        {
+            if (patterns[i])
+            {
+                glob_word(cmd, words[i]);
+            }
+            else if (words[i] != NULL)
+            {
+                command_add_word(cmd, words[i], &line_arena);
+            }
+        }
+    }
+    else
+    {
+        int count = 0;
+        for (int i = 0; i < cmd->argc; i++)
+        {
+            // Keep the remaining words, moving them down over the dropped ones.
+            if (cmd->argv[i] != NULL)
+            {
+                cmd->argv[count++] = cmd->argv[i];
+            }
+        }
+        cmd->argv[count] = NULL; // Terminate the filtered argument list.
+        cmd->argc = count;
+    }
+
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        if (cmd->redirs[i].type == REDIR_PROC_IN || cmd->redirs[i].type == REDIR_PROC_OUT)
+        {
+            continue; // Expanded by the subshell that runs it.
+        }
+        expand_word(&cmd->redirs[i].target, false);
+    }
+    return cmd->argv;
+}
+
+/**
+ * Tells whether a word in lexer form is a pattern for pathname expansion: it has an unquoted '*'
+ * or '?', or an unquoted '[' with a ']' after it. Characters inside '$(cmd)' do not count.
+ *
+ * @param word The word, before expansion.
+ * @return True if the word should be globbed.
+ */
+bool word_is_pattern(const char *word)
+{
+    bool bracket = false;
+    for (const char *p = word; *p != '\0'; p++)
+    {
+        if (*p == CTLESC && p[1] != '\0')
+        {
+            p++;
+        }
+        else if (*p == '$' && p[1] == '(')
+        {
+            const char *close = parse_substitution(p + 1); // Found by the lexer already.
+            if (close == NULL)
+            {
+                return false;
+            }
+            p = close;
+        }
+        else if (*p == '*' || *p == '?')
+        {
+            return true;
+        }
+        else if (*p == '[')
+        {
+            bracket = true;
+        }
+        else if (*p == ']' && bracket)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Tells whether one component of an expanded pattern has glob characters that are not escaped
+ * with a backslash.
+ *
+ * @param text Start of the component.
+ * @param len Its length.
+ * @return True if the component has to be matched against a directory listing.
+ */
+bool glob_has_meta(const char *text, size_t len)
+{
+    bool bracket = false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (text[i] == '\\')
+        {
+            i++;
+        }
+        else if (text[i] == '*' || text[i] == '?')
+        {
+            return true;
+        }
+        else if (text[i] == '[')
+        {
+            bracket = true;
+        }
+        else if (text[i] == ']' && bracket)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Appends the paths a pattern matches to a command, sorted, or the pattern itself without its
+ * escapes if nothing matches. Hidden entries are only matched by a pattern that starts with '.',
+ * and '.' and '..' never are.
+ *
+ * @param cmd The command being built.
+ * @param pattern The word as expanded by expand_word() in pattern mode.
+ */
+void glob_word(Command *cmd, const char *pattern)
+{
+    char path[PATH_MAX];
+    size_t len = 0;
+    int first = cmd->argc;
+    if (pattern[0] == '/')
+    {
+        path[len++] = '/';
+        pattern++;
+    }
+    path[len] = '\0';
+    glob_walk(cmd, path, len, pattern);
+    if (cmd->argc > first)
+    {
+        qsort(cmd->argv + first, cmd->argc - first, sizeof(char *), compare_strings);
+        return;
+    }
+
+    // No match: the word is passed on as written.
+    char *literal = arena_strndup(&line_arena, pattern - len, strlen(pattern) + len);
+    char *out = literal;
+    for (const char *in = literal; *in != '\0'; in++)
+    {
+        if (*in == '\\' && in[1] != '\0')
+        {
+            in++;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+    command_add_word(cmd, literal, &line_arena);
+}
+
+/**
+ * Matches the rest of a pattern, one '/'-separated component at a time, below a directory. A
+ * component without glob characters is appended as it is, and only a complete path is checked
+ * for existence; any other is matched with fnmatch() against the directory's listing.
+ *
+ * @param cmd The command that receives the matching paths.
+ * @param path Buffer of PATH_MAX bytes holding the directory matched so far, ending in '/' unless
+ *        it is empty for the current directory.
+ * @param len Length of the directory in path.
+ * @param rest The components still to match.
+ */
+void glob_walk(Command *cmd, char *path, size_t len, const char *rest)
+{
+    const char *slash = strchr(rest, '/');
+    size_t part = slash != NULL ? (size_t)(slash - rest) : strlen(rest);
+    if (!glob_has_meta(rest, part))
+    {
+        for (size_t i = 0; i < part; i++)
+        {
+            if (rest[i] == '\\' && i + 1 < part)
+            {
+                i++;
+            }
+            if (len + 2 >= PATH_MAX)
+            {
+                return;
+            }
+            path[len++] = rest[i];
+        }
+        if (slash != NULL)
+        {
+            path[len++] = '/';
+            path[len] = '\0';
+            glob_walk(cmd, path, len, slash + 1);
+            return;
+        }
+        path[len] = '\0';
+        struct stat st;
+        if (lstat(path, &st) == 0)
+        {
+            command_add_word(cmd, arena_strndup(&line_arena, path, len), &line_arena);
+        }
+        return;
+    }
+
+    DirListing *dir = dir_listing(len > 0 ? path : ".");
+    if (dir == NULL)
+    {
+        return;
+    }
+    char *match = arena_strndup(&line_arena, rest, part);
+    const char *names = dir->names;
+    if (slash != NULL)
+    {
+        // Listing the subdirectories may reuse this cache slot, so walk a copy.
+        char *copy = arena_alloc(&line_arena, dir->size);
+        memcpy(copy, dir->names, dir->size);
+        names = copy;
+    }
+    const char *end = names + dir->size;
+    for (const char *entry = names; entry < end; entry += strlen(entry + 1) + 2)
+    {
+        unsigned char type = entry[0];
+        const char *name = entry + 1;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            continue;
+        }
+        if (slash != NULL && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN)
+        {
+            continue; // Nothing can match below a file.
+        }
+        size_t name_len = strlen(name);
+        if (len + name_len + 2 >= PATH_MAX || fnmatch(match, name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+        memcpy(path + len, name, name_len + 1);
+        if (slash != NULL)
+        {
+            path[len + name_len] = '/';
+            path[len + name_len + 1] = '\0';
+            glob_walk(cmd, path, len + name_len + 1, slash + 1);
+        }
+        else
+        {
+            command_add_word(cmd, arena_strndup(&line_arena, path, len + name_len), &line_arena);
+        }
+    }
+    path[len] = '\0';
+}
+
+/**
+ * Returns the entries of a directory for pathname expansion. The listing is read with
+ * getdents64() in large blocks and kept in a small cache keyed by path, so a script that globs
+ * the same directories line after line reads each one once. A cached listing is reused only
+ * while the directory's device, inode and mtime are those it was read with, and only if it was
+ * read at least DIR_CACHE_RACY_NS after that mtime: file system timestamps are coarse, so a
+ * change made just after a listing that soon could leave the mtime as it was.
+ *
+ * @param path The directory.
+ * @return Its listing, valid until the next call; NULL if it cannot be read.
+ */
+DirListing *dir_listing(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        return NULL;
+    }
+    DirListing *dir = &dir_cache[hash_string(path) % DIR_CACHE_SLOTS];
+    if (dir->path != NULL && strcmp(dir->path, path) == 0 && dir->dev == st.st_dev && dir->ino == st.st_ino &&
+        dir->mtime.tv_sec == st.st_mtim.tv_sec && dir->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+        elapsed_ns(&dir->mtime, &dir->scanned) > DIR_CACHE_RACY_NS)
+    {
+        stats.dir_cache_hits++;
+        return dir;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    free(dir->path);
+    dir->path = strdup(path);
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+    clock_gettime(CLOCK_REALTIME, &dir->scanned);
+    dir->size = 0;
+
+    uint64_t buffer[DIR_READ_BUFFER / sizeof(uint64_t)]; // Aligned for struct dirent64.
+    ssize_t n;
+    while (dir->path != NULL && (n = getdents64(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t offset = 0; offset < n;)
+        {
+            struct dirent64 *entry = (struct dirent64 *)((char *)buffer + offset);
+            offset += entry->d_reclen;
+            size_t name_len = strlen(entry->d_name);
+            if (dir->size + name_len + 2 > dir->cap)
+            {
+                size_t cap = (dir->size + name_len + 2) * 2;
+                char *names = realloc(dir->names, cap < 4096 ? 4096 : cap);
+                if (names == NULL)
+                {
+                    n = -1;
+                    break;
+                }
+                dir->names = names;
+                dir->cap = cap < 4096 ? 4096 : cap;
+            }
+            dir->names[dir->size] = entry->d_type;
+            memcpy(dir->names + dir->size + 1, entry->d_name, name_len + 1);
+            dir->size += name_len + 2;
+        }
+        if (n < 0)
+        {
+            break;
+        }
+    }
+    close(fd);
+    stats.dir_scans++;
+    if (n < 0 || dir->path == NULL)
+    {
+        free(dir->path);
+        dir->path = NULL; // Unreadable or out of memory: nothing is cached.
+        return NULL;
+    }
+    return dir;
+}
+
+/**
+ * Opens the redirection targets of a command in the shell and records them as descriptor moves
+ * for the launch backend. Targets are opened close-on-exec, so only the dup2'd copy survives in
+ * the child. Process substitutions are started first: each one's pipe end is handed to the
+ * command under its own number, and the marker word naming it, in argv or as a file name, is
+ * replaced by its /dev/fd path.
+ *
+ * @param cmd The command whose redirections to open.
+ * @param argv The command's expanded argv, or NULL if it has none.
+ * @param spec Launch description receiving the moves.
+ * @return False after reporting an error, in which case nothing is left open.
+ */
+bool open_redirects(Command *cmd, char *argv[], LaunchSpec *spec)
+{
+    char *paths[MAX_REDIRECTS] = {NULL};
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        Redirect *redir = &cmd->redirs[i];
+        if (redir->type == REDIR_PROC_IN || redir->type == REDIR_PROC_OUT)
+        {
+            int fd = start_process_substitution(redir);
+            if (fd < 0)
+            {
+                close_redirects(spec);
+                return false;
+            }
+            spec->moves[spec->num_moves++] = (FdMove){fd, fd, true};
+            paths[i] = arena_alloc(&line_arena, 24);
+            snprintf(paths[i], 24, "/dev/fd/%d", fd);
+        }
+    }
+    for (int i = 0; argv != NULL && argv[i] != NULL; i++)
+    {
+        if (proc_marker(argv[i], paths) >= 0)
+        {
+            argv[i] = paths[proc_marker(argv[i], paths)];
+        }
+    }
+
+    for (int i = 0; i < cmd->num_redirs; i++)
+    {
+        Redirect *redir = &cmd->redirs[i];
+        const char *target = redir->target;
+        if (redir->type == REDIR_PROC_IN || redir->type == REDIR_PROC_OUT)
+        {
+            continue;
+        }
+        if (proc_marker(target, paths) >= 0)
+        {
+            target = paths[proc_marker(target, paths)];
+        }
+        if (redir->type == REDIR_DUP)
+        {
+            if (target[0] == '\0' || target[strspn(target, "0123456789")] != '\0')
+            {
+                fprintf(stderr, "wsh: %s: bad file descriptor\n", target);
+                close_redirects(spec);
+                return false;
+            }
+            // Copied in the child once the earlier moves are in place, like sh does.
+            spec->moves[spec->num_moves++] = (FdMove){atoi(target), redir->fd, false};
+            continue;
+        }
+
+        int flags = O_CLOEXEC;
+        if (redir->type == REDIR_INPUT)
+        {
+            flags |= O_RDONLY;
+        }
+        else if (redir->type == REDIR_APPEND)
+        {
+            flags |= O_WRONLY | O_CREAT | O_APPEND;
+        }
+        else
+        {
+            flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        }
+
+        int fd = open(target, flags, 0666);
+        bool clash = false;
+        for (int j = 0; j < cmd->num_redirs; j++)
+        {
+            clash = clash || cmd->redirs[j].fd == fd;
+        }
+        if (clash)
+        {
+            // Landed on a number this command redirects ('3> a > b' with 3 free): moving onto
+            // it would clobber this file, so keep the file above the single-digit range.
+            int moved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            moved = moved < 0 && errno == EINVAL ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : moved;
+            close(fd);
+            fd = moved;
+        }
+        if (fd < 0)
+        {
+            fprintf(stderr, "wsh: %s: %s\n", target, strerror(errno));
+            close_redirects(spec);
+            return false;
+        }
+        spec->moves[spec->num_moves++] = (FdMove){fd, redir->fd, true};
+    }
+    return true;
+}
+
+/**
+ * Recognises the marker word of a process substitution. Only markers of substitutions that were
+ * actually started count, so control characters typed into a word cannot index past them.
+ *
+ * @param word An expanded word.
+ * @param paths /dev/fd paths of the started substitutions, by redirection index.
+ * @return The redirection index the word stands for, or -1 if it is an ordinary word.
+ */
+int proc_marker(const char *word, char *paths[])
+{
+    int slot = word[0] == CTLPROC ? word[1] - '0' : -1;
+    return slot >= 0 && slot < MAX_REDIRECTS && word[2] == '\0' && paths[slot] != NULL ? slot : -1;
+}
+
+/**
+ * Starts the command of a process substitution in a forked subshell, connected to a new pipe:
+ * its output feeds the pipe for '<(cmd)', its input drains it for '>(cmd)'. The subshell belongs
+ * to no job and is reaped whenever it exits.
+ *
+ * @param redir The process substitution.
+ * @return The shell's end of the pipe, close-on-exec, or -1 after reporting an error.
+ */
+int start_process_substitution(Redirect *redir)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        perror("Couldn't Pipe");
+        return -1;
+    }
+    int ours = redir->type == REDIR_PROC_IN ? fds[0] : fds[1];
+    int theirs = redir->type == REDIR_PROC_IN ? fds[1] : fds[0];
+
+    fflush(stdout); // Do not let the child inherit pending output.
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        LaunchSpec spec = {-1, -1, ours, {{0, 0, false}}, 0, -1, NULL};
+        if (redir->type == REDIR_PROC_IN)
+        {
+            spec.fd_out = theirs;
+        }
+        else
+        {
+            spec.fd_in = theirs;
+        }
+        apply_launch_spec(&spec);
+        job_table_reset(); // The parent's jobs are not this process's children.
+        job_control = false;
+        add_to_history_enabled = false;
+        parse_and_execute(redir->target);
+        exit(last_status);
+    }
+    close(theirs);
+    if (pid < 0)
+    {
+        perror("fork failed");
+        close(ours);
+        return -1;
+    }
+    return ours;
+}
+
+/**
+ * Closes the shell's copies of redirection targets once the child has been started.
+ *
+ * @param spec Launch description holding the moves.
+ */
+void close_redirects(LaunchSpec *spec)
+{
+    for (int i = 0; i < spec->num_moves; i++)
+    {
+        if (spec->moves[i].owned)
+        {
+            close(spec->moves[i].from);
+        }
+    }
+    spec->num_moves = 0;
+}
+
+/**
+ * Applies redirections to the shell's own descriptors, for built-in commands that run in the
+ * shell. Every descriptor that gets replaced is first saved above the range commands use, so
+ * restore_shell_fds() can put it back.
+ *
+ * @param spec Redirections opened by open_redirects().
+ * @param saved Receives one entry per move: the saved copy (-1 if the descriptor was closed)
+ *              and the descriptor it belongs to.
+ * @return Number of entries written to saved.
+ */
+int redirect_shell(const LaunchSpec *spec, FdMove saved[])
+{
+    fflush(stdout); // Output produced so far belongs to the old descriptors.
+    fflush(stderr);
+    int count = 0;
+    for (int i = 0; i < spec->num_moves; i++)
+    {
+        int to = spec->moves[i].to;
+        if (spec->moves[i].from == to)
+        {
+            continue; // A process substitution's pipe, already in place.
+        }
+        // Keep the copy clear of low descriptors; below a limit of 10 any free number will do.
+        int copy = fcntl(to, F_DUPFD_CLOEXEC, 10);
+        if (copy < 0 && errno == EINVAL)
+        {
+            copy = fcntl(to, F_DUPFD_CLOEXEC, 0);
+        }
+        if (copy < 0 && errno != EBADF)
+        {
+            perror("wsh: cannot save descriptor");
+            continue; // Leave it alone rather than lose it for good.
+        }
+        saved[count++] = (FdMove){copy, to, true}; // -1: it was closed, and is closed again after.
+        dup2(spec->moves[i].from, to);
+    }
+    return count;
+}
+
+/**
+ * Puts back the descriptors replaced by redirect_shell(), in reverse order.
+ *
+ * @param saved Entries written by redirect_shell().
+ * @param count Number of entries.
+ */
+void restore_shell_fds(FdMove saved[], int count)
+{
+    fflush(stdout); // Flush the built-in's output into the redirection target.
+    fflush(stderr);
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (saved[i].from >= 0)
+        {
+            dup2(saved[i].from, saved[i].to);
+            close(saved[i].from);
+        }
+        else
+        {
+            close(saved[i].to);
+        }
+    }
+}
+
+/**
+ * Checks whether a pipeline stage is a plain 'cat file' whose file the next stage can read
+ * directly, and opens the file if so. Only regular files qualify: the next stage then sees the
+ * same bytes cat would have copied, without the extra process and the pipe in between.
+ *
+ * @param cmd The stage, to check for redirections.
+ * @param argv Its expanded argument vector.
+ * @return A read-only descriptor of the file, or -1 if the stage must run as written.
+ */
+int open_cat_input(Command *cmd, char *argv[])
+{
+    if (argv[0] == NULL || strcmp(argv[0], "cat") != 0 || argv[1] == NULL || argv[2] != NULL ||
+        argv[1][0] == '-' || cmd->num_redirs > 0)
+    {
+        return -1;
+    }
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)))
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd; // On failure cat runs and reports the problem itself.
+}
+
+/**
+ * Runs a built-in inside the shell with its plumbing in place: pipe ends from the spec become
+ * stdin and stdout, then the command's own redirections are applied, and everything is put
+ * back afterwards. The spec's pipe ends are consumed. SIGPIPE is ignored meanwhile, so a reader
+ * that quits early turns into a write error rather than killing the shell.
+ *
+ * @param builtin The built-in to run.
+ * @param argv Its expanded argument vector.
+ * @param cmd The command, for its redirections.
+ * @param spec Pipe plumbing (fd_in, fd_out) with no moves yet.
+ * @return The built-in's exit status; 1 if a redirection failed.
+ */
+int run_builtin_in_shell(const Builtin *builtin, char *argv[], Command *cmd, LaunchSpec *spec)
+{
+    // Pipe ends become ordinary moves, applied before the command's own redirections.
+    spec->num_moves = 0;
+    if (spec->fd_in >= 0)
+    {
+        spec->moves[spec->num_moves++] = (FdMove){spec->fd_in, STDIN_FILENO, true};
+    }
+    if (spec->fd_out >= 0)
+    {
+        spec->moves[spec->num_moves++] = (FdMove){spec->fd_out, STDOUT_FILENO, true};
+    }
+    if (!open_redirects(cmd, argv, spec))
+    {
+        return 1;
+    }
+
+    struct sigaction ignore, old_sigpipe;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old_sigpipe);
+
+    FdMove saved[MAX_REDIRECTS + 2];
+    int num_saved = redirect_shell(spec, saved);
+    close_redirects(spec);
+    int status = run_builtin(builtin, argv);
+    restore_shell_fds(saved, num_saved);
+    clearerr(stdout); // Forget a write error from a closed pipe.
+
+    sigaction(SIGPIPE, &old_sigpipe, NULL);
+    return status;
+}
+
+/**
+ * Executes a pipeline made of a single command.
+ *
+ * @param pipeline The parsed pipeline; its first command is executed.
+ * @return The command's exit status: 1 if it was invalid or a redirection failed, 127 if it could
+ *         not be started, 0 if it runs in the background.
+ */
+int execute_command(Pipeline *pipeline)
+{
+    Command *cmd = pipeline->cmds[0];
+    char **filtered_argv = prepare_argv(cmd); // Arguments after substitution.
+
+    // Validate the command after substitution.
+    if (!isValidCommand(filtered_argv))
+    {
+        printf("Error: Command validation failed.\n");
+        return 1; // Exit if the command is invalid.
+    }
+
+    // Inherit the shell's stdin and stdout; lead a new process group under job control.
+    LaunchSpec spec = {-1, -1, -1, {{0, 0, false}}, 0, job_control ? 0 : -1, pipeline->attrs};
+    if (!open_redirects(cmd, filtered_argv, &spec))
+    {
+        return 1;
+    }
+
+    sigset_t saved;
+    block_child_signals(&saved); // The reaper must not see the child before its job exists.
+    struct timespec launch_start, launch_end;
+    clock_gettime(CLOCK_MONOTONIC, &launch_start);
+    pid_t pid = launch_process(filtered_argv, &spec); // Start the command.
+    clock_gettime(CLOCK_MONOTONIC, &launch_end);
+    close_redirects(&spec);
+    int status = 127; // Not found or could not be executed.
+    if (pid > 0) // Command started.
+    {
+        Job *job = job_for_pipeline(pipeline, 1);
+        job->started = launch_start; // The job was created after its process.
+        job_add_process(job, pid, filtered_argv[0])->launch_ns = elapsed_ns(&launch_start, &launch_end);
+        status = job_launched(job); // Wait for it unless it runs in the background.
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return status;
+}
+
+/**
+ * Checks and executes built-in commands such as exit, cd, history, export, local, and vars.
+ *
+ * @param argv Array of command and arguments.
+ * @return Returns 1 if a built-in command is executed, 0 otherwise.
+ */
+int built_in_command(char *argv[])
+{
+    const Builtin *builtin = find_builtin(argv[0]);
+    if (builtin == NULL)
+    {
+        return 0; // Indicate that the command is not a built-in command.
+    }
+    run_builtin(builtin, argv);
+    return 1;
+}
+
+/**
+ * Looks up a built-in command. The switch on name length and first character compiles to a jump
+ * table, so at most one string comparison decides the lookup and external commands are usually
+ * rejected without any.
+ *
+ * @param name The command name.
+ * @return The built-in's descriptor, or NULL if the name is not a built-in.
+ */
+const Builtin *find_builtin(const char *name)
+{
+    size_t len = strnlen(name, BUILTIN_MAX_NAME + 1);
+    BuiltinId id;
+    switch (BUILTIN_KEY(len, (unsigned char)name[0]))
+    {
+    case BUILTIN_KEY(2, 'c'):
+        id = BUILTIN_CD;
+        break;
+    case BUILTIN_KEY(4, 'e'):
+        id = name[1] == 'x' ? BUILTIN_EXIT : BUILTIN_ECHO;
+        break;
+    case BUILTIN_KEY(7, 'h'):
+        id = BUILTIN_HISTORY;
+        break;
+    case BUILTIN_KEY(6, 'e'):
+        id = BUILTIN_EXPORT;
+        break;
+    case BUILTIN_KEY(5, 'l'):
+        id = BUILTIN_LOCAL;
+        break;
+    case BUILTIN_KEY(4, 'v'):
+        id = BUILTIN_VARS;
+        break;
+    case BUILTIN_KEY(4, 'h'):
+        id = BUILTIN_HASH;
+        break;
+    case BUILTIN_KEY(4, 'j'):
+        id = BUILTIN_JOBS;
+        break;
+    case BUILTIN_KEY(4, 'w'):
+        id = BUILTIN_WAIT;
+        break;
+    case BUILTIN_KEY(2, 'f'):
+        id = BUILTIN_FG;
+        break;
+    case BUILTIN_KEY(2, 'b'):
+        id = BUILTIN_BG;
+        break;
+    case BUILTIN_KEY(6, 'p'):
+        id = BUILTIN_PRINTF;
+        break;
+    case BUILTIN_KEY(6, 'c'):
+        id = BUILTIN_COPROC;
+        break;
+    case BUILTIN_KEY(4, 't'):
+        id = name[1] == 'r' ? BUILTIN_TRUE : BUILTIN_TEST;
+        break;
+    case BUILTIN_KEY(5, 'f'):
+        id = BUILTIN_FALSE;
+        break;
+    case BUILTIN_KEY(1, '['):
+        id = BUILTIN_BRACKET;
+        break;
+    case BUILTIN_KEY(3, 'p'):
+        id = BUILTIN_PWD;
+        break;
+    default:
+        return NULL;
+    }
+    return memcmp(builtins[id].name, name, len + 1) == 0 ? &builtins[id] : NULL;
+}
+
+/**
+ * Runs a built-in command after checking its arguments with the descriptor's validator.
+ *
+ * @param builtin Descriptor returned by find_builtin().
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command; 1 if validation failed.
+ */
+int run_builtin(const Builtin *builtin, char *argv[])
+{
+    if (builtin->validator != NULL && !builtin->validator(argv))
+    {
+        return 1;
+    }
+    return builtin->handler(argv);
+}
+
+/**
+ * Adds a command to the history, avoiding duplicates and managing history size. The history is a
+ * circular buffer, so evicting the oldest command is O(1). With a history file open the command is
+ * also appended to it with a single write.
+ *
+ * @param cmd Command string to be added to the history.
+ */
+void add_to_history(const char *cmd)
+{
+    // Ignore if history is disabled, or cmd is NULL, empty, or all whitespace.
+    if (!add_to_history_enabled || cmd == NULL || *cmd == '\0' || strspn(cmd, " \t\n\v\f\r") == strlen(cmd))
+    {
+        return;
+    }
+
+    if (!history_reserve())
+    {
+        return;
+    }
+
+    // Avoid adding if the last command in history is the same.
+    size_t len = strlen(cmd);
+    if (current_history_count > 0)
+    {
+        HistoryEntry *last = history_at(1);
+        if (last->len == len && memcmp(last->text, cmd, len) == 0)
+        {
+            return;
+        }
+    }
+
+    // Pick the slot after the newest entry; at capacity that is the oldest one, which is evicted.
+    HistoryEntry *slot = &history[(history_head + current_history_count) % history_capacity];
+    if (current_history_count == history_capacity)
+    {
+        if (slot->owned)
+        {
+            free((char *)slot->text);
+            history_file_contiguous = false; // The mapped lines are all gone from the ring.
+        }
+        else
+        {
+            history_file_floor += slot->len + 1; // The oldest mapped line moves forward.
+        }
+        history_head = (history_head + 1) % history_capacity;
+        current_history_count--;
+    }
+
+    // Add the new command to history.
+    slot->text = strndup(cmd, len);
+    slot->len = len;
+    slot->owned = true;
+    current_history_count++;
+    history_index_add(slot->text, len);
+
+    // Persist it: one write of the command and its newline.
+    if (history_file_fd >= 0)
+    {
+        struct iovec parts[2] = {{(void *)cmd, len}, {"\n", 1}};
+        if (writev(history_file_fd, parts, 2) < 0)
+        {
+            perror("history file");
+            close(history_file_fd);
+            history_file_fd = -1;
+        }
+    }
+}
+
+/**
+ * Allocates the history ring the first time a command is recorded, so shells that never add to
+ * the history, and batch runs until their first line has run, do not pay for it at startup.
+ *
+ * @return False if the allocation failed.
+ */
+bool history_reserve()
+{
+    if (history == NULL)
+    {
+        history = calloc(history_capacity, sizeof(HistoryEntry));
+        if (history == NULL)
+        {
+            perror("Failed to allocate memory for history");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns a history entry by its number as shown by 'history': 1 is the most recent command.
+ *
+ * @param command_number Number of the entry, between 1 and current_history_count.
+ * @return The entry.
+ */
+HistoryEntry *history_at(int command_number)
+{
+    return &history[(history_head + current_history_count - command_number) % history_capacity];
+}
+
+/**
+ * Sets the size of the command history buffer. This function allows dynamically adjusting
+ * the number of commands that can be stored in the shell's history. If the new size is smaller
+ * than the current number of commands in the history, the oldest commands are discarded. If the
+ * new size is larger, the history capacity is increased and, when a history file is in use, the
+ * extra room is filled with older commands from it.
+ *
+ * @param newSize The new size for the command history buffer.
+ */
+void set_history_size(int newSize)
+{
+    // Validate the new size to ensure it's not negative.
+    if (newSize < 0)
+    {
+        fprintf(stderr, "Invalid history size.\n");
+        return; // Exit if the new size is invalid.
+    }
+
+    // Enable or disable adding commands to history based on the new size.
+    if (newSize == 0)
+    {
+        add_to_history_enabled = false; // Disable history if size is set to 0.
+    }
+    else
+    {
+        add_to_history_enabled = true; // Enable history for any size greater than 0.
+    }
+
+    HistoryEntry *resized = calloc(newSize > 0 ? newSize : 1, sizeof(HistoryEntry));
+    if (!resized) // Check for allocation failure.
+    {
+        perror("Unable to resize history");
+        return;
+    }
+
+    // Keep the newest entries; free the ones that no longer fit.
+    int keep = current_history_count > newSize ? newSize : current_history_count;
+    for (int i = 0; i < current_history_count - keep; i++)
+    {
+        HistoryEntry *entry = &history[(history_head + i) % history_capacity];
+        if (entry->owned)
+        {
+            free((char *)entry->text);
+            history_file_contiguous = false;
+        }
+        else
+        {
+            history_file_floor += entry->len + 1;
+        }
+    }
+
+    // Older commands from the history file go first, then the surviving entries in order.
+    int older = 0;
+    if (keep == current_history_count && newSize > keep)
+    {
+        older = history_backfill(resized, newSize - keep);
+    }
+    for (int i = 0; i < keep; i++)
+    {
+        resized[older + i] = history[(history_head + current_history_count - keep + i) % history_capacity];
+    }
+
+    free(history);
+    history = resized;
+    history_head = 0;
+    current_history_count = older + keep;
+    history_capacity = newSize > 0 ? newSize : 1; // A zero-size history is disabled, not empty.
+    history_index_reset(); // Serial numbers no longer match; the next search rebuilds.
+}
+
+/**
+ * Collects commands from the history file that are older than everything in the ring, for
+ * filling a history that just grew. Only lines up to the current floor are considered, and only
+ * while the ring still starts with mapped lines, so no command is skipped or repeated.
+ *
+ * @param entries Array receiving the commands, oldest first.
+ * @param wanted Maximum number of commands to collect.
+ * @return Number of commands written to entries.
+ */
+int history_backfill(HistoryEntry *entries, int wanted)
+{
+    if (history_map == NULL || !history_file_contiguous || wanted <= 0)
+    {
+        return 0;
+    }
+
+    // Walk backwards from the floor, one line at a time, until enough lines were found.
+    int found = 0;
+    size_t end = history_file_floor; // Offset just past the newline of the line being examined.
+    while (found < wanted && end > 0)
+    {
+        const char *nl = end >= 2 ? memrchr(history_map, '\n', end - 1) : NULL;
+        size_t start = nl != NULL ? (size_t)(nl - history_map) + 1 : 0;
+        if (end - 1 > start)
+        {
+            found++;
+        }
+        end = start;
+    }
+
+    // Fill the entries in file order, skipping blank lines.
+    int n = 0;
+    size_t pos = end;
+    while (n < found)
+    {
+        const char *line = history_map + pos;
+        const char *nl = memchr(line, '\n', history_file_floor - pos);
+        size_t len = nl != NULL ? (size_t)(nl - line) : history_file_floor - pos;
+        if (len > 0)
+        {
+            entries[n].text = line;
+            entries[n].len = len;
+            entries[n].owned = false;
+            n++;
+        }
+        pos += len + 1;
+    }
+
+    history_file_floor = end;
+    return n;
+}
+
+/**
+ * Whether the interactive prompt can use the line editor: both ends are a terminal that
+ * understands cursor movement.
+ *
+ * @return True if the editor should be used.
+ */
+bool editor_available()
+{
+    const char *term = getenv("TERM");
+    return isatty(STDIN_FILENO) && isatty(STDOUT_FILENO) && (term == NULL || strcmp(term, "dumb") != 0);
+}
+
+/**
+ * Reads a line at the prompt with the terminal in raw mode. Supports cursor movement (arrows,
+ * Home/End, Ctrl-A/B/E/F), deletion (Backspace, Delete, Ctrl-D/K/U/W), history browsing (Up/Down,
+ * Ctrl-P/N), Ctrl-R incremental search, Tab completion and Ctrl-L. Ctrl-C discards the line. The
+ * terminal is back in its normal mode when this returns, so commands run as usual.
+ *
+ * @param prompt The prompt to show.
+ * @return The line without a newline, valid until the next call, or NULL at end of input.
+ */
+char *editor_read_line(const char *prompt)
+{
+    struct termios cooked, raw;
+    if (tcgetattr(STDIN_FILENO, &cooked) < 0)
+    {
+        return NULL;
+    }
+    raw = cooked;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | INPCK | ISTRIP);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // Ctrl-C and Ctrl-Z arrive as keys.
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    EditLine *line = &edit_line;
+    editor_set(line, "", 0);
+    int browsing = 0;    // History entry shown, or 0 for the line being typed.
+    char *typed = NULL;  // The line being typed, saved while browsing.
+    bool tabbed = false; // Whether the previous key was Tab, so a second one lists candidates.
+    bool done = false;
+    char *result = NULL;
+    editor_refresh(prompt, line);
+
+    while (!done)
+    {
+        int key = editor_read_key();
+        bool tab = key == '\t';
+        switch (key)
+        {
+        case -1:
+            done = true; // Input closed.
+            break;
+        case '\r':
+        case '\n':
+            result = line->buf;
+            done = true;
+            break;
+        case CTRL_KEY('D'):
+            if (line->len == 0)
+            {
+                done = true;
+                break;
+            }
+            editor_delete(line, line->cursor, editor_next(line, line->cursor));
+            break;
+        case CTRL_KEY('C'):
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0)
+            {
+                done = true;
+            }
+            editor_set(line, "", 0);
+            browsing = 0;
+            break;
+        case 127:
+        case CTRL_KEY('H'):
+            editor_delete(line, editor_prev(line, line->cursor), line->cursor);
+            break;
+        case KEY_DELETE:
+            editor_delete(line, line->cursor, editor_next(line, line->cursor));
+            break;
+        case KEY_LEFT:
+        case CTRL_KEY('B'):
+            line->cursor = editor_prev(line, line->cursor);
+            break;
+        case KEY_RIGHT:
+        case CTRL_KEY('F'):
+            line->cursor = editor_next(line, line->cursor);
+            break;
+        case KEY_HOME:
+        case CTRL_KEY('A'):
+            line->cursor = 0;
+            break;
+        case KEY_END:
+        case CTRL_KEY('E'):
+            line->cursor = line->len;
+            break;
+        case CTRL_KEY('K'):
+            editor_delete(line, line->cursor, line->len);
+            break;
+        case CTRL_KEY('U'):
+            editor_delete(line, 0, line->cursor);
+            break;
+        case CTRL_KEY('W'):
+        {
+            size_t from = line->cursor;
+            while (from > 0 && line->buf[from - 1] == ' ')
+            {
+                from--;
+            }
+            while (from > 0 && line->buf[from - 1] != ' ')
+            {
+                from--;
+            }
+            editor_delete(line, from, line->cursor);
+            break;
+        }
+        case CTRL_KEY('L'):
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0)
+            {
+                done = true;
+            }
+            break;
+        case KEY_UP:
+        case CTRL_KEY('P'):
+        case KEY_DOWN:
+        case CTRL_KEY('N'):
+        {
+            int next = browsing + (key == KEY_UP || key == CTRL_KEY('P') ? 1 : -1);
+            if (next < 0 || next > current_history_count)
+            {
+                break;
+            }
+            if (browsing == 0)
+            {
+                free(typed);
+                typed = strdup(line->buf);
+                if (typed == NULL)
+                {
+                    perror("Failed to allocate memory");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            browsing = next;
+            if (browsing == 0)
+            {
+                editor_set(line, typed, strlen(typed));
+            }
+            else
+            {
+                HistoryEntry *entry = history_at(browsing);
+                editor_set(line, entry->text, entry->len);
+            }
+            break;
+        }
+        case CTRL_KEY('R'):
+            if (editor_search(line))
+            {
+                result = line->buf;
+                done = true;
+            }
+            break;
+        case '\t':
+            editor_complete(line, tabbed);
+            break;
+        default:
+            if (key >= 32 && key < 256)
+            {
+                char byte = key;
+                editor_insert(line, &byte, 1);
+            }
+            break;
+        }
+        tabbed = tab;
+        if (!done)
+        {
+            editor_refresh(prompt, line);
+        }
+    }
+
+    free(typed);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    if (write(STDOUT_FILENO, "\r\n", result != NULL ? 2 : 1) < 0)
+    {
+        return NULL;
+    }
+    return result;
+}
+
+/**
+ * Reads one key in raw mode, decoding the escape sequences of arrow and editing keys.
+ *
+ * @return The byte read, one of the KEY_ codes, 0 for an unknown sequence, or -1 at end of
+ *         input.
+ */
+int editor_read_key()
+{
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR)
+    {
+        // A child changed state; keep reading.
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    if (c != 0x1b)
+    {
+        return c;
+    }
+
+    // Escape sequences arrive in one burst; a lone Escape does not.
+    unsigned char seq[3];
+    struct pollfd pending = {STDIN_FILENO, POLLIN, 0};
+    if (poll(&pending, 1, 50) <= 0 || read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1)
+    {
+        return 0;
+    }
+    if (seq[0] == '[' && seq[1] >= '0' && seq[1] <= '9')
+    {
+        if (read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~')
+        {
+            return 0;
+        }
+        switch (seq[1])
+        {
+        case '1':
+        case '7':
+            return KEY_HOME;
+        case '3':
+            return KEY_DELETE;
+        case '4':
+        case '8':
+            return KEY_END;
+        }
+        return 0;
+    }
+    if (seq[0] == '[' || seq[0] == 'O')
+    {
+        switch (seq[1])
+        {
+        case 'A':
+            return KEY_UP;
+        case 'B':
+            return KEY_DOWN;
+        case 'C':
+            return KEY_RIGHT;
+        case 'D':
+            return KEY_LEFT;
+        case 'H':
+            return KEY_HOME;
+        case 'F':
+            return KEY_END;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Redraws the prompt and the line with a single write. A line wider than the terminal scrolls
+ * sideways so the cursor stays visible.
+ *
+ * @param prompt The prompt.
+ * @param line The line being edited.
+ */
+void editor_refresh(const char *prompt, const EditLine *line)
+{
+    struct winsize ws;
+    size_t cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    size_t prompt_cols = editor_columns(prompt, strlen(prompt));
+    size_t room = cols > prompt_cols + 1 ? cols - prompt_cols - 1 : 1;
+
+    size_t start = 0;
+    while (editor_columns(line->buf + start, line->cursor - start) > room)
+    {
+        start = editor_next(line, start);
+    }
+    size_t end = start;
+    while (end < line->len && editor_columns(line->buf + start, editor_next(line, end) - start) <= room)
+    {
+        end = editor_next(line, end);
+    }
+
+    char *data = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&data, &size);
+    fprintf(out, "\r%s%.*s\x1b[K\r", prompt, (int)(end - start), line->buf + start);
+    size_t column = prompt_cols + editor_columns(line->buf + start, line->cursor - start);
+    if (column > 0)
+    {
+        fprintf(out, "\x1b[%zuC", column);
+    }
+    fclose(out);
+    write_all(STDOUT_FILENO, data, size);
+    free(data);
+}
+
+/**
+ * Counts the terminal columns a piece of UTF-8 text takes: one per character.
+ *
+ * @param text The text.
+ * @param len Its length in bytes.
+ * @return The number of columns.
+ */
+size_t editor_columns(const char *text, size_t len)
+{
+    size_t columns = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        columns += ((unsigned char)text[i] & 0xc0) != 0x80; // Continuation bytes take no column.
+    }
+    return columns;
+}
+
+/**
+ * Finds the start of the character after a position, skipping UTF-8 continuation bytes.
+ *
+ * @param line The line.
+ * @param pos A position in it.
+ * @return The next character's position, or the length of the line.
+ */
+size_t editor_next(const EditLine *line, size_t pos)
+{
+    if (pos >= line->len)
+    {
+        return line->len;
+    }
+    pos++;
+    while (pos < line->len && ((unsigned char)line->buf[pos] & 0xc0) == 0x80)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * Finds the start of the character before a position.
+ *
+ * @param line The line.
+ * @param pos A position in it.
+ * @return The previous character's position, or 0.
+ */
+size_t editor_prev(const EditLine *line, size_t pos)
+{
+    if (pos == 0)
+    {
+        return 0;
+    }
+    pos--;
+    while (pos > 0 && ((unsigned char)line->buf[pos] & 0xc0) == 0x80)
+    {
+        pos--;
+    }
+    return pos;
+}
+
+/**
+ * Replaces the whole line and puts the cursor at its end.
+ *
+ * @param line The line.
+ * @param text The new text.
+ * @param len Its length.
+ */
+void editor_set(EditLine *line, const char *text, size_t len)
+{
+    line->len = 0;
+    line->cursor = 0;
+    editor_insert(line, text, len);
+}
+
+/**
+ * Inserts text at the cursor and moves the cursor past it. The buffer grows as needed, so lines
+ * have no length limit.
+ *
+ * @param line The line.
+ * @param text The text to insert.
+ * @param len Its length.
+ */
+void editor_insert(EditLine *line, const char *text, size_t len)
+{
+    if (line->len + len + 1 > line->cap)
+    {
+        size_t cap = line->cap > 0 ? line->cap : 256;
+        while (line->len + len + 1 > cap)
+        {
+            cap *= 2;
+        }
+        char *grown = realloc(line->buf, cap);
+        if (grown == NULL)
+        {
+            return; // Keep the line as it is.
+        }
+        line->buf = grown;
+        line->cap = cap;
+    }
+    memmove(line->buf + line->cursor + len, line->buf + line->cursor, line->len - line->cursor);
+    memcpy(line->buf + line->cursor, text, len);
+    line->len += len;
+    line->cursor += len;
+    line->buf[line->len] = '\0';
+}
+
+/**
+ * Deletes a range of the line and puts the cursor where it started.
+ *
+ * @param line The line.
+ * @param from Start of the range.
+ * @param to End of the range.
+ */
+void editor_delete(EditLine *line, size_t from, size_t to)
+{
+    if (from >= to)
+    {
+        return;
+    }
+    memmove(line->buf + from, line->buf + to, line->len - to + 1);
+    line->len -= to - from;
+    line->cursor = from;
+}
+
+/**
+ * Runs Ctrl-R incremental search: every key typed narrows the search to the most recent command
+ * containing the query, Ctrl-R moves to the next older match, and Backspace widens it again.
+ * Enter runs the match, or an empty line if nothing matches, so the line typed before the search
+ * never runs by accident. Ctrl-G or Ctrl-C cancels, and any other key keeps the match for editing.
+ *
+ * @param line The line; receives the match.
+ * @return True if the match should run right away.
+ */
+bool editor_search(EditLine *line)
+{
+    char query[256];
+    size_t query_len = 0;
+    query[0] = '\0';
+    int match = 0; // Command number of the match, or 0.
+    while (true)
+    {
+        HistoryEntry *entry = match > 0 ? history_at(match) : NULL;
+        char *data = NULL;
+        size_t size = 0;
+        FILE *out = open_memstream(&data, &size);
+        fprintf(out, "\r%s`%s': %.*s\x1b[K", match == 0 && query_len > 0 ? "(failed reverse-i-search)" : "(reverse-i-search)",
+                query, entry != NULL ? (int)entry->len : 0, entry != NULL ? entry->text : "");
+        fclose(out);
+        write_all(STDOUT_FILENO, data, size);
+        free(data);
+
+        int key = editor_read_key();
+        if (key == CTRL_KEY('R'))
+        {
+            int older = query_len > 0 ? history_search(query, match) : 0;
+            match = older > 0 ? older : match;
+        }
+        else if (key == 127 || key == CTRL_KEY('H'))
+        {
+            if (query_len > 0) // Nothing to widen with an empty query.
+            {
+                query[--query_len] = '\0';
+                match = query_len > 0 ? history_search(query, 0) : 0;
+            }
+        }
+        else if (key >= 32 && key != 127 && key < 256 && query_len < sizeof(query) - 1)
+        {
+            query[query_len++] = key;
+            query[query_len] = '\0';
+            match = history_search(query, match > 0 ? match - 1 : 0); // The current match may still fit.
+        }
+        else if (key == CTRL_KEY('G') || key == CTRL_KEY('C') || key < 0)
+        {
+            return false; // The line is left as it was.
+        }
+        else
+        {
+            bool run = key == '\r' || key == '\n';
+            if (entry != NULL)
+            {
+                editor_set(line, entry->text, entry->len);
+            }
+            else if (run)
+            {
+                editor_set(line, "", 0);
+            }
+            return run;
+        }
+    }
+}
+
+/**
+ * Completes the word before the cursor. The first word of a command completes to built-ins and
+ * to commands on PATH, other words to file names. A single candidate is inserted whole; several
+ * are completed to their common prefix, and listed when Tab is pressed twice.
+ *
+ * @param line The line.
+ * @param list Whether to list the candidates if the word cannot be extended.
+ */
+void editor_complete(EditLine *line, bool list)
+{
+    size_t start = line->cursor;
+    while (start > 0 && strchr(" \t|;&<>()", line->buf[start - 1]) == NULL)
+    {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && (line->buf[before - 1] == ' ' || line->buf[before - 1] == '\t'))
+    {
+        before--;
+    }
+    char *word = strndup(line->buf + start, line->cursor - start);
+    if (word == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    bool command = (before == 0 || strchr("|;&(", line->buf[before - 1]) != NULL) && strchr(word, '/') == NULL;
+
+    // Collect the candidates: names that start with the part being completed.
+    Completion found = {NULL, 0, 0};
+    const char *prefix = word;
+    if (command)
+    {
+        for (int i = 0; i < NUM_BUILTINS; i++)
+        {
+            completion_add(&found, builtins[i].name, prefix, false);
+        }
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+        {
+            for (PathCacheEntry *entry = path_cache[i]; entry != NULL; entry = entry->next)
+            {
+                completion_add(&found, entry->name, prefix, false);
+            }
+        }
+        completion_load_commands();
+        for (int i = 0; i < path_commands.count; i++)
+        {
+            completion_add(&found, path_commands.names[i], prefix, false);
+        }
+    }
+    else
+    {
+        char *slash = strrchr(word, '/');
+        char *dir_name = slash == NULL ? strdup(".") : slash == word ? strdup("/") : strndup(word, slash - word);
+        if (dir_name == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        prefix = slash != NULL ? slash + 1 : word;
+        DIR *dir = opendir(dir_name);
+        struct dirent *dirent;
+        while (dir != NULL && (dirent = readdir(dir)) != NULL)
+        {
+            if (dirent->d_name[0] == '.' && prefix[0] != '.')
+            {
+                continue; // Hidden unless asked for.
+            }
+            bool is_dir = dirent->d_type == DT_DIR;
+            if (dirent->d_type == DT_UNKNOWN || dirent->d_type == DT_LNK)
+            {
+                struct stat st;
+                is_dir = fstatat(dirfd(dir), dirent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+            }
+            completion_add(&found, dirent->d_name, prefix, is_dir);
+        }
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        free(dir_name);
+    }
+
+    // Sort and drop duplicates, then extend the word as far as all candidates agree.
+    qsort(found.names, found.count, sizeof(char *), compare_strings);
+    int unique = 0;
+    for (int i = 0; i < found.count; i++)
+    {
+        if (unique > 0 && strcmp(found.names[unique - 1], found.names[i]) == 0)
+        {
+            free(found.names[i]);
+            continue;
+        }
+        found.names[unique++] = found.names[i];
+    }
+    found.count = unique;
+
+    size_t prefix_len = strlen(prefix);
+    if (found.count == 1)
+    {
+        const char *name = found.names[0];
+        size_t len = strlen(name);
+        editor_insert(line, name + prefix_len, len - prefix_len);
+        if (name[len - 1] != '/')
+        {
+            editor_insert(line, " ", 1);
+        }
+    }
+    else if (found.count > 1)
+    {
+        size_t common = strlen(found.names[0]);
+        for (int i = 1; i < found.count; i++)
+        {
+            size_t same = 0;
+            while (same < common && found.names[i][same] == found.names[0][same])
+            {
+                same++;
+            }
+            common = same;
+        }
+        if (common > prefix_len)
+        {
+            editor_insert(line, found.names[0] + prefix_len, common - prefix_len);
+        }
+        else if (list)
+        {
+            write_all(STDOUT_FILENO, "\r\n", 2);
+            for (int i = 0; i < found.count; i++)
+            {
+                write_all(STDOUT_FILENO, found.names[i], strlen(found.names[i]));
+                write_all(STDOUT_FILENO, i + 1 < found.count ? "  " : "\r\n", 2);
+            }
+        }
+    }
+    if (found.count == 0 || (found.count > 1 && !list))
+    {
+        write_all(STDOUT_FILENO, "\a", 1);
+    }
+
+    for (int i = 0; i < found.count; i++)
+    {
+        free(found.names[i]);
+    }
+    free(found.names);
+    free(word);
+}
+
+/**
+ * Adds a name to the completion candidates if it starts with the given prefix.
+ *
+ * @param found The candidates.
+ * @param name The name.
+ * @param prefix What has been typed so far.
+ * @param is_dir Whether the name is a directory, which gets a '/' appended.
+ */
+void completion_add(Completion *found, const char *name, const char *prefix, bool is_dir)
+{
+    if (strncmp(name, prefix, strlen(prefix)) != 0)
+    {
+        return;
+    }
+    if (found->count == found->cap)
+    {
+        found->cap = found->cap > 0 ? found->cap * 2 : 32;
+        char **names = realloc(found->names, found->cap * sizeof(char *));
+        if (names == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        found->names = names;
+    }
+    char *copy = malloc(strlen(name) + 2);
+    if (copy == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(copy, "%s%s", name, is_dir ? "/" : "");
+    found->names[found->count++] = copy;
+}
+
+/**
+ * Lists the commands on PATH for completion. The listing is kept until PATH changes, so only the
+ * first Tab after a change reads the directories.
+ */
+void completion_load_commands()
+{
+    const char *path = env_value("PATH");
+    path = path != NULL ? path : "/bin:/usr/bin";
+    if (path_commands_path != NULL && strcmp(path_commands_path, path) == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < path_commands.count; i++)
+    {
+        free(path_commands.names[i]);
+    }
+    free(path_commands.names);
+    memset(&path_commands, 0, sizeof(path_commands));
+    free(path_commands_path);
+    path_commands_path = strdup(path);
+    if (path_commands_path == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *dir_start = path;
+    while (true)
+    {
+        const char *end = strchrnul(dir_start, ':');
+        char *dir_name = end > dir_start ? strndup(dir_start, end - dir_start) : strdup(".");
+        if (dir_name == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        DIR *dir = opendir(dir_name);
+        struct dirent *dirent;
+        while (dir != NULL && (dirent = readdir(dir)) != NULL)
+        {
+            if (dirent->d_name[0] != '.' && dirent->d_type != DT_DIR)
+            {
+                completion_add(&path_commands, dirent->d_name, "", false);
+            }
+        }
+        if (dir != NULL)
+        {
+            closedir(dir);
+        }
+        free(dir_name);
+        if (*end == '\0')
+        {
+            break;
+        }
+        dir_start = end + 1;
+    }
+}
+
+/**
+ * qsort() comparator for strings.
+ *
+ * @param a Pointer to the first string.
+ * @param b Pointer to the second string.
+ * @return Negative, zero or positive like strcmp().
+ */
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Finds the most recent command containing a string, older than a given one. Queries of three
+ * characters or more go through the trigram index: only the commands on the shortest posting
+ * list of the query's trigrams are checked, so a search stays instant in a large history.
+ * Shorter queries scan the ring.
+ *
+ * @param query The text to look for.
+ * @param after Command number to search below (1 is the most recent command), or 0 for all.
+ * @return Command number of the match, or 0 if there is none.
+ */
+int history_search(const char *query, int after)
+{
+    size_t len = strlen(query);
+    if (len < 3)
+    {
+        for (int n = after + 1; n <= current_history_count; n++)
+        {
+            HistoryEntry *entry = history_at(n);
+            if (memmem(entry->text, entry->len, query, len) != NULL)
+            {
+                return n;
+            }
+        }
+        return 0;
+    }
+
+    // Rebuild once stale postings of evicted commands outnumber the live ones.
+    if (history_index.num_slots == 0 || history_index.indexed > (unsigned long)current_history_count + 1024)
+    {
+        history_index_build();
+    }
+    TrigramPosting *rarest = NULL;
+    for (size_t i = 0; i + 3 <= len; i++)
+    {
+        TrigramPosting *posting = history_index_slot(trigram_key(query + i), false);
+        if (posting == NULL)
+        {
+            return 0; // Some trigram is in no command at all.
+        }
+        if (rarest == NULL || posting->count < rarest->count)
+        {
+            rarest = posting;
+        }
+    }
+
+    // Walk the posting list from the newest command that is older than 'after'.
+    unsigned long newest = history_index.top - after;
+    for (uint32_t i = rarest->count; i > 0; i--)
+    {
+        unsigned long serial = rarest->serials[i - 1];
+        if (serial > newest)
+        {
+            continue;
+        }
+        long n = (long)(history_index.top - serial) + 1;
+        if (n > current_history_count)
+        {
+            break; // Evicted from the ring, like everything older.
+        }
+        HistoryEntry *entry = history_at(n);
+        if (memmem(entry->text, entry->len, query, len) != NULL)
+        {
+            return n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Builds the trigram index from the commands currently in the history ring.
+ */
+void history_index_build()
+{
+    history_index_reset();
+    history_index.num_slots = 1024;
+    history_index.slots = calloc(history_index.num_slots, sizeof(TrigramPosting));
+    if (history_index.slots == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int n = current_history_count; n >= 1; n--)
+    {
+        HistoryEntry *entry = history_at(n);
+        history_index_add(entry->text, entry->len);
+    }
+    history_index.indexed = 0;
+}
+
+/**
+ * Adds the newest command to the trigram index, if the index has been built.
+ *
+ * @param text The command.
+ * @param len Its length.
+ */
+void history_index_add(const char *text, size_t len)
+{
+    if (history_index.num_slots == 0)
+    {
+        return; // Built on the first search.
+    }
+    uint32_t serial = ++history_index.top;
+    history_index.indexed++;
+    for (size_t i = 0; i + 3 <= len; i++)
+    {
+        TrigramPosting *posting = history_index_slot(trigram_key(text + i), true);
+        if (posting->count > 0 && posting->serials[posting->count - 1] == serial)
+        {
+            continue; // Trigram repeated within the command.
+        }
+        if (posting->count == posting->cap)
+        {
+            posting->cap = posting->cap > 0 ? posting->cap * 2 : 4;
+            uint32_t *serials = realloc(posting->serials, posting->cap * sizeof(uint32_t));
+            if (serials == NULL)
+            {
+                perror("Failed to allocate memory");
+                exit(EXIT_FAILURE);
+            }
+            posting->serials = serials;
+        }
+        posting->serials[posting->count++] = serial;
+    }
+}
+
+/**
+ * Finds the posting list of a trigram, optionally creating it. The table doubles when it is
+ * half full.
+ *
+ * @param key The trigram's key.
+ * @param create Whether to add a missing list.
+ * @return The posting list, or NULL if it is missing and not created.
+ */
+TrigramPosting *history_index_slot(uint32_t key, bool create)
+{
+    if (create && (history_index.used + 1) * 2 > history_index.num_slots)
+    {
+        // Rehash into a table twice the size.
+        size_t num_slots = history_index.num_slots * 2;
+        TrigramPosting *slots = calloc(num_slots, sizeof(TrigramPosting));
+        if (slots == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < history_index.num_slots; i++)
+        {
+            TrigramPosting *old = &history_index.slots[i];
+            if (old->key != 0)
+            {
+                size_t j = (old->key * 2654435761u) & (num_slots - 1);
+                while (slots[j].key != 0)
+                {
+                    j = (j + 1) & (num_slots - 1);
+                }
+                slots[j] = *old;
+            }
+        }
+        free(history_index.slots);
+        history_index.slots = slots;
+        history_index.num_slots = num_slots;
+    }
+
+    size_t mask = history_index.num_slots - 1;
+    for (size_t i = (key * 2654435761u) & mask;; i = (i + 1) & mask)
+    {
+        TrigramPosting *posting = &history_index.slots[i];
+        if (posting->key == key)
+        {
+            return posting;
+        }
+        if (posting->key == 0)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            posting->key = key;
+            history_index.used++;
+            return posting;
+        }
+    }
+}
+
+/**
+ * Forgets the trigram index; the next search rebuilds it. Called whenever the history ring is
+ * rearranged rather than appended to.
+ */
+void history_index_reset()
+{
+    for (size_t i = 0; i < history_index.num_slots; i++)
+    {
+        free(history_index.slots[i].serials);
+    }
+    free(history_index.slots);
+    memset(&history_index, 0, sizeof(history_index));
+}
+
+/**
+ * Packs three bytes of text into a trigram key; never 0, which marks a free slot.
+ *
+ * @param text The three bytes.
+ * @return The key.
+ */
+uint32_t trigram_key(const char *text)
+{
+    return ((uint32_t)(unsigned char)text[0] << 16 | (uint32_t)(unsigned char)text[1] << 8 | (unsigned char)text[2]) + 1;
+}
+
+/**
+ * Opens the persistent history file and loads its most recent commands. The file is mapped
+ * read-only and scanned backwards from its end, so startup only touches the lines that fit in
+ * the history; loaded entries point into the mapping instead of being copied. New commands are
+ * appended to the file as they are added.
+ *
+ * @param path Path of the history file.
+ */
+void init_history_file(const char *path)
+{
+    history_file_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history_file_fd < 0)
+    {
+        perror("history file");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(history_file_fd, &st) != 0 || st.st_size == 0)
+    {
+        return; // Nothing recorded yet.
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_file_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return; // History still gets appended; it just cannot be loaded.
+    }
+    history_map = map;
+    history_map_size = st.st_size;
+
+    // A file that does not end in a newline has a partial last line; start after it.
+    size_t end = history_map_size;
+    if (history_map[end - 1] != '\n')
+    {
+        const char *nl = memrchr(history_map, '\n', end);
+        end = nl != NULL ? (size_t)(nl - history_map) + 1 : 0;
+        if (write(history_file_fd, "\n", 1) != 1) // Keep later appends on a line of their own.
+        {
+            perror("history file");
+        }
+    }
+
+    history_file_floor = end;
+    history_file_contiguous = true;
+    if (!history_reserve())
+    {
+        return;
+    }
+    current_history_count = history_backfill(history, history_capacity);
+    history_head = 0;
+}
+
+/**
+ * Executes a specific command from history based on its number.
+ *
+ * @param command_number The number of the command in history to execute.
+ */
+void execute_history_command(int command_number)
+{
+    // Validate the command number.
+    if (command_number < 1 || command_number > current_history_count)
+    {
+        printf("Invalid history command number.\n");
+        return;
+    }
+
+    // Duplicate the command to ensure it can be modified if needed.
+    HistoryEntry *entry = history_at(command_number);
+    char *cmd = strndup(entry->text, entry->len);
+
+    // Temporarily disable adding commands to history to prevent recursion.
+    bool oldHistoryState = add_to_history_enabled;
+    add_to_history_enabled = false;
+    parse_and_execute(cmd);                   // Parse and execute the duplicated command.
+    add_to_history_enabled = oldHistoryState; // Restore the history state.
+
+    free(cmd); // Clean up the duplicated command string.
+}
+
+/**
+ * Validates if the provided command and arguments are syntactically correct.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the command is valid, False otherwise.
+ */
+bool isValidCommand(char *argv[])
+{
+    // Command cannot be empty.
+    if (argv[0] == NULL || strcmp(argv[0], "") == 0)
+    {
+        printf("Error: Command is empty.\n");
+        return false;
+    }
+
+    // Built-in commands carry their own argument checks.
+    const Builtin *builtin = find_builtin(argv[0]);
+    if (builtin != NULL && builtin->validator != NULL)
+    {
+        return builtin->validator(argv);
+    }
+
+    return true; // If all checks pass, the command is considered valid.
+}
+
+/**
+ * Special validation for 'cd' command: must have exactly one argument.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the arguments are valid.
+ */
+bool validate_cd(char *argv[])
+{
+    if (argv[1] == NULL || argv[2] != NULL)
+    {
+        printf("cd: wrong number of arguments. Usage: cd <directory>\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 'exit' command should not have any arguments.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the arguments are valid.
+ */
+bool validate_exit(char *argv[])
+{
+    if (argv[1] != NULL)
+    {
+        printf("exit: does not take any arguments.\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 'export' and 'local' commands require a VAR=value format.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the arguments are valid.
+ */
+bool validate_assignment(char *argv[])
+{
+    if (argv[1] == NULL || argv[2] != NULL || strchr(argv[1], '=') == NULL || argv[1][0] == '=')
+    {
+        printf("%s: incorrect usage. Expected format: %s VAR=value\n", argv[0], argv[0]);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 'history' command checks for correct usage: no argument, a command number, or 'set' with a
+ * size. A size of 0 is accepted; it turns history off.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the arguments are valid.
+ */
+bool validate_history(char *argv[])
+{
+    if (argv[1] == NULL)
+    {
+        return true;
+    }
+    if (strcmp(argv[1], "set") == 0)
+    {
+        if (argv[2] == NULL || argv[2][strspn(argv[2], "0123456789")] != '\0' || argv[2][0] == '\0' || argv[3] != NULL)
+        {
+            printf("history set: incorrect usage.\n");
+            return false;
+        }
+    }
+    else if (argv[1][strspn(argv[1], "0123456789")] != '\0' || argv[2] != NULL)
+    {
+        printf("history: incorrect usage. Usage: history [set <size>]\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * 'hash' accepts either '-r' alone or a list of command names.
+ *
+ * @param argv Array of command arguments to validate.
+ * @return True if the arguments are valid.
+ */
+bool validate_hash(char *argv[])
+{
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0 && argv[2] != NULL)
+    {
+        printf("hash: incorrect usage. Usage: hash [-r | name...]\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses the input command and executes it. This function handles both built-in and external commands,
+ * including support for piping, command lists and command history. The line is lexed once into a list
+ * of pipelines held in the line arena; classification, execution and history all work from that
+ * structure.
+ *
+ * @param input The command line input to parse and execute.
+ */
+void parse_and_execute(char *input)
+{
+    // Remove trailing newline, if present, to clean the input for processing.
+    size_t len = strlen(input);
+    if (len > 0 && input[len - 1] == '\n')
+    {
+        input[len - 1] = '\0';
+    }
+
+    // Everything the line needs lives in the arena until this call returns. Nested calls (for
+    // 'history N') release only what they allocated themselves.
+    ArenaMark mark = arena_mark(&line_arena);
+    execute_parsed(input, parse_timed(input));
+    arena_release(&line_arena, mark);
+}
+
+/**
+ * Executes a line that has been parsed already, by parse_line() or from a compiled script.
+ * Pipelines run in list order; one after '&&' or '||' is skipped, without expanding or starting
+ * anything, when the status of the last pipeline that ran says so.
+ *
+ * @param input The source line, for history.
+ * @param pipeline The parsed line in the line arena, or NULL if it did not parse.
+ */
+void execute_parsed(char *input, Pipeline *pipeline)
+{
+    if (stats.enabled && ++stats.lines % (stats.report_every > 0 ? stats.report_every : ULONG_MAX) == 0)
+    {
+        report_stats(); // Periodic report requested with WSH_STATS=N.
+    }
+
+    // Nothing to do for a blank line or one that failed to parse.
+    if (pipeline == NULL || pipeline->num_cmds == 0)
+    {
+        return;
+    }
+
+    // One table lookup both classifies each pipeline and selects its handler. Lines made only of
+    // shell built-ins bypass history addition; utilities such as echo stand in for external
+    // commands and are recorded like them.
+    bool record = false;
+    for (Pipeline *each = pipeline; each != NULL; each = each->next)
+    {
+        const Builtin *builtin = each->num_cmds == 1 && each->cmds[0]->argc > 0 ? find_builtin(each->cmds[0]->argv[0]) : NULL;
+        record = record || builtin == NULL || builtin->utility;
+        if ((each->op == LIST_AND && last_status != 0) || (each->op == LIST_OR && last_status == 0))
+        {
+            continue; // Short-circuited: the status stays that of the last pipeline that ran.
+        }
+
+        unsigned long serial = pipe_status_serial;
+        last_status = execute_pipeline(each, builtin) & 0xff;
+        if (pipe_status_serial == serial && pipe_status_reserve(1))
+        {
+            pipe_status[0] = last_status; // No job recorded anything more detailed.
+            pipe_status_count = 1;
+        }
+    }
+    if (record)
+    {
+        add_to_history(input); // Add the command to history.
+    }
+}
+
+/**
+ * Executes one pipeline of a command list.
+ *
+ * @param pipeline The pipeline.
+ * @param builtin The built-in it consists of, or NULL if it has external commands or several stages.
+ * @return Its exit status: that of the last stage, or 0 if it runs in the background.
+ */
+int execute_pipeline(Pipeline *pipeline, const Builtin *builtin)
+{
+    if (pipeline->cmds[0]->argc == 0 && pipeline->num_cmds == 1)
+    {
+        return 0; // Only redirections: nothing to run.
+    }
+
+    // Directly execute built-in commands. A utility with 'with' settings runs as a forked
+    // stage instead, so that the settings apply to it.
+    if (builtin != NULL && builtin->utility && pipeline->attrs != NULL)
+    {
+        return execute_piped_commands(pipeline);
+    }
+    if (builtin != NULL)
+    {
+        char **argv = prepare_argv(pipeline->cmds[0]);
+        LaunchSpec spec = {-1, -1, -1, {{0, 0, false}}, 0, -1, NULL};
+        if (argv[0] == NULL)
+        {
+            return 0;
+        }
+        if (pipeline->timed || profile_fd >= 0)
+        {
+            // Measured runs go through a job so they are reported like any other command.
+            sigset_t saved;
+            block_child_signals(&saved);
+            Job *job = job_for_pipeline(pipeline, 1);
+            int status = run_stage_in_shell(builtin, argv, pipeline->cmds[0], &spec, job_add_process(job, 0, argv[0]));
+            job_remove(job);
+            sigprocmask(SIG_SETMASK, &saved, NULL);
+            return status;
+        }
+        return run_builtin_in_shell(builtin, argv, pipeline->cmds[0], &spec);
+    }
+
+    if (pipeline->num_cmds == 1 && pipeline->memo && !pipeline->background && pipeline->cmds[0]->num_redirs == 0)
+    {
+        // Serve a repeated command from the memo cache.
+        return execute_memoized(pipeline);
+    }
+    if (pipeline->num_cmds == 1)
+    {
+        // Execute a single command without piping.
+        return execute_command(pipeline);
+    }
+    // Execute piped commands, built-in stages included.
+    return execute_piped_commands(pipeline);
+}
+
+/**
+ * Opens a batch file. Regular files are mapped privately so lines can be terminated in place
+ * without copying them; pipes, FIFOs and other unmappable inputs are read through a stream
+ * with a large buffer instead. Lines have no length limit in either mode.
+ *
+ * @param reader The reader to initialize.
+ * @param path Path of the batch file.
+ * @return True on success, false with errno set on failure.
+ */
+bool batch_reader_open(BatchReader *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            close(fd); // The mapping stays valid after the descriptor is gone.
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            reader->data = data;
+            reader->size = st.st_size;
+            return true;
+        }
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return true; // Empty file: nothing to read and nothing to map.
+    }
+
+    // Fall back to buffered streaming for anything that cannot be mapped.
+    reader->stream = fdopen(fd, "r");
+    if (reader->stream == NULL)
+    {
+        close(fd);
+        return false;
+    }
+    setvbuf(reader->stream, NULL, _IOFBF, BATCH_STREAM_BUFFER);
+    return true;
+}
+
+/**
+ * Returns the next line of a batch file with its newline removed. The returned string is
+ * writable and stays valid until the next call; in mapped mode it points straight into the
+ * file mapping.
+ *
+ * @param reader The reader to read from.
+ * @param len Receives the length of the returned line.
+ * @return The line, or NULL at end of input.
+ */
+char *batch_reader_next(BatchReader *reader, size_t *len)
+{
+    if (reader->stream != NULL)
+    {
+        ssize_t n = getline(&reader->line, &reader->cap, reader->stream);
+        if (n < 0)
+        {
+            return NULL;
+        }
+        if (n > 0 && reader->line[n - 1] == '\n')
+        {
+            reader->line[--n] = '\0'; // Remove newline character.
+        }
+        *len = n;
+        return reader->line;
+    }
+
+    if (reader->pos >= reader->size)
+    {
+        return NULL;
+    }
+
+    // Terminating lines in place dirties the private mapping. Give consumed pages back now and
+    // then so resident memory stays flat however long the script is.
+    if (reader->pos - reader->dropped >= BATCH_DROP_INTERVAL)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t upto = reader->pos / page * page;
+        madvise(reader->data + reader->dropped, upto - reader->dropped, MADV_DONTNEED);
+        reader->dropped = upto;
+    }
+
+    char *start = reader->data + reader->pos;
+    size_t remaining = reader->size - reader->pos;
+    char *newline = memchr(start, '\n', remaining);
+    if (newline != NULL)
+    {
+        *newline = '\0'; // Terminate the line in place.
+        *len = newline - start;
+        reader->pos += *len + 1;
+        return start;
+    }
+
+    // Last line without a trailing newline. The byte after the file is zero-filled by the
+    // kernel unless the file ends exactly on a page boundary, in which case it is copied.
+    reader->pos = reader->size;
+    *len = remaining;
+    if (reader->size % sysconf(_SC_PAGESIZE) != 0)
+    {
+        return start;
+    }
+    free(reader->tail);
+    reader->tail = strndup(start, remaining);
+    return reader->tail;
+}
+
+/**
+ * Releases everything held by a batch file reader.
+ *
+ * @param reader The reader to close.
+ */
+void batch_reader_close(BatchReader *reader)
+{
+    if (reader->data != NULL)
+    {
+        munmap(reader->data, reader->size);
+    }
+    if (reader->stream != NULL)
+    {
+        fclose(reader->stream);
+    }
+    free(reader->line);
+    free(reader->tail);
+    memset(reader, 0, sizeof(*reader));
+}
+
+/**
+ * Names the cache file of a compiled script: the script's path with a 'c' appended, so
+ * 'build.wsh' is compiled to 'build.wshc'.
+ *
+ * @param path Path of the script.
+ * @param cache Buffer receiving the cache path.
+ * @param size Size of the buffer.
+ * @return False if the cache path does not fit.
+ */
+bool compiled_path(const char *path, char *cache, size_t size)
+{
+    return (size_t)snprintf(cache, size, "%sc", path) < size;
+}
+
+/**
+ * Loads the compiled form of a script if its cache file exists and was made from the script as
+ * it is now: same device, inode, size and modification time, and a body with the recorded size
+ * and hash. Every record is also decoded once before the script runs, so a damaged cache is rebuilt from the text instead of
+ * failing halfway through.
+ *
+ * @param path Path of the script.
+ * @param script Receives the compiled script.
+ * @return False if there is no usable cache file.
+ */
+bool compiled_script_open(const char *path, CompiledScript *script)
+{
+    struct stat source, st;
+    CompiledHeader header;
+    char cache[PATH_MAX];
+    int fd = compiled_path(path, cache, sizeof(cache)) ? open(cache, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool fresh = stat(path, &source) == 0 && fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 memcmp(header.magic, COMPILED_MAGIC, 4) == 0 && header.version == COMPILED_VERSION &&
+                 header.dev == (uint64_t)source.st_dev && header.ino == (uint64_t)source.st_ino &&
+                 header.size == source.st_size && header.mtime_sec == source.st_mtim.tv_sec &&
+                 header.mtime_nsec == source.st_mtim.tv_nsec && header.body_size == st.st_size - sizeof(header);
+    void *map = fresh ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    script->data = map;
+    script->size = st.st_size;
+    script->mapped = true;
+    script->pos = script->data + sizeof(header);
+    script->end = script->data + st.st_size;
+    script->bad = hash_bytes(script->pos, header.body_size) != header.body_hash;
+    if (script->bad || !compiled_script_check(script, header.num_lines))
+    {
+        compiled_script_close(script);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Validates a compiled script by decoding every record into the line arena and releasing it
+ * again, then rewinds it. Decoding is bounds-checked, so this finds truncated or overwritten
+ * records as well as impossible list operators, redirections and text positions.
+ *
+ * @param script The compiled script, positioned at its first record.
+ * @param num_lines Number of records the header promises.
+ * @return True if every record decodes and their number matches.
+ */
+bool compiled_script_check(CompiledScript *script, uint32_t num_lines)
+{
+    char *first = script->pos;
+    uint32_t count = 0;
+    Pipeline *pipeline;
+    while (!script->bad && script->pos < script->end)
+    {
+        ArenaMark mark = arena_mark(&line_arena);
+        compiled_script_next(script, &pipeline);
+        arena_release(&line_arena, mark);
+        count++;
+    }
+    script->pos = first;
+    return !script->bad && count == num_lines;
+}
+
+/**
+ * Compiles a script: parses every line once and encodes the result after a header that records
+ * the script's identity. The result is written to the cache file through a temporary file and a
+ * rename, so concurrent runs never see a partial cache. If the cache cannot be written, the
+ * compiled script is still used for this run.
+ *
+ * @param path Path of the script.
+ * @param script Receives the compiled script.
+ * @return False if the script is not a regular file that can be read.
+ */
+bool compile_script(const char *path, CompiledScript *script)
+{
+    BatchReader reader;
+    struct stat source;
+    if (stat(path, &source) != 0 || !S_ISREG(source.st_mode) || !batch_reader_open(&reader, path))
+    {
+        return false;
+    }
+
+    CompiledHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPILED_MAGIC, 4);
+    header.version = COMPILED_VERSION;
+    header.dev = source.st_dev;
+    header.ino = source.st_ino;
+    header.size = source.st_size;
+    header.mtime_sec = source.st_mtim.tv_sec;
+    header.mtime_nsec = source.st_mtim.tv_nsec;
+
+    char *data = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&data, &size);
+    fwrite(&header, sizeof(header), 1, out); // Placeholder, completed below.
+    char *line;
+    size_t len;
+    parse_quiet = true; // Errors are reported when the line runs.
+    while ((line = batch_reader_next(&reader, &len)) != NULL)
+    {
+        if (len == 0)
+        {
+            continue;
+        }
+        ArenaMark mark = arena_mark(&line_arena);
+        Pipeline *pipeline = parse_line(line, &line_arena);
+        compile_string(out, line);
+        compile_pipeline(out, line, pipeline);
+        arena_release(&line_arena, mark);
+        header.num_lines++;
+    }
+    parse_quiet = false;
+    batch_reader_close(&reader);
+    fclose(out);
+
+    header.body_size = size - sizeof(header);
+    header.body_hash = hash_bytes(data + sizeof(header), header.body_size);
+    memcpy(data, &header, sizeof(header));
+
+    // Publish the cache; a read-only directory just means it is rebuilt next time.
+    char cache[PATH_MAX], temp[PATH_MAX + 8];
+    int fd = -1;
+    if (compiled_path(path, cache, sizeof(cache)))
+    {
+        snprintf(temp, sizeof(temp), "%s.XXXXXX", cache);
+        fd = mkstemp(temp);
+    }
+    if (fd >= 0 && (!write_all(fd, data, size) || fchmod(fd, 0644) != 0 || rename(temp, cache) != 0))
+    {
+        unlink(temp);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    script->data = data;
+    script->size = size;
+    script->mapped = false;
+    script->pos = data + sizeof(header);
+    script->end = data + size;
+    script->bad = false;
+    return true;
+}
+
+/**
+ * Encodes a parsed line: a kind byte (0 if it parsed, 1 if it did not or has too many pipelines to
+ * count in 16 bits), then for each pipeline its
+ * list operator, flags, commands and the position of its text in the line, and for each command
+ * its words and redirections. Words are kept in lexer form, so expansion works on them as usual.
+ *
+ * @param out Stream receiving the encoding.
+ * @param line The source line.
+ * @param pipeline The parsed line, or NULL after a syntax error.
+ */
+void compile_pipeline(FILE *out, const char *line, const Pipeline *pipeline)
+{
+    size_t total = 0;
+    for (const Pipeline *each = pipeline; each != NULL; each = each->next)
+    {
+        total++;
+    }
+    // A list too long for its 16-bit count is stored as unparsed and parsed when it runs.
+    uint8_t kind = pipeline == NULL || total > UINT16_MAX;
+    fwrite(&kind, 1, 1, out);
+    if (kind != 0)
+    {
+        return;
+    }
+    uint16_t count = total;
+    fwrite(&count, sizeof(count), 1, out);
+    const char *cursor = line;
+    for (const Pipeline *each = pipeline; each != NULL; each = each->next)
+    {
+        // Pipeline texts are trimmed pieces of the line, in order.
+        const char *text = strstr(cursor, each->text);
+        uint32_t where[2] = {text - line, strlen(each->text)};
+        cursor = text + where[1];
+        uint8_t op = each->op;
+        uint8_t flags = each->background | each->timed << 1 | each->memo << 2 | (each->attrs != NULL) << 3;
+        uint32_t num_cmds = each->num_cmds;
+        fwrite(&op, 1, 1, out);
+        fwrite(&flags, 1, 1, out);
+        fwrite(&num_cmds, sizeof(num_cmds), 1, out);
+        fwrite(where, sizeof(where), 1, out);
+        if (each->attrs != NULL)
+        {
+            // 'with' settings: which are set, then the CPU mask, nice value and cgroup.
+            const LaunchAttrs *attrs = each->attrs;
+            uint8_t which = attrs->set_cpus | attrs->set_nice << 1 | (attrs->cgroup != NULL) << 2;
+            int32_t nice = attrs->nice;
+            fwrite(&which, 1, 1, out);
+            fwrite(&attrs->cpus, sizeof(attrs->cpus), 1, out);
+            fwrite(&nice, sizeof(nice), 1, out);
+            compile_string(out, attrs->cgroup != NULL ? attrs->cgroup : "");
+        }
+        for (int i = 0; i < each->num_cmds; i++)
+        {
+            const Command *cmd = each->cmds[i];
+            uint32_t argc = cmd->argc;
+            uint8_t num_redirs = cmd->num_redirs;
+            fwrite(&argc, sizeof(argc), 1, out);
+            fwrite(&num_redirs, 1, 1, out);
+            for (int a = 0; a < cmd->argc; a++)
+            {
+                compile_string(out, cmd->argv[a]);
+            }
+            for (int r = 0; r < cmd->num_redirs; r++)
+            {
+                uint8_t type = cmd->redirs[r].type, fd = cmd->redirs[r].fd;
+                fwrite(&type, 1, 1, out);
+                fwrite(&fd, 1, 1, out);
+                compile_string(out, cmd->redirs[r].target);
+            }
+        }
+    }
+}
+
+/**
+ * Encodes a string as its length followed by its bytes and a NUL, so decoding can point into the
+ * compiled script instead of copying.
+ *
+ * @param out Stream receiving the encoding.
+ * @param str The string.
+ */
+void compile_string(FILE *out, const char *str)
+{
+    uint32_t len = strlen(str);
+    fwrite(&len, sizeof(len), 1, out);
+    fwrite(str, 1, len + 1, out);
+}
+
+/**
+ * Decodes the next line of a compiled script. Nodes are allocated in the line arena; words point
+ * into the script itself. A record that does not fit in the script or holds impossible values
+ * sets script->bad and ends the script.
+ *
+ * @param script The compiled script.
+ * @param pipeline Receives the parsed line, or NULL if the line does not parse and must be
+ *                 parsed again to report its error.
+ * @return The source line, or NULL at the end of the script or at a damaged record.
+ */
+char *compiled_script_next(CompiledScript *script, Pipeline **pipeline)
+{
+    *pipeline = NULL;
+    if (script->bad || script->pos >= script->end)
+    {
+        return NULL;
+    }
+    struct timespec decode_start, decode_end;
+    clock_gettime(CLOCK_MONOTONIC, &decode_start);
+    char *line = compiled_string(script);
+    uint32_t kind = compiled_number(script, 1);
+    if (kind != 0 || script->bad)
+    {
+        script->bad |= kind > 1;
+        return script->bad ? NULL : line; // Did not parse.
+    }
+    size_t line_len = strlen(line);
+
+    Pipeline *prev = NULL;
+    Pipeline *head = NULL;
+    for (int count = compiled_number(script, 2); count > 0 && !script->bad; count--)
+    {
+        ListOp op = compiled_number(script, 1);
+        int flags = compiled_number(script, 1);
+        Pipeline *each = parse_new_pipeline(prev, op, &line_arena);
+        uint32_t num_cmds = compiled_number(script, 4);
+        each->background = flags & 1;
+        each->timed = flags & 2;
+        each->memo = flags & 4;
+        size_t offset = compiled_number(script, 4), len = compiled_number(script, 4);
+        if (op > LIST_OR || offset > line_len || len > line_len - offset)
+        {
+            script->bad = true;
+            break;
+        }
+        each->text = offset == 0 && len == line_len ? line : arena_strndup(&line_arena, line + offset, len);
+        if (flags & 8)
+        {
+            LaunchAttrs *attrs = arena_alloc(&line_arena, sizeof(LaunchAttrs));
+            int which = compiled_number(script, 1);
+            if ((size_t)(script->end - script->pos) < sizeof(attrs->cpus))
+            {
+                script->bad = true;
+                break;
+            }
+            memcpy(&attrs->cpus, script->pos, sizeof(attrs->cpus));
+            script->pos += sizeof(attrs->cpus);
+            attrs->nice = (int32_t)compiled_number(script, 4);
+            char *cgroup = compiled_string(script);
+            attrs->set_cpus = which & 1;
+            attrs->set_nice = which & 2;
+            attrs->cgroup = which & 4 ? cgroup : NULL;
+            each->attrs = attrs;
+        }
+        for (uint32_t i = 0; i < num_cmds && !script->bad; i++)
+        {
+            Command *cmd = command_new(&line_arena);
+            uint32_t argc = compiled_number(script, 4);
+            cmd->num_redirs = compiled_number(script, 1);
+            if (cmd->num_redirs > MAX_REDIRECTS)
+            {
+                script->bad = true;
+                break;
+            }
+            for (uint32_t a = 0; a < argc && !script->bad; a++)
+            {
+                command_add_word(cmd, compiled_string(script), &line_arena);
+            }
+            for (int r = 0; r < cmd->num_redirs && !script->bad; r++)
+            {
+                cmd->redirs[r].type = compiled_number(script, 1);
+                cmd->redirs[r].fd = compiled_number(script, 1);
+                cmd->redirs[r].target = compiled_string(script);
+                script->bad |= cmd->redirs[r].type > REDIR_PROC_OUT;
+            }
+            pipeline_add_command(each, cmd, &line_arena);
+        }
+        head = head != NULL ? head : each;
+        prev = each;
+    }
+    if (script->bad || head == NULL)
+    {
+        script->bad = true; // A parsed line has at least one pipeline.
+        return NULL;
+    }
+    *pipeline = head;
+    clock_gettime(CLOCK_MONOTONIC, &decode_end);
+    head->parse_ns = elapsed_ns(&decode_start, &decode_end);
+    return line;
+}
+
+/**
+ * Decodes a little number of a compiled script.
+ *
+ * @param script The compiled script.
+ * @param width Its size in bytes: 1, 2 or 4.
+ * @return The number, or 0 with script->bad set if it does not fit in the script.
+ */
+uint32_t compiled_number(CompiledScript *script, size_t width)
+{
+    uint32_t value = 0;
+    if ((size_t)(script->end - script->pos) < width)
+    {
+        script->bad = true;
+        script->pos = script->end;
+        return 0;
+    }
+    if (width == 1)
+    {
+        value = *(uint8_t *)script->pos;
+    }
+    else if (width == 2)
+    {
+        uint16_t half;
+        memcpy(&half, script->pos, 2);
+        value = half;
+    }
+    else
+    {
+        memcpy(&value, script->pos, 4);
+    }
+    script->pos += width;
+    return value;
+}
+
+/**
+ * Decodes a string of a compiled script without copying it.
+ *
+ * @param script The compiled script.
+ * @return The string, inside the script's writable data; empty, with script->bad set, if it
+ *         does not fit in the script or is not terminated where its length says.
+ */
+char *compiled_string(CompiledScript *script)
+{
+    uint32_t len = compiled_number(script, 4);
+    if (script->bad || (size_t)(script->end - script->pos) <= len || script->pos[len] != '\0' ||
+        memchr(script->pos, '\0', len) != NULL)
+    {
+        script->bad = true;
+        script->pos = script->end;
+        return "";
+    }
+    char *str = script->pos;
+    script->pos += len + 1;
+    return str;
+}
+
+/**
+ * Releases a compiled script.
+ *
+ * @param script The compiled script.
+ */
+void compiled_script_close(CompiledScript *script)
+{
+    if (script->mapped)
+    {
+        munmap(script->data, script->size);
+    }
+    else
+    {
+        free(script->data);
+    }
+    memset(script, 0, sizeof(*script));
+}
+
+/**
+ * Executes every line of a batch file. With max_jobs of 1 lines run strictly in order in the
+ * shell itself. Otherwise independent lines are handed to the job slot scheduler, which keeps
+ * up to max_jobs of them running at once, each pinned to a CPU of its own if pin is set. With
+ * compiled set, lines come pre-parsed from the
+ * script's compiled form, which is built and cached next to the script first if it is missing or
+ * out of date.
+ *
+ * @param path Path of the batch file.
+ * @param max_jobs Number of lines allowed to run concurrently.
+ * @param ordered Whether parallel output is replayed in submission order.
+ * @param pin Whether parallel jobs are pinned to CPUs in turn ('-P').
+ * @param compiled Whether to run from the compiled script ('-C').
+ */
+void run_batch_file(const char *path, int max_jobs, bool ordered, bool pin, bool compiled)
+{
+    CompiledScript script = {0};
+    bool use_compiled = compiled && (compiled_script_open(path, &script) || compile_script(path, &script));
+    BatchReader reader = {0};
+    if (!use_compiled && !batch_reader_open(&reader, path)) // Try to open the batch file.
+    {
+        perror("Error opening batch file");
+        exit(-1);
+    }
+
+    BatchScheduler sched = {0};
+    sched.max_jobs = max_jobs;
+    sched.ordered = ordered;
+    if (max_jobs > 1 && ordered)
+    {
+        // Let finished jobs run ahead of a slow one by a few windows before blocking.
+        sched.window = max_jobs * 4;
+        sched.pids = calloc(sched.window, sizeof(pid_t));
+        sched.outputs = calloc(sched.window, sizeof(FILE *));
+        if (sched.pids == NULL || sched.outputs == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (max_jobs > 1 && pin)
+    {
+        batch_pin_init(&sched);
+    }
+
+    // Read and execute commands from the batch file, one line view at a time. Each line is
+    // parsed, or decoded from the compiled script, into the line arena.
+    while (true)
+    {
+        ArenaMark mark = arena_mark(&line_arena);
+        Pipeline *pipeline = NULL;
+        size_t len;
+        char *line = use_compiled ? compiled_script_next(&script, &pipeline) : batch_reader_next(&reader, &len);
+        if (line == NULL)
+        {
+            break;
+        }
+        if (!use_compiled && len == 0)
+        {
+            continue; // Ignore empty lines.
+        }
+        if (pipeline == NULL)
+        {
+            pipeline = parse_timed(line); // Reports a syntax error, if any, here and in order.
+        }
+        if (max_jobs == 1)
+        {
+            job_notify(); // Drop background jobs that have finished.
+            execute_parsed(line, pipeline);
+        }
+        else if (pipeline != NULL)
+        {
+            batch_schedule_line(&sched, line, pipeline);
+        }
+        arena_release(&line_arena, mark);
+    }
+
+    batch_barrier(&sched); // Let the last jobs finish before the shell exits.
+    free(sched.pids);
+    free(sched.outputs);
+    free(sched.cpus);
+    free(sched.cpu_jobs);
+    if (use_compiled)
+    {
+        compiled_script_close(&script);
+    }
+    else
+    {
+        batch_reader_close(&reader);
+    }
+}
+
+/**
+ * Copies the first whitespace-delimited word of a batch line into a buffer.
+ *
+ * @param line The batch line.
+ * @param buf Buffer receiving the word, truncated to fit.
+ * @param size Size of the buffer.
+ * @return False if the line holds only whitespace.
+ */
+bool batch_first_word(const char *line, char *buf, size_t size)
+{
+    size_t skip = strspn(line, " \t");
+    size_t word = strcspn(line + skip, " \t");
+    if (word == 0)
+    {
+        return false;
+    }
+    if (word >= size)
+    {
+        word = size - 1;
+    }
+    memcpy(buf, line + skip, word);
+    buf[word] = '\0';
+    return true;
+}
+
+/**
+ * Runs one batch line under the parallel scheduler. Lines that use built-in commands act as
+ * barriers: every running job finishes first, and the line then runs in the shell itself so that
+ * directory changes and variables are visible to the lines after them. Any other line, utilities
+ * such as echo included, is started in a child once a job slot is free.
+ *
+ * @param sched The scheduler state.
+ * @param line The batch line to run.
+ * @param pipeline The parsed line, in the line arena.
+ */
+void batch_schedule_line(BatchScheduler *sched, char *line, Pipeline *pipeline)
+{
+    // Isolate the first word to classify the line.
+    char first[MAX_LINE_LENGTH];
+    if (!batch_first_word(line, first, sizeof(first)))
+    {
+        return; // Whitespace only.
+    }
+
+    if (batch_list_is_barrier(pipeline))
+    {
+        batch_barrier(sched);
+        execute_parsed(line, pipeline);
+        return;
+    }
+
+    // Wait for a free slot, and in ordered mode for room in the output window.
+    while (sched->running >= sched->max_jobs || (sched->ordered && sched->count == sched->window))
+    {
+        batch_reap_one(sched);
+    }
+
+    FILE *output = NULL;
+    if (sched->ordered)
+    {
+        output = tmpfile();
+        if (output == NULL)
+        {
+            perror("tmpfile");
+            return;
+        }
+    }
+
+    add_to_history(line); // The child's copy of the history is discarded, so record it here.
+    fflush(stdout);       // Do not let the child inherit pending output.
+    fflush(stderr);
+    int cpu = batch_pick_cpu(sched);
+    sigset_t saved;
+    block_child_signals(&saved); // Register the child before the reaper can see it exit.
+    pid_t pid = fork();
+    if (pid == 0) // Child process: run the line like the serial loop would.
+    {
+        job_table_reset(); // The parent's jobs are not this process's children.
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        if (cpu >= 0)
+        {
+            // Everything the line starts inherits the CPU, unless it says otherwise with 'with'.
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(sched->cpus[cpu], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+        add_to_history_enabled = false; // Already recorded by the parent.
+        if (output != NULL)
+        {
+            dup2(fileno(output), STDOUT_FILENO);
+            dup2(fileno(output), STDERR_FILENO);
+        }
+        execute_parsed(line, pipeline);
+        exit(last_status);
+    }
+    else if (pid < 0)
+    {
+        perror("fork failed");
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        if (output != NULL)
+        {
+            fclose(output);
+        }
+        return;
+    }
+
+    Job *job = job_create(line, true, 1);
+    job->batch = true;
+    job_add_process(job, pid, first);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    sched->running++;
+    if (cpu >= 0)
+    {
+        sched->cpu_jobs[cpu] = pid;
+    }
+    if (sched->ordered)
+    {
+        int slot = (sched->head + sched->count++) % sched->window;
+        sched->pids[slot] = pid;
+        sched->outputs[slot] = output;
+    }
+}
+
+/**
+ * Lists the CPUs parallel batch jobs are pinned to: those the shell itself may run on, so the
+ * jobs stay within any affinity or cpuset the shell was started with.
+ *
+ * @param sched The scheduler state.
+ */
+void batch_pin_init(BatchScheduler *sched)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        perror("sched_getaffinity");
+        return; // Run unpinned.
+    }
+    sched->cpus = malloc(CPU_COUNT(&allowed) * sizeof(int));
+    sched->cpu_jobs = calloc(CPU_COUNT(&allowed), sizeof(pid_t));
+    if (sched->cpus == NULL || sched->cpu_jobs == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            sched->cpus[sched->num_cpus++] = cpu;
+        }
+    }
+}
+
+/**
+ * Chooses the CPU the next batch job is pinned to. CPUs are handed out round-robin, skipping
+ * those whose job is still running, so concurrent jobs do not share a CPU while there are enough
+ * of them, and a CPU's cache is reused by the job after the one that last ran there.
+ *
+ * @param sched The scheduler state.
+ * @return Index in sched->cpus, or -1 if jobs are not pinned.
+ */
+int batch_pick_cpu(BatchScheduler *sched)
+{
+    if (sched->num_cpus == 0)
+    {
+        return -1;
+    }
+    int cpu = sched->next_cpu;
+    for (int i = 0; i < sched->num_cpus; i++)
+    {
+        int candidate = (sched->next_cpu + i) % sched->num_cpus;
+        if (sched->cpu_jobs[candidate] == 0)
+        {
+            cpu = candidate;
+            break;
+        }
+    }
+    sched->next_cpu = (cpu + 1) % sched->num_cpus; // More jobs than CPUs: share them in turn.
+    return cpu;
+}
+
+/**
+ * Decides whether a batch line must run in the shell itself: any pipeline of its list, skipped
+ * or not, may be a shell built-in such as cd.
+ *
+ * @param pipeline The parsed line.
+ * @return True if the line is a barrier.
+ */
+bool batch_list_is_barrier(const Pipeline *pipeline)
+{
+    for (; pipeline != NULL; pipeline = pipeline->next)
+    {
+        for (int i = 0; i < pipeline->num_cmds; i++)
+        {
+            const Builtin *builtin = pipeline->cmds[i]->argc > 0 ? find_builtin(pipeline->cmds[i]->argv[0]) : NULL;
+            if (builtin != NULL && !builtin->utility)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Blocks until any running batch job exits and frees its slot. The SIGCHLD reaper collects the
+ * child; this only sleeps until the job table shows one of the scheduler's jobs as done. In ordered mode the job is
+ * marked finished and any output that is now at the front of the window is replayed.
+ *
+ * @param sched The scheduler state.
+ */
+void batch_reap_one(BatchScheduler *sched)
+{
+    sigset_t saved;
+    block_child_signals(&saved);
+    Job *job = job_wait_batch();
+    pid_t pid = job != NULL ? job->pgid : -1;
+    if (job != NULL)
+    {
+        job_remove(job);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (pid < 0)
+    {
+        sched->running = 0; // No children left; the count was stale.
+        return;
+    }
+    sched->running--;
+    for (int i = 0; i < sched->num_cpus; i++)
+    {
+        if (sched->cpu_jobs[i] == pid)
+        {
+            sched->cpu_jobs[i] = 0; // Its CPU is free for the next job.
+        }
+    }
+
+    if (sched->ordered)
+    {
+        for (int i = 0; i < sched->count; i++)
+        {
+            int slot = (sched->head + i) % sched->window;
+            if (sched->pids[slot] == pid)
+            {
+                sched->pids[slot] = 0;
+                break;
+            }
+        }
+        batch_emit_ready(sched);
+    }
+}
+
+/**
+ * Waits for every running batch job, then replays any output still pending.
+ *
+ * @param sched The scheduler state.
+ */
+void batch_barrier(BatchScheduler *sched)
+{
+    while (sched->running > 0)
+    {
+        batch_reap_one(sched);
+    }
+    if (sched->ordered)
+    {
+        batch_emit_ready(sched);
+    }
+}
+
+/**
+ * Copies the captured output of finished jobs to stdout, oldest first, stopping at the first
+ * job that is still running.
+ *
+ * @param sched The scheduler state.
+ */
+void batch_emit_ready(BatchScheduler *sched)
+{
+    fflush(stdout);
+    while (sched->count > 0 && sched->pids[sched->head] == 0)
+    {
+        FILE *output = sched->outputs[sched->head];
+        char buffer[BATCH_STREAM_BUFFER / 4];
+        ssize_t n;
+        lseek(fileno(output), 0, SEEK_SET);
+        while ((n = read(fileno(output), buffer, sizeof(buffer))) > 0)
+        {
+            if (write(STDOUT_FILENO, buffer, n) != n)
+            {
+                break;
+            }
+        }
+        fclose(output);
+
+        sched->outputs[sched->head] = NULL;
+        sched->head = (sched->head + 1) % sched->window;
+        sched->count--;
+    }
+}
+
+/**
+ * Checks if the given command is a built-in command of the shell.
+ *
+ * @param command The command to check.
+ * @return True if the command is built-in, False otherwise.
+ */
+bool isBuiltInCommand(char *command)
+{
+    return find_builtin(command) != NULL;
+}
+
+/**
+ * Executes a series of commands connected by pipes, allowing the output of one command to serve as input to the next.
+ * Stages are started left to right, each with the fast launch backend, and all join the job's
+ * process group. Only the pipe to the next stage is open at any time, so the number of
+ * descriptors the shell holds does not grow with the length of the pipeline.
+ *
+ * @param pipeline The parsed pipeline to execute.
+ * @return The exit status of the last stage, or 0 if the pipeline runs in the background.
+ */
+int execute_piped_commands(Pipeline *pipeline)
+{
+    int num_cmds = pipeline->num_cmds;
+    int pipefds[2];  // Pipe from the current stage to the next one.
+    int fd_in = 0;   // Read end of the pipe from the previous stage, or 0 for the shell's stdin.
+    bool broken = false; // Set once a pipe cannot be created; later stages are not started.
+
+    long pipe_size = pipe_buffer_size(); // Read once per pipeline, not once per pipe.
+
+    // A utility at the end of the pipeline, or else at its start, runs inside the shell once the
+    // other stages are started. Any other built-in stage runs in a forked child.
+    int in_shell = -1;
+    const Builtin *first = pipeline->cmds[0]->argc > 0 ? find_builtin(pipeline->cmds[0]->argv[0]) : NULL;
+    const Builtin *last = pipeline->cmds[num_cmds - 1]->argc > 0 ? find_builtin(pipeline->cmds[num_cmds - 1]->argv[0]) : NULL;
+    if (!pipeline->background && pipeline->attrs == NULL && last != NULL && last->utility)
+    {
+        in_shell = num_cmds - 1;
+    }
+    else if (!pipeline->background && pipeline->attrs == NULL && first != NULL && first->utility)
+    {
+        in_shell = 0;
+    }
+    const Builtin *shell_builtin = in_shell == 0 ? first : last;
+    char **shell_argv = NULL;
+    LaunchSpec shell_spec;
+
+    // Every stage belongs to one job; the reaper must not see a stage before it is recorded.
+    sigset_t saved;
+    block_child_signals(&saved);
+    Job *job = job_for_pipeline(pipeline, num_cmds);
+    JobProcess *shell_proc = NULL; // Entry of the in-shell stage, kept in pipeline order.
+
+    // Setup pipes and fork processes for each command in the pipeline.
+    for (int i = 0; i < num_cmds; ++i)
+    {
+        // Expand the command first; a leading 'cat file' may not need to run at all.
+        if (broken)
+        {
+            job_add_process(job, 0, "")->status = W_EXITCODE(1, 0);
+            continue;
+        }
+        char **argv = prepare_argv(pipeline->cmds[i]);
+        if (i == in_shell)
+        {
+            shell_argv = argv;
+        }
+        if (i == 0 && num_cmds > 1)
+        {
+            int fd = open_cat_input(pipeline->cmds[0], argv);
+            if (fd >= 0)
+            {
+                fd_in = fd; // The second stage reads the file itself.
+                job_add_process(job, 0, argv[0]); // Counts as a stage that succeeded.
+                continue;
+            }
+        }
+
+        // Create pipes for all but the last command. Both ends are close-on-exec: each child
+        // gets its own ends through dup2, and no other stage inherits them.
+        if (i < num_cmds - 1)
+        {
+            if (pipe2(pipefds, O_CLOEXEC) < 0)
+            {
+                perror("Couldn't Pipe");
+                broken = true; // Let the stages already started see end of file and finish.
+                job_add_process(job, 0, "")->status = W_EXITCODE(1, 0);
+                if (fd_in != 0)
+                {
+                    close(fd_in);
+                    fd_in = 0;
+                }
+                continue;
+            }
+            if (pipe_size > 0 && fcntl(pipefds[1], F_SETPIPE_SZ, pipe_size) < 0 && i == 0)
+            {
+                fprintf(stderr, "wsh: %s=%ld: %s\n", PIPE_SIZE_VAR, pipe_size, strerror(errno));
+            }
+        }
+
+        // Describe the stage's plumbing: read from the previous pipe, write into the
+        // current one, and drop the current read end, which belongs to the next stage.
+        LaunchSpec spec;
+        spec.num_moves = 0;
+        spec.fd_in = fd_in != 0 ? fd_in : -1;
+        spec.fd_out = i < num_cmds - 1 ? pipefds[1] : -1;
+        spec.fd_close = i < num_cmds - 1 ? pipefds[0] : -1;
+        spec.pgid = !job_control ? -1 : job->pgid; // The first process started leads the group.
+        spec.attrs = pipeline->attrs;
+
+        // Start the command; the in-shell stage keeps its pipe ends until it runs. Stages that
+        // do not start still get an entry, so '$PIPESTATUS' has one status per stage.
+        if (i == in_shell)
+        {
+            shell_spec = spec;
+            shell_proc = job_add_process(job, 0, argv[0] != NULL ? argv[0] : "");
+        }
+        else if (argv[0] == NULL)
+        {
+            job_add_process(job, 0, "");
+        }
+        else if (!open_redirects(pipeline->cmds[i], argv, &spec))
+        {
+            job_add_process(job, 0, argv[0])->status = W_EXITCODE(1, 0);
+        }
+        else
+        {
+            struct timespec launch_start, launch_end;
+            clock_gettime(CLOCK_MONOTONIC, &launch_start);
+            const Builtin *builtin = i == 0 ? first : i == num_cmds - 1 ? last : find_builtin(argv[0]);
+            pid_t pid = builtin != NULL ? fork_builtin(builtin, argv, &spec) : launch_process(argv, &spec);
+            clock_gettime(CLOCK_MONOTONIC, &launch_end);
+            close_redirects(&spec);
+            JobProcess *proc = job_add_process(job, pid > 0 ? pid : 0, argv[0]);
+            proc->launch_ns = elapsed_ns(&launch_start, &launch_end);
+            proc->status = pid > 0 ? 0 : W_EXITCODE(127, 0);
+        }
+
+        // Parent process: release the ends that now belong to the child.
+        {
+            // Close the input end of the previous pipe.
+            if (fd_in != 0 && i != in_shell)
+            {
+                close(fd_in);
+            }
+            // Save the read end of the current pipe, if not the last command.
+            if (i < num_cmds - 1)
+            {
+                if (i != in_shell)
+                {
+                    close(pipefds[1]);
+                }
+                fd_in = pipefds[0];
+            }
+        }
+    }
+
+    // Run the in-shell stage now that its reader or writer exists. It does not read its input,
+    // so closing that pipe right after is what a quick exit of the command would do.
+    if (shell_proc != NULL)
+    {
+        shell_spec.fd_close = -1; // Already held by the next stage.
+        if (shell_argv[0] != NULL)
+        {
+            run_stage_in_shell(shell_builtin, shell_argv, pipeline->cmds[in_shell], &shell_spec, shell_proc);
+        }
+        else
+        {
+            close_redirects(&shell_spec);
+        }
+    }
+
+    // Wait for every stage unless the pipeline runs in the background.
+    int status = job_launched(job);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return status;
+}
+
+/**
+ * Reads the WSH_PIPE_SIZE setting, which asks for larger pipe buffers between pipeline stages.
+ * An invalid value is reported and ignored.
+ *
+ * @return The requested pipe buffer size in bytes, or 0 to keep the kernel's default.
+ */
+long pipe_buffer_size()
+{
+    const char *value = shell_setting(PIPE_SIZE_VAR);
+    if (value == NULL || *value == '\0')
+    {
+        return 0;
+    }
+    long size = parse_size(value);
+    if (size <= 0 || size > INT_MAX)
+    {
+        fprintf(stderr, "wsh: %s=%s: invalid size\n", PIPE_SIZE_VAR, value);
+        return 0;
+    }
+    return size;
+}
+
+/**
+ * Reads a setting that may be given as a local or an environment variable; local wins.
+ *
+ * @param name The setting's name.
+ * @return Its value, or NULL if it is not set.
+ */
+const char *shell_setting(const char *name)
+{
+    VarEntry *local = var_table_find(&local_vars, name);
+    return local != NULL ? local->value : env_value(name);
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ *
+ * @param value The text to parse.
+ * @return The size in bytes, or -1 if the text is not a valid size or does not fit in a long.
+ */
+long parse_size(const char *value)
+{
+    char *end;
+    errno = 0;
+    long size = strtol(value, &end, 10);
+    if (end == value || errno == ERANGE || size < 0)
+    {
+        return -1;
+    }
+    int shifts = 0; // Multiplications by 1024 the suffix asks for.
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        shifts++;
+        // fall through
+    case 'M':
+    case 'm':
+        shifts++;
+        // fall through
+    case 'K':
+    case 'k':
+        shifts++;
+        end++;
+        break;
+    }
+    for (; shifts > 0; shifts--)
+    {
+        if (size > LONG_MAX / 1024)
+        {
+            return -1; // Would overflow.
+        }
+        size *= 1024;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+/**
+ * Allocates memory from an arena. Allocations are 16-byte aligned and live until the arena is
+ * released past them. Chunks left over from earlier lines are reused before new ones are made.
+ *
+ * @param arena The arena to allocate from.
+ * @param size Number of bytes needed.
+ * @return The memory; the shell exits if the system is out of memory.
+ */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    arena->in_use += size;
+    if (arena->in_use > arena->peak)
+    {
+        arena->peak = arena->in_use;
+    }
+    stats.arena_allocs++;
+
+    ArenaChunk *chunk = arena->current;
+    if (chunk != NULL && chunk->size - chunk->used >= size)
+    {
+        void *mem = chunk->data + chunk->used;
+        chunk->used += size;
+        return mem;
+    }
+
+    // Move on to the next spare chunk if it is big enough, otherwise insert a new one.
+    ArenaChunk *next = chunk != NULL ? chunk->next : arena->first;
+    if (next == NULL || next->size < size)
+    {
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        ArenaChunk *fresh = malloc(sizeof(ArenaChunk) + chunk_size);
+        if (fresh == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        stats.chunk_mallocs++;
+        fresh->size = chunk_size;
+        fresh->next = next;
+        if (chunk != NULL)
+        {
+            chunk->next = fresh;
+        }
+        else
+        {
+            arena->first = fresh;
+        }
+        next = fresh;
+    }
+
+    next->used = size;
+    arena->current = next;
+    return next->data;
+}
+
+/**
+ * Records the current position of an arena.
+ *
+ * @param arena The arena.
+ * @return A mark that can later be passed to arena_release().
+ */
+ArenaMark arena_mark(Arena *arena)
+{
+    ArenaMark mark = {arena->current, arena->current != NULL ? arena->current->used : 0, arena->in_use};
+    return mark;
+}
+
+/**
+ * Frees everything allocated from an arena after a mark was taken. Chunks stay linked for
+ * reuse, so a steady stream of lines causes no further malloc calls.
+ *
+ * @param arena The arena.
+ * @param mark Position returned by arena_mark().
+ */
+void arena_release(Arena *arena, ArenaMark mark)
+{
+    arena->current = mark.chunk;
+    arena->in_use = mark.in_use;
+    if (mark.chunk != NULL)
+    {
+        mark.chunk->used = mark.used;
+    }
+}
+
+/**
+ * Copies a string into an arena.
+ *
+ * @param arena The arena to allocate from.
+ * @param str The string to copy.
+ * @return The copy, valid until the arena is released past it.
+ */
+char *arena_strdup(Arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+/**
+ * Copies the first len bytes of a string into an arena and terminates the copy.
+ *
+ * @param arena The arena to allocate from.
+ * @param str The string to copy from; it must have at least len bytes.
+ * @param len Number of bytes to copy.
+ * @return The copy, valid until the arena is released past it.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * Enables the WSH_STATS counters. WSH_STATS=1 reports once when the shell exits; a larger
+ * number N additionally reports after every N lines, which shows whether memory stays flat.
+ */
+void init_stats()
+{
+    const char *setting = getenv("WSH_STATS");
+    if (setting == NULL || *setting == '\0')
+    {
+        return;
+    }
+    stats.enabled = true;
+    stats.owner = getpid();
+    stats.report_every = strtoul(setting, NULL, 10);
+    if (stats.report_every == 1)
+    {
+        stats.report_every = 0; // '1' just turns the exit report on.
+    }
+    stats.start_rss_kb = current_rss_kb();
+    atexit(report_stats);
+}
+
+/**
+ * Prints the WSH_STATS counters to stderr as a single line.
+ */
+void report_stats()
+{
+    if (!stats.enabled || getpid() != stats.owner)
+    {
+        return; // Children forked by the shell inherit the counters but must not report them.
+    }
+
+    struct mallinfo2 heap = mallinfo2();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long lines = stats.lines > 0 ? stats.lines : 1;
+    fprintf(stderr,
+            "wsh: stats lines=%lu arena_allocs=%lu allocs_per_line=%.2f arena_chunk_mallocs=%lu "
+            "arena_peak=%zu heap_in_use=%zu rss_kb=%ld start_rss_kb=%ld max_rss_kb=%ld memo_hits=%lu "
+            "memo_misses=%lu memo_bytes=%zu env_rebuilds=%lu dir_scans=%lu dir_cache_hits=%lu open_fds=%d\n",
+            stats.lines, stats.arena_allocs, (double)stats.arena_allocs / lines, stats.chunk_mallocs,
+            line_arena.peak, heap.uordblks, current_rss_kb(), stats.start_rss_kb, usage.ru_maxrss, memo_cache.hits,
+            memo_cache.misses, memo_cache.bytes, stats.env_rebuilds, stats.dir_scans, stats.dir_cache_hits,
+            count_open_fds());
+}
+
+/**
+ * Counts the shell's open descriptors, so a descriptor leak shows up in WSH_STATS as a count
+ * that grows over a long run.
+ *
+ * @return Number of open descriptors, or -1 if /proc cannot be read.
+ */
+int count_open_fds()
+{
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+    {
+        return -1;
+    }
+    int count = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        count += dirent->d_name[0] != '.';
+    }
+    closedir(dir);
+    return count - 1; // Not counting the one reading the directory.
+}
+
+/**
+ * Reads the shell's current resident set size from /proc.
+ *
+ * @return Resident set size in kilobytes, or -1 if it cannot be read.
+ */
+long current_rss_kb()
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages_total, pages_resident;
+    if (statm == NULL)
+    {
+        return -1;
+    }
+    if (fscanf(statm, "%ld %ld", &pages_total, &pages_resident) != 2)
+    {
+        pages_resident = -1;
+    }
+    fclose(statm);
+    return pages_resident < 0 ? -1 : pages_resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Sets up child handling. A SIGCHLD handler reaps every child as soon as it changes state, so
+ * background jobs never linger as zombies. Interactive sessions on a terminal additionally get
+ * job control: the shell moves into its own process group and ignores keyboard and terminal
+ * stop signals, and each job gets a process group of its own that is handed the terminal while
+ * in the foreground.
+ *
+ * @param interactive Whether commands are read from the user rather than a batch file.
+ */
+void init_job_control(bool interactive)
+{
+    interactive_shell = interactive;
+    sigprocmask(SIG_BLOCK, NULL, &child_sigmask); // Commands start with the mask the shell got.
+    sigemptyset(&child_sigdefault);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchld_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // Keep reads of the next line going across child exits.
+    sigaction(SIGCHLD, &action, NULL);
+
+    if (!interactive || !isatty(STDIN_FILENO))
+    {
+        return;
+    }
+
+    // Wait until the shell itself runs in the foreground before taking over the terminal.
+    pid_t pgid;
+    while (tcgetpgrp(STDIN_FILENO) != (pgid = getpgrp()))
+    {
+        kill(-pgid, SIGTTIN);
+    }
+
+    // Keyboard signals go to the foreground job; the shell itself must survive them.
+    int ignored[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU};
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++)
+    {
+        signal(ignored[i], SIG_IGN);
+        sigaddset(&child_sigdefault, ignored[i]);
+    }
+    setpgid(0, 0); // Fails harmlessly if the shell already leads its group.
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+    job_control = true;
+}
+
+/**
+ * SIGCHLD handler: collects every child that changed state, without blocking, and records the
+ * result in the job table. The main program blocks SIGCHLD whenever it changes the table.
+ *
+ * @param sig The signal number (unused).
+ */
+void sigchld_handler(int sig)
+{
+    (void)sig;
+    int saved_errno = errno; // waitpid() must not clobber errno of the interrupted code.
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        job_update(pid, status, &usage);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Records a wait status for a process. Processes that belong to no job are ignored.
+ *
+ * @param pid The process that changed state.
+ * @param status Its wait status.
+ * @param usage Resources it used, valid once it has exited.
+ */
+void job_update(pid_t pid, int status, const struct rusage *usage)
+{
+    for (int i = 0; i < job_table_size; i++)
+    {
+        Job *job = job_table[i];
+        for (int p = 0; job != NULL && p < job->num_procs; p++)
+        {
+            JobProcess *proc = &job->procs[p];
+            if (proc->pid != pid)
+            {
+                continue;
+            }
+            if (WIFSTOPPED(status))
+            {
+                proc->stopped = true;
+            }
+            else if (WIFCONTINUED(status))
+            {
+                proc->stopped = false;
+            }
+            else
+            {
+                proc->exited = true;
+                proc->stopped = false;
+                proc->status = status;
+                proc->usage = *usage;
+                if (job_is_done(job))
+                {
+                    clock_gettime(CLOCK_MONOTONIC, &job->finished); // Async-signal-safe.
+                }
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * Blocks SIGCHLD so the reaper cannot run while the job table is being changed or inspected.
+ *
+ * @param saved Receives the previous signal mask, to be restored with sigprocmask().
+ */
+void block_child_signals(sigset_t *saved)
+{
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, saved);
+}
+
+/**
+ * Adds a job under the lowest free job number. SIGCHLD must be blocked.
+ *
+ * @param command The command line, copied into the job.
+ * @param background Whether the job runs in the background.
+ * @param max_procs Number of processes the job may hold.
+ * @return The new job.
+ */
+Job *job_create(const char *command, bool background, int max_procs)
+{
+    int slot = 0;
+    while (slot < job_table_size && job_table[slot] != NULL)
+    {
+        slot++;
+    }
+    if (slot == job_table_size)
+    {
+        int size = job_table_size == 0 ? 8 : job_table_size * 2;
+        Job **table = realloc(job_table, size * sizeof(Job *));
+        if (table == NULL)
+        {
+            perror("Failed to allocate memory for jobs");
+            exit(EXIT_FAILURE);
+        }
+        memset(table + job_table_size, 0, (size - job_table_size) * sizeof(Job *));
+        job_table = table;
+        job_table_size = size;
+    }
+
+    Job *job = calloc(1, sizeof(Job) + max_procs * sizeof(JobProcess));
+    if (job == NULL || (job->command = strdup(command != NULL ? command : "")) == NULL)
+    {
+        perror("Failed to allocate memory for jobs");
+        exit(EXIT_FAILURE);
+    }
+    job->id = slot + 1;
+    job->background = background;
+    job->max_procs = max_procs;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    job_table[slot] = job;
+    return job;
+}
+
+/**
+ * Records a started process of a job. The first real process gives the job its process group.
+ * A PID of 0 records a stage that runs inside the shell or did not start at all; it counts as
+ * exited right away, and the caller fills in its status. SIGCHLD must be blocked.
+ *
+ * @param job The job.
+ * @param pid The process that was started, or 0.
+ * @param name Command name, for profiles.
+ * @return The process entry, for the caller to fill in timings.
+ */
+JobProcess *job_add_process(Job *job, pid_t pid, const char *name)
+{
+    if (job->num_procs == job->max_procs)
+    {
+        fprintf(stderr, "wsh: job table overflow\n"); // Cannot happen: callers size the job.
+        exit(EXIT_FAILURE);
+    }
+    if (job->pgid == 0 && pid > 0)
+    {
+        job->pgid = pid;
+    }
+    JobProcess *proc = &job->procs[job->num_procs++];
+    memset(proc, 0, sizeof(*proc));
+    proc->pid = pid;
+    proc->exited = pid == 0;
+    snprintf(proc->name, sizeof(proc->name), "%s", name);
+    return proc;
+}
+
+/**
+ * Removes a job from the table and frees it. SIGCHLD must be blocked.
+ *
+ * @param job The job to remove.
+ */
+void job_remove(Job *job)
+{
+    if (job_is_done(job) && !job->batch)
+    {
+        job_report(job); // 'time' output and profile record, if requested.
+    }
+    job_table[job->id - 1] = NULL;
+    free(job->command);
+    free(job);
+}
+
+/**
+ * Forgets every job without waiting for it. Used in forked children, whose inherited table
+ * describes processes that are not theirs.
+ */
+void job_table_reset()
+{
+    for (int i = 0; i < job_table_size; i++)
+    {
+        if (job_table[i] != NULL)
+        {
+            job_table[i]->batch = true; // Not ours to report.
+            job_remove(job_table[i]);
+        }
+    }
+}
+
+/**
+ * Whether every process of a job has exited.
+ *
+ * @param job The job.
+ * @return True if the job is done.
+ */
+bool job_is_done(const Job *job)
+{
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        if (!job->procs[p].exited)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether a job is stopped: at least one process is stopped and none is running.
+ *
+ * @param job The job.
+ * @return True if the job is stopped.
+ */
+bool job_is_stopped(const Job *job)
+{
+    bool stopped = false;
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        if (!job->procs[p].exited && !job->procs[p].stopped)
+        {
+            return false;
+        }
+        stopped = stopped || job->procs[p].stopped;
+    }
+    return stopped;
+}
+
+/**
+ * Exit status of a job: that of its last process, or 128 plus the signal that killed it.
+ *
+ * @param job The job.
+ * @return The exit status.
+ */
+int job_status(const Job *job)
+{
+    if (job->num_procs == 0)
+    {
+        return 1;
+    }
+    return wait_status_code(job->procs[job->num_procs - 1].status);
+}
+
+/**
+ * Converts a wait status to the exit status the shell reports: the exit code, or 128 plus the
+ * signal number for a process killed by a signal.
+ *
+ * @param status The wait status.
+ * @return The exit status.
+ */
+int wait_status_code(int status)
+{
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * Records the status of every process of a finished job as '$PIPESTATUS'.
+ *
+ * @param job The job.
+ */
+void job_record_status(const Job *job)
+{
+    pipe_status_serial++;
+    pipe_status_count = 0;
+    if (!pipe_status_reserve(job->num_procs))
+    {
+        return;
+    }
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        pipe_status[pipe_status_count++] = wait_status_code(job->procs[p].status);
+    }
+}
+
+/**
+ * Makes room for the statuses of a pipeline with the given number of stages.
+ *
+ * @param count Number of entries needed.
+ * @return False if the allocation failed; pipe_status is then unchanged.
+ */
+bool pipe_status_reserve(int count)
+{
+    if (count <= pipe_status_cap)
+    {
+        return true;
+    }
+    int cap = pipe_status_cap > 0 ? pipe_status_cap : 16;
+    while (cap < count)
+    {
+        cap *= 2;
+    }
+    int *grown = realloc(pipe_status, cap * sizeof(int));
+    if (grown == NULL)
+    {
+        return false;
+    }
+    pipe_status = grown;
+    pipe_status_cap = cap;
+    return true;
+}
+
+/**
+ * Finishes starting a job: drops it if no process is running, announces it if it runs in the
+ * background, and otherwise waits for it in the foreground. SIGCHLD must be blocked.
+ *
+ * @param job The job whose processes have all been started.
+ * @return The job's exit status, or 0 for a background job.
+ */
+int job_launched(Job *job)
+{
+    if (job->pgid == 0)
+    {
+        // Every stage ran in the shell or failed to start.
+        job_record_status(job);
+        int status = job_status(job);
+        job_remove(job);
+        return status;
+    }
+    if (job->background)
+    {
+        printf("[%d] PID %d running in background\n", job->id, job->pgid);
+        return 0;
+    }
+    return job_wait_foreground(job);
+}
+
+/**
+ * Runs a job in the foreground: hands it the terminal under job control and waits until it
+ * exits or stops. A finished job is removed; a stopped one stays in the table as a background
+ * job for 'fg' and 'bg'. SIGCHLD must be blocked.
+ *
+ * @param job The job.
+ * @return The job's exit status, or 128 plus the stop signal if it stopped.
+ */
+int job_wait_foreground(Job *job)
+{
+    job->background = false;
+    if (job_control && job->pgid > 0)
+    {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    }
+    job_wait(job);
+    if (job_control)
+    {
+        tcsetpgrp(STDIN_FILENO, getpgrp()); // Take the terminal back for the prompt.
+    }
+
+    if (!job_is_done(job))
+    {
+        job->background = true;
+        printf("\n");
+        job_print(job);
+        return 128 + SIGTSTP;
+    }
+    job_record_status(job);
+    int status = job_status(job);
+    job_remove(job);
+    return status;
+}
+
+/**
+ * Sleeps until a job has exited or stopped. SIGCHLD must be blocked. The job's processes are
+ * collected directly with a blocking wait4() on its process group (on any child without job
+ * control), instead of a wakeup by SIGCHLD for every stage that exits. Other children collected
+ * along the way are recorded as the handler would.
+ *
+ * @param job The job.
+ */
+void job_wait(Job *job)
+{
+    pid_t which = job_control && job->pgid > 0 ? -job->pgid : -1;
+    while (!job_is_done(job) && !job_is_stopped(job))
+    {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(which, &status, WUNTRACED | WCONTINUED, &usage);
+        if (pid > 0)
+        {
+            job_update(pid, status, &usage);
+        }
+        else if (errno != EINTR)
+        {
+            break; // No such children left: nothing more will change.
+        }
+    }
+}
+
+/**
+ * Sleeps until one of the batch scheduler's jobs is done. SIGCHLD must be blocked.
+ *
+ * @return The finished job, still in the table, or NULL if the scheduler has no jobs.
+ */
+Job *job_wait_batch()
+{
+    sigset_t wait_mask;
+    sigprocmask(SIG_BLOCK, NULL, &wait_mask);
+    sigdelset(&wait_mask, SIGCHLD);
+    while (1)
+    {
+        bool any = false;
+        for (int i = 0; i < job_table_size; i++)
+        {
+            Job *job = job_table[i];
+            if (job != NULL && job->batch)
+            {
+                if (job_is_done(job))
+                {
+                    return job;
+                }
+                any = true;
+            }
+        }
+        if (!any)
+        {
+            return NULL;
+        }
+        sigsuspend(&wait_mask);
+    }
+}
+
+/**
+ * Sends a signal to a job: to its process group under job control, else to each live process.
+ *
+ * @param job The job.
+ * @param sig The signal to send.
+ */
+void job_signal(Job *job, int sig)
+{
+    if (job_control)
+    {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        if (!job->procs[p].exited)
+        {
+            kill(job->procs[p].pid, sig);
+        }
+    }
+}
+
+/**
+ * Removes background jobs that have finished, reporting them in interactive sessions. Called
+ * before each prompt and before each serial batch line.
+ */
+void job_notify()
+{
+    sigset_t saved;
+    block_child_signals(&saved);
+    for (int i = 0; i < job_table_size; i++)
+    {
+        Job *job = job_table[i];
+        if (job != NULL && job->background && !job->batch && job_is_done(job))
+        {
+            if (interactive_shell)
+            {
+                job_print(job);
+            }
+            job_remove(job);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+/**
+ * Prints one line of a job listing: number, state and command.
+ *
+ * @param job The job.
+ */
+void job_print(const Job *job)
+{
+    const char *state = job_is_done(job) ? "Done" : job_is_stopped(job) ? "Stopped" : "Running";
+    printf("[%d]  %-8s %s\n", job->id, state, job->command);
+}
+
+/**
+ * Picks the job 'fg' or 'bg' acts on by default: the highest-numbered job still alive.
+ *
+ * @param stopped_only Whether only stopped jobs qualify.
+ * @return The job, or NULL if there is none.
+ */
+Job *job_current(bool stopped_only)
+{
+    for (int i = job_table_size - 1; i >= 0; i--)
+    {
+        Job *job = job_table[i];
+        if (job != NULL && !job->batch && !job_is_done(job) && (!stopped_only || job_is_stopped(job)))
+        {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Resolves a job argument: '%n' names job n, a plain number names the job holding that PID.
+ * Reports unknown jobs.
+ *
+ * @param command Name of the calling builtin, for the error message.
+ * @param spec The argument.
+ * @return The job, or NULL if there is no such job.
+ */
+Job *job_from_spec(const char *command, const char *spec)
+{
+    if (spec[0] == '%')
+    {
+        int id = atoi(spec + 1);
+        if (id >= 1 && id <= job_table_size && job_table[id - 1] != NULL && !job_table[id - 1]->batch)
+        {
+            return job_table[id - 1];
+        }
+    }
+    else
+    {
+        pid_t pid = atoi(spec);
+        for (int i = 0; pid > 0 && i < job_table_size; i++)
+        {
+            Job *job = job_table[i];
+            for (int p = 0; job != NULL && !job->batch && p < job->num_procs; p++)
+            {
+                if (job->procs[p].pid == pid)
+                {
+                    return job;
+                }
+            }
+        }
+    }
+    printf("%s: %s: no such job\n", command, spec);
+    return NULL;
+}
+
+/**
+ * Creates the job that runs a pipeline, carrying over its measurements. SIGCHLD must be blocked.
+ *
+ * @param pipeline The pipeline.
+ * @param max_procs Number of processes the job may hold.
+ * @return The new job.
+ */
+Job *job_for_pipeline(Pipeline *pipeline, int max_procs)
+{
+    Job *job = job_create(pipeline->text, pipeline->background, max_procs);
+    job->timed = pipeline->timed;
+    job->parse_ns = pipeline->parse_ns;
+    return job;
+}
+
+/**
+ * Runs a built-in stage inside the shell and records it in its job slot: the time it took as
+ * the stage's launch time, the shell's own rusage growth as its usage, and its exit status.
+ *
+ * @param builtin The built-in to run.
+ * @param argv Its expanded argument vector.
+ * @param cmd The command, for its redirections.
+ * @param spec Pipe plumbing, consumed as by run_builtin_in_shell().
+ * @param proc The stage's entry from job_add_process(job, 0, ...).
+ * @return The built-in's exit status.
+ */
+int run_stage_in_shell(const Builtin *builtin, char *argv[], Command *cmd, LaunchSpec *spec, JobProcess *proc)
+{
+    struct timespec start, end;
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = run_builtin_in_shell(builtin, argv, cmd, spec);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &after);
+
+    proc->status = W_EXITCODE(status & 0xff, 0); // Encoded like a wait status.
+    proc->in_shell = true;
+    proc->launch_ns = elapsed_ns(&start, &end);
+    proc->usage = after;
+    timersub(&after.ru_utime, &before.ru_utime, &proc->usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &proc->usage.ru_stime);
+    proc->usage.ru_nvcsw -= before.ru_nvcsw;
+    proc->usage.ru_nivcsw -= before.ru_nivcsw;
+    return status;
+}
+
+/**
+ * Reports a finished job: a bash-style real/user/sys summary on stderr for the 'time' prefix,
+ * and a JSON line in the WSH_PROFILE trace. The line is written with a single write() to an
+ * O_APPEND descriptor, so records from parallel batch jobs never interleave.
+ *
+ * @param job The finished job.
+ */
+void job_report(const Job *job)
+{
+    if (!job->timed && profile_fd < 0)
+    {
+        return;
+    }
+
+    struct timespec finished = job->finished;
+    if (finished.tv_sec == 0 && finished.tv_nsec == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &finished); // Only stages run in the shell.
+    }
+    long wall_ns = elapsed_ns(&job->started, &finished);
+    long user_us = 0, sys_us = 0;
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        user_us += timeval_us(&job->procs[p].usage.ru_utime);
+        sys_us += timeval_us(&job->procs[p].usage.ru_stime);
+    }
+
+    if (job->timed)
+    {
+        fprintf(stderr, "\nreal\t%ldm%.3fs\nuser\t%ldm%.3fs\nsys\t%ldm%.3fs\n", wall_ns / 60000000000L,
+                (wall_ns % 60000000000L) / 1e9, user_us / 60000000L, (user_us % 60000000L) / 1e6, sys_us / 60000000L,
+                (sys_us % 60000000L) / 1e6);
+    }
+    if (profile_fd < 0)
+    {
+        return;
+    }
+
+    char *record = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&record, &size);
+    if (out == NULL)
+    {
+        return;
+    }
+    fprintf(out, "{\"line\": ");
+    json_write_string(out, job->command);
+    fprintf(out, ", \"parse_us\": %.1f, \"wall_us\": %.1f, \"status\": %d, \"stages\": [", job->parse_ns / 1e3,
+            wall_ns / 1e3, job_status(job));
+    for (int p = 0; p < job->num_procs; p++)
+    {
+        const JobProcess *proc = &job->procs[p];
+        fprintf(out, "%s{\"command\": ", p > 0 ? ", " : "");
+        json_write_string(out, proc->name);
+        fprintf(out,
+                ", \"pid\": %d, \"in_shell\": %s, \"launch_us\": %.1f, \"user_us\": %ld, \"sys_us\": %ld, "
+                "\"max_rss_kb\": %ld, \"voluntary_cs\": %ld, \"involuntary_cs\": %ld}",
+                (int)proc->pid, proc->in_shell ? "true" : "false", proc->launch_ns / 1e3,
+                timeval_us(&proc->usage.ru_utime), timeval_us(&proc->usage.ru_stime), proc->usage.ru_maxrss,
+                proc->usage.ru_nvcsw, proc->usage.ru_nivcsw);
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+    if (write(profile_fd, record, size) != (ssize_t)size)
+    {
+        perror("wsh: WSH_PROFILE");
+    }
+    free(record);
+}
+
+/**
+ * Writes a string as a JSON string literal, escaping quotes, backslashes and control characters.
+ *
+ * @param out The stream to write to.
+ * @param str The string.
+ */
+void json_write_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(out, "\\%c", *p);
+        }
+        else if (*p < 0x20)
+        {
+            fprintf(out, "\\u%04x", *p);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * Computes the time between two CLOCK_MONOTONIC readings.
+ *
+ * @param from The earlier reading.
+ * @param to The later reading.
+ * @return The difference in nanoseconds.
+ */
+long elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000L + (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Converts a timeval, such as a rusage CPU time, to microseconds.
+ *
+ * @param tv The time value.
+ * @return The time in microseconds.
+ */
+long timeval_us(const struct timeval *tv)
+{
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+/**
+ * Prints the CLOCK_MONOTONIC time at which this process got to run, in nanoseconds, for
+ * startup_bench(). It runs before any other initialization and does not use stdio.
+ *
+ * @return Exit status 0.
+ */
+int startup_probe()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%ld\n", now.tv_sec * 1000000000L + now.tv_nsec);
+    return write(STDOUT_FILENO, text, len) == len ? 0 : 1;
+}
+
+/**
+ * Measures how fast the shell gets a batch script to its first command ('wsh --startup-bench
+ * [runs]'). Each run starts this binary on a one-line script whose command is this binary again
+ * in probe mode, which reports when it started; time to first exec is the time from launching
+ * the shell until the probe runs. Launching the probe directly gives the cost of a bare
+ * spawn + exec, which the shell's own overhead is reported against. Fails if the median time
+ * to first exec is over WSH_STARTUP_BUDGET_US microseconds (default STARTUP_BUDGET_US).
+ *
+ * @param runs Number of runs of each kind.
+ * @return 0 if the median is within budget, 1 otherwise.
+ */
+int startup_bench(int runs)
+{
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len < 0 || runs <= 0)
+    {
+        fprintf(stderr, "Usage: wsh --startup-bench [runs]\n");
+        return 1;
+    }
+    exe[len] = '\0';
+
+    char script[] = "/tmp/wsh-startup-XXXXXX";
+    int fd = mkstemp(script);
+    if (fd < 0)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    dprintf(fd, "'%s' --startup-probe\n", exe);
+    close(fd);
+
+    long *first_exec = calloc(runs, sizeof(long));
+    long *total = calloc(runs, sizeof(long));
+    long *bare = calloc(runs, sizeof(long));
+    char *shell_argv[] = {exe, script, NULL};
+    char *probe_argv[] = {exe, "--startup-probe", NULL};
+    bool ok = true;
+    for (int i = 0; i < runs && ok; i++)
+    {
+        total[i] = startup_run(shell_argv, &first_exec[i]);
+        ok = total[i] >= 0 && startup_run(probe_argv, &bare[i]) >= 0;
+    }
+    unlink(script);
+    if (!ok)
+    {
+        fprintf(stderr, "wsh: startup bench: run failed\n");
+        free(first_exec);
+        free(total);
+        free(bare);
+        return 1;
+    }
+
+    qsort(first_exec, runs, sizeof(long), compare_long);
+    qsort(total, runs, sizeof(long), compare_long);
+    qsort(bare, runs, sizeof(long), compare_long);
+    const char *setting = getenv("WSH_STARTUP_BUDGET_US");
+    long budget_us = setting != NULL && atol(setting) > 0 ? atol(setting) : STARTUP_BUDGET_US;
+    long p50 = first_exec[runs / 2], p99 = first_exec[runs * 99 / 100];
+    printf("runs                %d\n", runs);
+    printf("time to first exec  p50 %7.1f us  p99 %7.1f us\n", p50 / 1e3, p99 / 1e3);
+    printf("bare spawn + exec   p50 %7.1f us  p99 %7.1f us\n", bare[runs / 2] / 1e3, bare[runs * 99 / 100] / 1e3);
+    printf("shell overhead      p50 %7.1f us\n", (p50 - bare[runs / 2]) / 1e3);
+    printf("whole batch run     p50 %7.1f us  p99 %7.1f us\n", total[runs / 2] / 1e3, total[runs * 99 / 100] / 1e3);
+    printf("budget              %ld us: %s\n", budget_us, p50 <= budget_us * 1000 ? "ok" : "over");
+    free(first_exec);
+    free(total);
+    free(bare);
+    return p50 <= budget_us * 1000 ? 0 : 1;
+}
+
+/**
+ * Starts a command whose output ends with a startup_probe() timestamp and waits for it.
+ *
+ * @param argv The command.
+ * @param first_exec_ns Receives the time from launch until the probe ran.
+ * @return The time from launch until the command exited, in nanoseconds, or -1 on failure.
+ */
+long startup_run(char *const argv[], long *first_exec_ns)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid;
+    int err = posix_spawn(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0)
+    {
+        close(fds[0]);
+        return -1;
+    }
+
+    char text[64];
+    size_t used = 0;
+    ssize_t n;
+    while (used < sizeof(text) - 1 && (n = read(fds[0], text + used, sizeof(text) - 1 - used)) > 0)
+    {
+        used += n;
+    }
+    close(fds[0]);
+    text[used] = '\0';
+
+    // The run's child is reaped here rather than by the SIGCHLD handler, which is not installed.
+    int status;
+    waitpid(pid, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long probe_ns = atol(text);
+    if (probe_ns <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+    *first_exec_ns = probe_ns - (start.tv_sec * 1000000000L + start.tv_nsec);
+    return elapsed_ns(&start, &end);
+}
+
+/**
+ * Orders two longs for qsort().
+ *
+ * @param a The first value.
+ * @param b The second value.
+ * @return Negative, zero or positive as a is less than, equal to or greater than b.
+ */
+int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Runs the shell as a server ('wsh --serve path'): it listens on a UNIX domain socket and runs the
+ * script each client sends, so callers that run many small scripts pay for a fork of an already
+ * initialized shell instead of a full startup. Every client is served by its own forked copy of
+ * the server, which keeps clients' directories and variables apart and lets them run at once.
+ *
+ * Protocol: the client first sends one byte carrying its standard input, output and error as
+ * SCM_RIGHTS descriptors, then its working directory terminated by a NUL byte, then the script,
+ * and shuts down its sending side. Commands read and write the client's descriptors directly.
+ * Once the script has run, the server replies with "exit N\n" and closes the connection.
+ *
+ * The socket is only accessible to its owner (mode 0600), and connections from any other user are
+ * refused after an SO_PEERCRED check, since a client can run anything as the server's user.
+ *
+ * @param path Path of the socket to create. A stale socket at that path is replaced; one that a
+ *             server still answers on is left alone.
+ * @return Exit status 1 if the socket could not be set up; otherwise the server runs until killed.
+ */
+int run_server(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "wsh: --serve: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct stat st;
+    if (listener >= 0 && lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        // Only a socket nobody answers on was left behind by an earlier server.
+        if (connect(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno != ECONNREFUSED)
+        {
+            fprintf(stderr, "wsh: --serve: %s: a server is already running\n", path);
+            return 1;
+        }
+        unlink(path);
+    }
+    mode_t mask = umask(077); // The socket is created 0600.
+    bool bound = listener >= 0 && bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, SOMAXCONN) < 0)
+    {
+        perror("wsh: --serve");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // A client that goes away must not take the server with it.
+    sigaddset(&child_sigdefault, SIGPIPE);
+    while (true)
+    {
+        int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("wsh: accept");
+            }
+            continue;
+        }
+        struct ucred peer;
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid())
+        {
+            close(conn); // Another user's client.
+            continue;
+        }
+
+        pid_t pid = fork(); // The SIGCHLD reaper collects it; it belongs to no job.
+        if (pid == 0)
+        {
+            close(listener);
+            signal(SIGPIPE, SIG_DFL);
+            server_handle_client(conn);
+        }
+        else if (pid < 0)
+        {
+            perror("fork failed");
+        }
+        close(conn);
+    }
+}
+
+/**
+ * Serves one client in a forked copy of the server: takes over the client's descriptors and
+ * working directory, runs its script line by line, and reports the final exit status. The status
+ * is sent by an atexit() handler, so a script that ends with 'exit' gets its reply as well.
+ *
+ * @param conn The connection to the client.
+ */
+void server_handle_client(int conn)
+{
+    int fds[3];
+    char byte;
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&byte, 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg;
+    if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    {
+        exit(EXIT_FAILURE); // Not a wsh client.
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    for (int fd = 0; fd < 3; fd++)
+    {
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
+
+    server_conn = conn;
+    server_conn_owner = getpid();
+    atexit(server_reply);
+
+    FILE *in = fdopen(conn, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    if (in == NULL || getdelim(&line, &cap, '\0', in) <= 0 || chdir(line) != 0)
+    {
+        fprintf(stderr, "wsh: server: cannot enter client directory\n");
+        last_status = 1;
+    }
+    else
+    {
+        while (getline(&line, &cap, in) > 0)
+        {
+            job_notify(); // Drop background jobs that have finished.
+            parse_and_execute(line);
+        }
+    }
+
+    exit(last_status);
+}
+
+/**
+ * atexit() handler of a server child: replies "exit N" with the script's last status. Processes
+ * the child forks inherit the handler but are not the one the client waits for, so they stay
+ * quiet.
+ */
+void server_reply()
+{
+    if (server_conn < 0 || getpid() != server_conn_owner)
+    {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    char reply[16];
+    int len = snprintf(reply, sizeof(reply), "exit %d\n", last_status);
+    send(server_conn, reply, len, MSG_NOSIGNAL); // A client that went away needs no reply.
+    server_conn = -1;
+}
+
+/**
+ * Runs a script on a wsh server ('wsh --client path [script]') and exits with its status. The
+ * script is read from the named file, or from standard input if none is given; in the latter
+ * case its commands get /dev/null as their standard input.
+ *
+ * @param path Path of the server's socket.
+ * @param script Script file, or NULL to send standard input.
+ * @return The script's exit status, or 1 if the server could not be reached.
+ */
+int run_client(const char *path, const char *script)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int input = script != NULL ? open(script, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (input < 0)
+    {
+        perror(script);
+        return 1;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path) || conn < 0)
+    {
+        fprintf(stderr, "wsh: --client: invalid socket path\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("wsh: --client");
+        return 1;
+    }
+
+    // Hand over the descriptors the commands use.
+    int fds[3] = {script != NULL ? STDIN_FILENO : open("/dev/null", O_RDONLY | O_CLOEXEC), STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {"W", 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    char cwd[PATH_MAX];
+    if (fds[0] < 0 || sendmsg(conn, &msg, 0) != 1 || getcwd(cwd, sizeof(cwd)) == NULL || !write_all(conn, cwd, strlen(cwd) + 1))
+    {
+        perror("wsh: --client");
+        return 1;
+    }
+
+    // Send the script, then wait for the status.
+    char buffer[BATCH_STREAM_BUFFER / 4];
+    ssize_t n;
+    while ((n = read(input, buffer, sizeof(buffer))) > 0)
+    {
+        if (!write_all(conn, buffer, n))
+        {
+            break; // The server went away; its reply, if any, still says why.
+        }
+    }
+    shutdown(conn, SHUT_WR);
+    size_t used = 0;
+    while (used < sizeof(buffer) - 1 && (n = read(conn, buffer + used, sizeof(buffer) - 1 - used)) > 0)
+    {
+        used += n;
+    }
+    buffer[used] = '\0';
+    int status;
+    if (sscanf(buffer, "exit %d", &status) != 1)
+    {
+        fprintf(stderr, "wsh: --client: connection lost\n");
+        return 1;
+    }
+    return status;
+}
+
+/**
+ * Opens the trace file named by WSH_PROFILE. Each finished command or pipeline then appends
+ * one JSON line with its parse time, wall time and per-stage launch latency and rusage.
+ */
+void init_profile()
+{
+    const char *path = getenv("WSH_PROFILE");
+    if (path == NULL || *path == '\0')
+    {
+        return;
+    }
+    profile_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (profile_fd < 0)
+    {
+        fprintf(stderr, "wsh: WSH_PROFILE: %s: %s\n", path, strerror(errno));
+    }
+}
+
+/**
+ * Reads the WSH_LAUNCH environment variable to choose how external commands are started.
+ * "fork" selects the plain fork + execvp backend; anything else keeps posix_spawnp.
+ */
+void init_launch_backend()
+{
+    const char *backend = getenv("WSH_LAUNCH");
+    if (backend != NULL && strcmp(backend, "fork") == 0)
+    {
+        launch_backend = LAUNCH_FORK;
+    }
+    else
+    {
+        launch_backend = LAUNCH_SPAWN;
+    }
+}
+
+/**
+ * Starts an external command with the selected launch backend. The binary is resolved through
+ * the PATH cache first, so the child performs a single execve instead of probing every PATH
+ * directory. The parent never blocks here; waiting for the child is left to the caller. Commands
+ * with 'with' settings always use the fork backend, since posix_spawn cannot apply them.
+ *
+ * @param argv Null-terminated argument vector; argv[0] is looked up in PATH.
+ * @param spec Descriptor plumbing to apply in the child.
+ * @return The child's PID, or -1 if the command could not be started.
+ */
+pid_t launch_process(char *argv[], const LaunchSpec *spec)
+{
+    const char *path = resolve_command(argv[0]);
+    if (path == NULL)
+    {
+        fprintf(stderr, "execvp: %s\n", strerror(ENOENT)); // Same report execvp would give.
+        return -1;
+    }
+    fflush(stdout); // Keep the shell's own output, such as job reports, ahead of the command's.
+
+    if (launch_backend == LAUNCH_FORK || spec->attrs != NULL)
+    {
+        return fork_process(path, argv, spec); // 'with' settings are applied in the child.
+    }
+
+    pid_t pid = spawn_process(path, argv, spec);
+    if (pid < 0 && errno == ENOENT && strchr(argv[0], '/') == NULL)
+    {
+        // The cached binary disappeared; search PATH again once before giving up.
+        path_cache_forget(argv[0]);
+        path = resolve_command(argv[0]);
+        if (path != NULL)
+        {
+            pid = spawn_process(path, argv, spec);
+        }
+    }
+    if (pid < 0)
+    {
+        fprintf(stderr, "execvp: %s\n", strerror(errno)); // Same report the fork backend gives.
+    }
+    return pid;
+}
+
+/**
+ * Launch backend built on posix_spawn. The pipe setup is expressed as file actions so the
+ * child never runs shell code, which lets libc start it without copying the page tables.
+ * Errors such as a missing binary are reported by posix_spawn in the parent via errno.
+ *
+ * @param path Resolved path of the binary to execute.
+ * @param argv Null-terminated argument vector.
+ * @param spec Descriptor plumbing to apply in the child.
+ * @return The child's PID, or -1 with errno set if the command could not be started.
+ */
+pid_t spawn_process(const char *path, char *argv[], const LaunchSpec *spec)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // Mirror the dup2/close sequence the fork backend performs by hand.
+    if (spec->fd_in >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, spec->fd_in, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, spec->fd_in);
+    }
+    if (spec->fd_out >= 0)
+    {
+        posix_spawn_file_actions_adddup2(&actions, spec->fd_out, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, spec->fd_out);
+    }
+    if (spec->fd_close >= 0)
+    {
+        posix_spawn_file_actions_addclose(&actions, spec->fd_close);
+    }
+    for (int i = 0; i < spec->num_moves; i++)
+    {
+        // A move onto the same number only clears close-on-exec, which keeps process
+        // substitution pipes open under the number their /dev/fd path names.
+        posix_spawn_file_actions_adddup2(&actions, spec->moves[i].from, spec->moves[i].to);
+    }
+
+    // Start with the shell's original signal mask and dispositions, in the requested group.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigmask(&attr, &child_sigmask);
+    posix_spawnattr_setsigdefault(&attr, &child_sigdefault);
+    if (spec->pgid >= 0)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, spec->pgid);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, env_snapshot());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Launch backend built on fork + execv. Kept as a fallback for cases that need to run
+ * arbitrary code in the child before the exec.
+ *
+ * @param path Resolved path of the binary to execute.
+ * @param argv Null-terminated argument vector.
+ * @param spec Descriptor plumbing to apply in the child.
+ * @return The child's PID, or -1 if the fork failed.
+ */
+pid_t fork_process(const char *path, char *argv[], const LaunchSpec *spec)
+{
+    char **envp = env_snapshot(); // Built before the fork, so the child does not allocate.
+    pid_t pid = fork();           // Create a new process.
+    if (pid == 0)                 // Child process.
+    {
+        apply_launch_spec(spec);
+
+        // Execute the resolved binary directly.
+        execve(path, argv, envp);
+        perror("execvp");
+        _exit(EXIT_FAILURE); // Skip atexit handlers and stdio buffers inherited from the shell.
+    }
+    else if (pid < 0) // Fork failed.
+    {
+        perror("fork failed");
+    }
+    else if (spec->pgid >= 0)
+    {
+        setpgid(pid, spec->pgid > 0 ? spec->pgid : pid); // Also from the parent, so no one races the child.
+    }
+    return pid;
+}
+
+/**
+ * Runs a built-in as a pipeline stage in a forked child, for stages that cannot run inside the
+ * shell. The child exits with the built-in's status.
+ *
+ * @param builtin The built-in to run.
+ * @param argv Its expanded argument vector.
+ * @param spec Descriptor plumbing to apply in the child.
+ * @return The child's PID, or -1 if the fork failed.
+ */
+pid_t fork_builtin(const Builtin *builtin, char *argv[], const LaunchSpec *spec)
+{
+    fflush(stdout); // Do not let the child inherit pending output.
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        apply_launch_spec(spec);
+        int status = run_builtin(builtin, argv);
+        fflush(stdout);
+        _exit(status);
+    }
+    else if (pid < 0)
+    {
+        perror("fork failed");
+    }
+    else if (spec->pgid >= 0)
+    {
+        setpgid(pid, spec->pgid > 0 ? spec->pgid : pid); // Also from the parent, so no one races the child.
+    }
+    return pid;
+}
+
+/**
+ * Prepares a forked child to become a job process: joins the job's process group, restores the
+ * signal state the shell changed, and installs the descriptor plumbing. 'with' settings are
+ * applied last, so their errors go to the command's stderr; a child that cannot honour them
+ * exits with status 126 rather than run unconstrained.
+ *
+ * @param spec Descriptor plumbing to apply.
+ */
+void apply_launch_spec(const LaunchSpec *spec)
+{
+    // Join the job's process group and restore the signal state the shell changed.
+    if (spec->pgid >= 0)
+    {
+        setpgid(0, spec->pgid);
+    }
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        if (sigismember(&child_sigdefault, sig) == 1)
+        {
+            signal(sig, SIG_DFL);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+
+    // Redirect input and output if necessary.
+    if (spec->fd_in >= 0)
+    {
+        dup2(spec->fd_in, STDIN_FILENO);
+        close(spec->fd_in);
+    }
+    if (spec->fd_out >= 0)
+    {
+        dup2(spec->fd_out, STDOUT_FILENO);
+        close(spec->fd_out);
+    }
+    if (spec->fd_close >= 0)
+    {
+        close(spec->fd_close);
+    }
+    for (int i = 0; i < spec->num_moves; i++)
+    {
+        if (spec->moves[i].from == spec->moves[i].to)
+        {
+            fcntl(spec->moves[i].to, F_SETFD, 0); // Kept under its own number: just survive exec.
+            continue;
+        }
+        dup2(spec->moves[i].from, spec->moves[i].to);
+    }
+    if (spec->attrs != NULL && !apply_launch_attrs(spec->attrs))
+    {
+        _exit(126);
+    }
+}
+
+/**
+ * Applies 'with' settings to the calling process. The cgroup comes first, since its cpuset may
+ * restrict the CPUs that can be chosen, then the affinity and the nice value; all of them are
+ * inherited by whatever the process starts.
+ *
+ * @param attrs The settings.
+ * @return False after reporting the first setting that could not be applied.
+ */
+bool apply_launch_attrs(const LaunchAttrs *attrs)
+{
+    if (attrs->cgroup != NULL)
+    {
+        // Writing 0 to cgroup.procs moves the writer itself.
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s/cgroup.procs", CGROUP_ROOT, attrs->cgroup + (attrs->cgroup[0] == '/'));
+        int fd = open(path, O_WRONLY | O_CLOEXEC);
+        bool moved = fd >= 0 && write(fd, "0", 1) == 1;
+        int err = errno;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (!moved)
+        {
+            fprintf(stderr, "wsh: with: cgroup %s: %s\n", attrs->cgroup, strerror(err));
+            return false;
+        }
+    }
+    if (attrs->set_cpus && sched_setaffinity(0, sizeof(attrs->cpus), &attrs->cpus) != 0)
+    {
+        fprintf(stderr, "wsh: with: cpus: %s\n", strerror(errno));
+        return false;
+    }
+    if (attrs->set_nice && setpriority(PRIO_PROCESS, 0, attrs->nice) != 0)
+    {
+        fprintf(stderr, "wsh: with: nice %d: %s\n", attrs->nice, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Parses one 'key=value' setting of a 'with' prefix: 'cpus=' takes a list such as 0-7,12,
+ * 'nice=' a value from -20 to 19 and 'cgroup=' a cgroup below CGROUP_ROOT. Values are taken as
+ * written; they are not expanded.
+ *
+ * @param attrs The settings being built.
+ * @param setting The word, in lexer form; split in place.
+ * @return False after reporting a syntax error.
+ */
+bool launch_attrs_set(LaunchAttrs *attrs, char *setting)
+{
+    remove_quote_escapes(setting);
+    char *value = strchr(setting, '=');
+    if (value != NULL)
+    {
+        *value++ = '\0';
+        char *end;
+        long nice = strtol(value, &end, 10);
+        if (strcmp(setting, "cpus") == 0 && parse_cpu_list(value, &attrs->cpus))
+        {
+            attrs->set_cpus = true;
+            return true;
+        }
+        if (strcmp(setting, "nice") == 0 && *value != '\0' && *end == '\0' && nice >= -20 && nice <= 19)
+        {
+            attrs->set_nice = true;
+            attrs->nice = nice;
+            return true;
+        }
+        if (strcmp(setting, "cgroup") == 0 && *value != '\0' && strstr(value, "..") == NULL)
+        {
+            attrs->cgroup = value;
+            return true;
+        }
+    }
+    parse_error("with: invalid setting '%s%s%s'", setting, value != NULL ? "=" : "", value != NULL ? value : "");
+    return false;
+}
+
+/**
+ * Parses a CPU list in the kernel's format: comma-separated numbers and ranges, as in 0-3,8,10-11.
+ *
+ * @param text The list.
+ * @param set Receives the CPUs.
+ * @return False if the list is empty, malformed or names a CPU beyond CPU_SETSIZE.
+ */
+bool parse_cpu_list(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *p = text;
+    do
+    {
+        char *end;
+        if (!isdigit((unsigned char)*p))
+        {
+            return false;
+        }
+        long first = strtol(p, &end, 10), last = first;
+        if (*end == '-')
+        {
+            p = end + 1;
+            if (!isdigit((unsigned char)*p))
+            {
+                return false;
+            }
+            last = strtol(p, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        p = end;
+    } while (*p++ == ',');
+    return p[-1] == '\0';
+}
+
+/**
+ * Resolves a command name to the binary that would be executed, the way execvp searches PATH.
+ * Names containing a '/' are used as given. Successful searches are remembered in the PATH
+ * cache so later launches of the same command skip the directory walk entirely.
+ *
+ * @param name The command name to resolve.
+ * @return Path of the binary, or NULL if no executable was found in PATH.
+ */
+const char *resolve_command(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return name; // Explicit paths bypass PATH and the cache.
+    }
+
+    PathCacheEntry *entry = path_cache_lookup(name, false);
+    if (entry != NULL)
+    {
+        entry->hits++;
+        return entry->path;
+    }
+
+    const char *path_env = env_value("PATH");
+    if (path_env == NULL)
+    {
+        path_env = "/bin:/usr/bin"; // Same default confstr(_CS_PATH) gives execvp.
+    }
+
+    // Walk PATH once, testing each candidate without executing it.
+    size_t name_len = strlen(name);
+    char candidate[MAX_LINE_LENGTH * 4];
+    const char *dir = path_env;
+    while (true)
+    {
+        const char *end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        if (dir_len + name_len + 2 <= sizeof(candidate))
+        {
+            if (dir_len == 0)
+            {
+                candidate[0] = '.'; // An empty PATH element means the current directory.
+                dir_len = 1;
+            }
+            else
+            {
+                memcpy(candidate, dir, dir_len);
+            }
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+            struct stat st;
+            if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            {
+                entry = path_cache_lookup(name, true);
+                entry->path = strdup(candidate);
+                if (entry->path == NULL)
+                {
+                    perror("Failed to allocate memory");
+                    exit(EXIT_FAILURE);
+                }
+                entry->hits = 1;
+                return entry->path;
+            }
+        }
+        if (*end == '\0')
+        {
+            break;
+        }
+        dir = end + 1;
+    }
+
+    return NULL; // Not found anywhere in PATH.
+}
+
+/**
+ * Computes the PATH cache bucket for a command name.
+ *
+ * @param name The command name.
+ * @return Index of the bucket holding the name.
+ */
+unsigned int path_cache_bucket(const char *name)
+{
+    return hash_string(name) % PATH_CACHE_BUCKETS;
+}
+
+/**
+ * Hashes a string with 32-bit FNV-1a.
+ *
+ * @param str The string to hash.
+ * @return The hash value.
+ */
+unsigned int hash_string(const char *str)
+{
+    unsigned int hash = 2166136261u;
+    for (const char *p = str; *p != '\0'; p++)
+    {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Hashes a byte string that may contain NUL bytes, with the same function as hash_string().
+ *
+ * @param data The bytes.
+ * @param len Number of bytes.
+ * @return The hash value.
+ */
+unsigned int hash_bytes(const char *data, size_t len)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Looks up a command in the PATH cache, optionally creating an empty entry for it.
+ *
+ * @param name The command name.
+ * @param insert Whether to create the entry when it does not exist.
+ * @return The entry, or NULL if it does not exist and insert is false.
+ */
+PathCacheEntry *path_cache_lookup(const char *name, bool insert)
+{
+    unsigned int bucket = path_cache_bucket(name);
+    for (PathCacheEntry *entry = path_cache[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            return entry;
+        }
+    }
+
+    if (!insert)
+    {
+        return NULL;
+    }
+
+    PathCacheEntry *entry = calloc(1, sizeof(PathCacheEntry));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    entry->next = path_cache[bucket]; // Prepend to the bucket's chain.
+    path_cache[bucket] = entry;
+    return entry;
+}
+
+/**
+ * Removes a single command from the PATH cache, if present.
+ *
+ * @param name The command name to forget.
+ */
+void path_cache_forget(const char *name)
+{
+    PathCacheEntry **link = &path_cache[path_cache_bucket(name)];
+    while (*link != NULL)
+    {
+        PathCacheEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next; // Unlink and release the entry.
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * Empties the PATH cache. Called for 'hash -r' and whenever PATH changes.
+ */
+void path_cache_clear()
+{
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        PathCacheEntry *entry = path_cache[i];
+        while (entry != NULL)
+        {
+            PathCacheEntry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache[i] = NULL;
+    }
+}
+
+/**
+ * Runs a single command through the memo cache. A live entry for the same argument vector,
+ * working directory and environment is replayed without launching anything. Otherwise the
+ * command runs with its standard output going to a memory file, which is copied to the shell's
+ * output and cached once the command has exited. Standard error is not captured, and results of
+ * commands killed by a signal or stopped are not cached.
+ *
+ * WSH_MEMO_TTL sets how many seconds results stay valid (default 60), WSH_MEMO_SIZE how much
+ * output the cache holds in total (default 16M), and WSH_MEMO_ENV is a colon-separated list of
+ * further environment variables the result depends on; PATH is always part of the key.
+ *
+ * @param pipeline The pipeline, made of one external command without redirections.
+ * @return The command's exit status.
+ */
+int execute_memoized(Pipeline *pipeline)
+{
+    char **argv = prepare_argv(pipeline->cmds[0]);
+    if (!isValidCommand(argv))
+    {
+        printf("Error: Command validation failed.\n");
+        return 1;
+    }
+
+    size_t key_len;
+    char *key = memo_key(argv, &key_len);
+    unsigned int hash = hash_bytes(key, key_len);
+    MemoEntry *entry = memo_lookup(key, key_len, hash);
+    if (entry != NULL)
+    {
+        memo_cache.hits++;
+        fflush(stdout);
+        write_all(STDOUT_FILENO, entry->output, entry->size);
+        return entry->status;
+    }
+
+    memo_cache.misses++;
+    int capture = memfd_create("wsh-memo", MFD_CLOEXEC);
+    if (capture < 0)
+    {
+        fflush(stdout); // Run it uncached, straight to the shell's output; argv is already expanded.
+    }
+    LaunchSpec spec = {-1, capture, -1, {{0, 0, false}}, 0, job_control ? 0 : -1, pipeline->attrs};
+    sigset_t saved;
+    block_child_signals(&saved);
+    pid_t pid = launch_process(argv, &spec);
+    int status = 127;
+    bool finished = false;
+    if (pid > 0)
+    {
+        Job *job = job_for_pipeline(pipeline, 1);
+        job_add_process(job, pid, argv[0]);
+        unsigned long serial = pipe_status_serial;
+        status = job_launched(job);
+        finished = pipe_status_serial != serial && status < 128; // Exited, not stopped or killed.
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    if (capture < 0)
+    {
+        return status;
+    }
+
+    // Copy the output to the shell's standard output, keeping it if it fits in the cache.
+    fflush(stdout);
+    off_t size = lseek(capture, 0, SEEK_END);
+    bool keep = finished && size >= 0 && size <= memo_max_bytes();
+    size_t chunk = keep ? (size_t)size : BATCH_STREAM_BUFFER;
+    char *output = malloc(chunk > 0 ? chunk : 1);
+    ssize_t n;
+    for (off_t offset = 0; output != NULL && offset < size && (n = pread(capture, output, chunk, offset)) > 0; offset += n)
+    {
+        write_all(STDOUT_FILENO, output, n);
+    }
+    if (keep && output != NULL)
+    {
+        memo_store(key, key_len, hash, output, size, status);
+    }
+    else
+    {
+        free(output);
+    }
+    close(capture);
+    return status;
+}
+
+/**
+ * Builds the memo cache key of a command: its words, the working directory, PATH and the
+ * variables named in WSH_MEMO_ENV, separated by NUL bytes. The key lives in the line arena.
+ *
+ * @param argv The expanded argument vector.
+ * @param len Receives the length of the key.
+ * @return The key.
+ */
+char *memo_key(char *argv[], size_t *len)
+{
+    char *key = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&key, &size);
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        fwrite(argv[i], 1, strlen(argv[i]) + 1, out);
+    }
+    char cwd[PATH_MAX];
+    fprintf(out, "%c%s%c", '\0', getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "", '\0');
+
+    const char *path = env_value("PATH");
+    fprintf(out, "PATH=%s%c", path != NULL ? path : "", '\0');
+    const char *names = shell_setting("WSH_MEMO_ENV");
+    while (names != NULL && *names != '\0')
+    {
+        size_t name_len = strcspn(names, ":");
+        char *name = arena_strndup(&line_arena, names, name_len); // Whole, so long names stay distinct.
+        const char *value = env_value(name);
+        fprintf(out, "%s=%s%c", name, value != NULL ? value : "", value != NULL ? '\0' : '\1');
+        names += name_len + (names[name_len] == ':');
+    }
+    fclose(out);
+
+    char *copy = arena_strndup(&line_arena, key, size);
+    free(key);
+    *len = size;
+    return copy;
+}
+
+/**
+ * Reads WSH_MEMO_SIZE, the total size of output the memo cache may hold.
+ *
+ * @return The limit in bytes.
+ */
+long memo_max_bytes()
+{
+    const char *value = shell_setting("WSH_MEMO_SIZE");
+    long size = value != NULL ? parse_size(value) : -1;
+    return size >= 0 ? size : MEMO_DEFAULT_SIZE;
+}
+
+/**
+ * Reads WSH_MEMO_TTL, the number of seconds a memoized result stays valid. A value that is not a
+ * positive number of seconds is reported once and MEMO_DEFAULT_TTL is used instead, since it
+ * would otherwise make every entry stale and silently disable the cache.
+ *
+ * @return The TTL in seconds.
+ */
+long memo_ttl()
+{
+    const char *value = shell_setting("WSH_MEMO_TTL");
+    if (value == NULL || *value == '\0')
+    {
+        return MEMO_DEFAULT_TTL;
+    }
+    char *end;
+    errno = 0;
+    long ttl = strtol(value, &end, 10);
+    if (*end == '\0' && errno != ERANGE && ttl > 0)
+    {
+        return ttl;
+    }
+    if (memo_ttl_reported == NULL || strcmp(memo_ttl_reported, value) != 0)
+    {
+        fprintf(stderr, "wsh: WSH_MEMO_TTL=%s: invalid number of seconds, using %d\n", value, MEMO_DEFAULT_TTL);
+        free(memo_ttl_reported);
+        memo_ttl_reported = strdup(value);
+    }
+    return MEMO_DEFAULT_TTL;
+}
+
+/**
+ * Writes a whole buffer to a descriptor, retrying short writes.
+ *
+ * @param fd The descriptor.
+ * @param data The bytes to write.
+ * @param len Number of bytes.
+ * @return False if a write failed, for instance because the reader went away.
+ */
+bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Finds the memo cache entry for a key and marks it as the most recently used. An entry older
+ * than WSH_MEMO_TTL is dropped instead.
+ *
+ * @param key The key.
+ * @param len Length of the key.
+ * @param hash Hash of the key.
+ * @return The entry, or NULL if there is no live one.
+ */
+MemoEntry *memo_lookup(const char *key, size_t len, unsigned int hash)
+{
+    for (MemoEntry *entry = memo_cache.buckets[hash % MEMO_BUCKETS]; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash != hash || entry->key_len != len || memcmp(entry->key, key, len) != 0)
+        {
+            continue;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - entry->stored >= memo_ttl())
+        {
+            memo_evict(entry);
+            return NULL;
+        }
+        memo_unlink(entry);
+        entry->older = memo_cache.newest;
+        if (memo_cache.newest != NULL)
+        {
+            memo_cache.newest->newer = entry;
+        }
+        memo_cache.newest = entry;
+        if (memo_cache.oldest == NULL)
+        {
+            memo_cache.oldest = entry;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * Adds a result to the memo cache, evicting the least recently used entries until the output of
+ * all entries fits in WSH_MEMO_SIZE.
+ *
+ * @param key The key; it is copied.
+ * @param len Length of the key.
+ * @param hash Hash of the key.
+ * @param output Captured output, allocated with malloc; the cache takes ownership.
+ * @param size Length of the output.
+ * @param status Exit status of the command.
+ */
+void memo_store(char *key, size_t len, unsigned int hash, char *output, size_t size, int status)
+{
+    while (memo_cache.oldest != NULL && memo_cache.bytes + size > (size_t)memo_max_bytes())
+    {
+        memo_evict(memo_cache.oldest);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    MemoEntry *entry = calloc(1, sizeof(MemoEntry));
+    if (entry == NULL || (entry->key = malloc(len)) == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry->key, key, len);
+    entry->key_len = len;
+    entry->hash = hash;
+    entry->output = output;
+    entry->size = size;
+    entry->status = status;
+    entry->stored = now.tv_sec;
+
+    entry->next = memo_cache.buckets[hash % MEMO_BUCKETS]; // Prepend to the bucket's chain.
+    memo_cache.buckets[hash % MEMO_BUCKETS] = entry;
+    entry->older = memo_cache.newest;
+    if (memo_cache.newest != NULL)
+    {
+        memo_cache.newest->newer = entry;
+    }
+    memo_cache.newest = entry;
+    if (memo_cache.oldest == NULL)
+    {
+        memo_cache.oldest = entry;
+    }
+    memo_cache.bytes += size;
+}
+
+/**
+ * Takes a memo cache entry off the use list.
+ *
+ * @param entry The entry.
+ */
+void memo_unlink(MemoEntry *entry)
+{
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        memo_cache.newest = entry->older;
+    }
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        memo_cache.oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+}
+
+/**
+ * Removes an entry from the memo cache and frees it.
+ *
+ * @param entry The entry.
+ */
+void memo_evict(MemoEntry *entry)
+{
+    MemoEntry **link = &memo_cache.buckets[entry->hash % MEMO_BUCKETS];
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    memo_unlink(entry);
+    memo_cache.bytes -= entry->size;
+    free(entry->key);
+    free(entry->output);
+    free(entry);
+}
+
+/**
+ * Prints the history of commands executed in the shell session up to the current moment.
+ * This function walks the ring from the newest entry backwards, displaying each command
+ * along with its order number, starting from the most recent.
+ */
+void print_history()
+{
+    if (current_history_count == 0)
+    {
+        return; // Exit early if there are no commands in history.
+    }
+    for (int n = 1; n <= current_history_count; n++)
+    {
+        HistoryEntry *entry = history_at(n);
+        printf("%d) %.*s\n", n, (int)entry->len, entry->text); // Print each command in reverse order.
+    }
+}
+
+/**
+ * Sets or updates a local variable within the shell's environment.
+ * If a variable with the given name already exists, its value is updated.
+ * Otherwise, a new variable is created.
+ *
+ * @param name The name of the variable to set or update.
+ * @param value The value to assign to the variable.
+ */
+void set_local_var(char *name, char *value)
+{
+    var_table_set(&local_vars, name, value);
+}
+
+/**
+ * Looks up a variable by name.
+ *
+ * @param table The table to search.
+ * @param name The variable name.
+ * @return The variable's entry, or NULL if it is not set.
+ */
+VarEntry *var_table_find(VarTable *table, const char *name)
+{
+    return var_table_lookup(table, name, strlen(name));
+}
+
+/**
+ * Looks up a variable by a name given as a pointer and a length, so a name can be looked up
+ * where it appears inside a word.
+ *
+ * @param table The table to search.
+ * @param name Start of the variable name.
+ * @param len Length of the name.
+ * @return The variable's entry, or NULL if it is not set.
+ */
+VarEntry *var_table_lookup(VarTable *table, const char *name, size_t len)
+{
+    if (table->num_slots == 0)
+    {
+        return NULL;
+    }
+
+    unsigned int hash = hash_bytes(name, len);
+    unsigned int mask = table->num_slots - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask)
+    {
+        int slot = table->slots[i];
+        if (slot == 0)
+        {
+            return NULL; // An empty slot ends the probe sequence.
+        }
+        if (slot > 0)
+        {
+            VarEntry *entry = &table->entries[slot - 1];
+            if (entry->hash == hash && strncmp(entry->name, name, len) == 0 && entry->name[len] == '\0')
+            {
+                return entry;
+            }
+        }
+    }
+}
+
+/**
+ * Sets a variable, appending it in insertion order if it is new.
+ *
+ * @param table The table to update.
+ * @param name The variable name.
+ * @param value The new value.
+ */
+void var_table_set(VarTable *table, const char *name, const char *value)
+{
+    size_t len = strlen(value);
+    VarEntry *entry = var_table_find(table, name);
+    if (entry != NULL)
+    {
+        // Update in place, growing the value buffer only when the new value does not fit.
+        if (len + 1 > entry->value_cap)
+        {
+            char *grown = realloc(entry->value, len + 1);
+            if (grown == NULL)
+            {
+                perror("Failed to allocate memory");
+                exit(EXIT_FAILURE);
+            }
+            entry->value = grown;
+            entry->value_cap = len + 1;
+        }
+        memcpy(entry->value, value, len + 1);
+        return;
+    }
+
+    // Keep the index at most half full, counting tombstones; this also compacts unset entries.
+    if ((table->live + table->tombstones + 1) * 2 > table->num_slots)
+    {
+        int num_slots = table->num_slots > 0 ? table->num_slots : VAR_TABLE_MIN_SLOTS;
+        while ((table->live + 1) * 2 > num_slots)
+        {
+            num_slots *= 2;
+        }
+        var_table_rebuild(table, num_slots);
+    }
+    if (table->count == table->capacity)
+    {
+        int capacity = table->capacity > 0 ? table->capacity * 2 : VAR_TABLE_MIN_SLOTS / 2;
+        VarEntry *entries = realloc(table->entries, capacity * sizeof(VarEntry));
+        if (entries == NULL)
+        {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+
+    entry = &table->entries[table->count];
+    entry->name = strdup(name);
+    entry->value = malloc(len + 1);
+    if (entry->name == NULL || entry->value == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(entry->value, value, len + 1);
+    entry->value_cap = len + 1;
+    entry->hash = hash_string(name);
+    entry->live = true;
+
+    // Claim the first free slot on the probe sequence.
+    unsigned int mask = table->num_slots - 1;
+    unsigned int i = entry->hash & mask;
+    while (table->slots[i] > 0)
+    {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i] < 0)
+    {
+        table->tombstones--; // Reusing a tombstone.
+    }
+    table->slots[i] = ++table->count;
+    table->live++;
+}
+
+/**
+ * Removes a variable. Its slot becomes a tombstone and its entry is dropped at the next rebuild,
+ * so the remaining variables keep their order without shifting the array.
+ *
+ * @param table The table to update.
+ * @param name The variable name.
+ */
+void var_table_unset(VarTable *table, const char *name)
+{
+    VarEntry *entry = var_table_find(table, name);
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    int number = entry - table->entries + 1;
+    unsigned int mask = table->num_slots - 1;
+    unsigned int i = entry->hash & mask;
+    while (table->slots[i] != number)
+    {
+        i = (i + 1) & mask;
+    }
+    table->slots[i] = -1;
+    table->tombstones++;
+
+    free(entry->name);
+    free(entry->value);
+    entry->name = NULL;
+    entry->value = NULL;
+    entry->live = false;
+    table->live--;
+}
+
+/**
+ * Drops unset entries from the array, keeping the order of the rest, and rebuilds the index.
+ *
+ * @param table The table to rebuild.
+ * @param num_slots New size of the index; must be a power of two.
+ */
+void var_table_rebuild(VarTable *table, int num_slots)
+{
+    int kept = 0;
+    for (int i = 0; i < table->count; i++)
+    {
+        if (table->entries[i].live)
+        {
+            table->entries[kept++] = table->entries[i];
+        }
+    }
+    table->count = kept;
+
+    free(table->slots);
+    table->slots = calloc(num_slots, sizeof(int));
+    if (table->slots == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    table->num_slots = num_slots;
+    table->tombstones = 0;
+
+    unsigned int mask = num_slots - 1;
+    for (int n = 0; n < kept; n++)
+    {
+        unsigned int i = table->entries[n].hash & mask;
+        while (table->slots[i] != 0)
+        {
+            i = (i + 1) & mask;
+        }
+        table->slots[i] = n + 1;
+    }
+}
+
+/**
+ * Expands a word in lexer form: '$NAME' and '${NAME}' are replaced by the variable's value
+ * wherever they appear, '$(cmd)' by the output of cmd, and the quote markers are removed. A '$'
+ * that is quoted or not followed by a name is kept. Neither kind of expansion splits the word.
+ * The result is built in the line arena in a single pass; words without a '$' are only cleaned in
+ * place. Unset variables expand to nothing, so a word made only of them becomes empty. For a word
+ * that is going to be globbed, quoted glob characters, those in substituted values and every
+ * backslash are escaped with a backslash instead, so only the unquoted ones are active.
+ *
+ * @param word Pointer to the word; updated to point at the expanded result.
+ * @param pattern Whether to produce a pattern for glob_word().
+ */
+void expand_word(char **word, bool pattern)
+{
+    char *in = strchr(*word, '$');
+    if (in == NULL && !pattern)
+    {
+        remove_quote_escapes(*word);
         return;
     }
-    history = temp;             // Update the history pointer to the newly allocated memory.
-    history_capacity = newSize; // Update the capacity to reflect the new size.
 
-    // Ensure the current history count does not exceed the new size.
-    current_history_count = current_history_count > newSize ? newSize : current_history_count;
+    size_t cap = strlen(*word) + 64;
+    char *out = arena_alloc(&line_arena, cap);
+    size_t len = 0;
+    for (in = *word + (**word == CTLQUOTE); *in != '\0';)
+    {
+        const char *value = NULL;
+        size_t value_len = 0;
+        bool literal = true; // Whether glob characters in value are to be matched literally.
+        if (*in == CTLESC && in[1] != '\0')
+        {
+            value = in + 1; // Quoted character, copied as is.
+            value_len = 1;
+            in += 2;
+        }
+        else if (*in == '$' && in[1] == '(')
+        {
+            const char *close = parse_substitution(in + 1); // Found by the lexer already.
+            value = command_substitution(in + 2, close - in - 2, &value_len);
+            in = (char *)close + 1;
+        }
+        else if (*in == '$' && (in[1] == '?' || in[1] == '_' || isalpha((unsigned char)in[1]) || in[1] == '{'))
+        {
+            const char *name = in + 1 + (in[1] == '{');
+            const char *end = name;
+            if (*end == '?')
+            {
+                end++;
+            }
+            else
+            {
+                while (*end == '_' || isalnum((unsigned char)*end))
+                {
+                    end++;
+                }
+            }
+            if (in[1] == '{' && (*end != '}' || end == name))
+            {
+                value = in; // Not a valid '${NAME}': keep the '$' literally.
+                value_len = 1;
+                in++;
+            }
+            else
+            {
+                value = lookup_variable(name, end - name);
+                value_len = value != NULL ? strlen(value) : 0;
+                in = (char *)end + (in[1] == '{');
+            }
+        }
+        else
+        {
+            value = in++;
+            value_len = 1;
+            literal = false;
+        }
+
+        size_t need = pattern ? value_len * 2 : value_len; // Room for an escape before each byte.
+        if (len + need + 1 > cap)
+        {
+            // Move to a larger buffer; the old one is released with the line.
+            cap = (len + need + 1) * 2;
+            char *bigger = arena_alloc(&line_arena, cap);
+            memcpy(bigger, out, len);
+            out = bigger;
+        }
+        if (pattern)
+        {
+            for (size_t i = 0; i < value_len; i++)
+            {
+                char c = value[i];
+                if (c == '\\' || (literal && c != '\0' && strchr(GLOB_CHARS, c) != NULL))
+                {
+                    out[len++] = '\\';
+                }
+                out[len++] = c;
+            }
+        }
+        else if (value_len > 0)
+        {
+            memcpy(out + len, value, value_len); // value is NULL for an unset variable.
+            len += value_len;
+        }
+    }
+    out[len] = '\0';
+    *word = out;
+}
+
+/**
+ * Looks up a variable for expansion. The shell's own variables come first, then the
+ * environment, then local variables; each is a single hash probe.
+ *
+ * @param name Start of the variable name.
+ * @param len Length of the name.
+ * @return The value, or NULL if the variable is not set.
+ */
+const char *lookup_variable(const char *name, size_t len)
+{
+    const char *value = special_variable(name, len);
+    if (value != NULL)
+    {
+        return value;
+    }
+    VarEntry *entry = var_table_lookup(env_table(), name, len);
+    if (entry == NULL)
+    {
+        entry = var_table_lookup(&local_vars, name, len);
+    }
+    return entry != NULL ? entry->value : NULL;
+}
+
+/**
+ * Runs the command of a '$(cmd)' substitution and returns its output without trailing newlines.
+ * The output goes to a memfd, like that of 'memo', so the command runs through the usual
+ * foreground wait whatever its size, and is then copied into the line arena with one pread() of
+ * exactly its size. A single utility built-in such as echo or printf runs in the shell itself;
+ * a single external command is launched directly; anything else (pipelines, lists, built-ins
+ * with side effects) runs in a forked subshell, so it cannot change the shell's state. Nested
+ * substitutions are expanded when the inner command's words are.
+ *
+ * @param text The command, as written between the parentheses.
+ * @param len Length of the command.
+ * @param out_len Receives the length of the output.
+ * @return The output in the line arena; empty if the command could not be run.
+ */
+char *command_substitution(const char *text, size_t len, size_t *out_len)
+{
+    *out_len = 0;
+    char *inner = arena_strndup(&line_arena, text, len);
+    Pipeline *parsed = parse_line(inner, &line_arena);
+    if (parsed == NULL || parsed->num_cmds == 0)
+    {
+        return "";
+    }
+    int capture = memfd_create("wsh-subst", MFD_CLOEXEC);
+    if (capture < 0)
+    {
+        perror("command substitution");
+        return "";
+    }
+
+    bool simple = parsed->next == NULL && parsed->num_cmds == 1 && !parsed->background && !parsed->timed &&
+                  !parsed->memo && parsed->cmds[0]->argc > 0;
+    Command *cmd = parsed->cmds[0];
+    const Builtin *builtin = simple ? find_builtin(cmd->argv[0]) : NULL;
+    char **argv = NULL;
+    int status = 1;
+    if (builtin != NULL && builtin->utility)
+    {
+        // Output of a built-in goes to the memfd through the shell's own stdout.
+        argv = prepare_argv(cmd);
+        LaunchSpec spec = {-1, fcntl(capture, F_DUPFD_CLOEXEC, 0), -1, {{0, 0, false}}, 0, -1, NULL};
+        status = run_builtin_in_shell(builtin, argv, cmd, &spec);
+    }
+    else
+    {
+        sigset_t saved;
+        block_child_signals(&saved); // The reaper must not see the child before its job exists.
+        LaunchSpec spec = {-1, capture, -1, {{0, 0, false}}, 0, job_control ? 0 : -1, NULL};
+        pid_t pid = -1;
+        if (simple && builtin == NULL)
+        {
+            argv = prepare_argv(cmd);
+            if (argv[0] != NULL && open_redirects(cmd, argv, &spec))
+            {
+                pid = launch_process(argv, &spec);
+                close_redirects(&spec);
+            }
+            status = argv[0] != NULL ? 127 : 0;
+        }
+        else
+        {
+            fflush(stdout); // Do not let the child inherit pending output.
+            fflush(stderr);
+            pid = fork();
+            if (pid == 0)
+            {
+                apply_launch_spec(&spec);
+                job_table_reset(); // The parent's jobs are not this process's children.
+                job_control = false;
+                add_to_history_enabled = false;
+                execute_parsed(inner, parsed);
+                fflush(stdout);
+                exit(last_status);
+            }
+            else if (pid < 0)
+            {
+                perror("fork failed");
+            }
+            else if (spec.pgid >= 0)
+            {
+                setpgid(pid, pid); // Also from the parent, so no one races the child.
+            }
+        }
+        if (pid > 0)
+        {
+            Job *job = job_create(inner, false, 1); // Waited for even if it ends in '&'.
+            job_add_process(job, pid, simple && builtin == NULL ? argv[0] : "subshell");
+            status = job_launched(job);
+        }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+    }
+
+    // Copy the output into the arena, minus the trailing newlines.
+    off_t size = lseek(capture, 0, SEEK_END);
+    char *output = arena_alloc(&line_arena, size > 0 ? size + 1 : 1);
+    size_t got = 0;
+    ssize_t n;
+    while (size > 0 && got < (size_t)size && (n = pread(capture, output + got, size - got, got)) > 0)
+    {
+        got += n;
+    }
+    close(capture);
+    while (got > 0 && output[got - 1] == '\n')
+    {
+        got--;
+    }
+    output[got] = '\0';
+    last_status = status;
+    *out_len = got;
+    return output;
+}
+
+/**
+ * Returns the shell's copy of the environment, indexed like the local variables. It is built
+ * from environ the first time it is needed and kept in step by 'export', so lookups never scan
+ * the environment.
+ *
+ * @return The environment table.
+ */
+VarTable *env_table()
+{
+    if (!env_loaded)
+    {
+        env_loaded = true;
+        for (char **env = environ; *env != NULL; env++)
+        {
+            char *equals = strchr(*env, '=');
+            if (equals != NULL)
+            {
+                char *name = strndup(*env, equals - *env);
+                var_table_set(&env_vars, name, equals + 1);
+                free(name);
+            }
+        }
+    }
+    return &env_vars;
+}
+
+/**
+ * Looks up an environment variable. Until the environment has been changed, this is getenv();
+ * afterwards it is a probe of the shell's table.
+ *
+ * @param name The variable name.
+ * @return Its value, or NULL if it is not set.
+ */
+const char *env_value(const char *name)
+{
+    if (!env_loaded)
+    {
+        return getenv(name);
+    }
+    VarEntry *entry = var_table_find(&env_vars, name);
+    return entry != NULL ? entry->value : NULL;
+}
+
+/**
+ * Returns the environment handed to launched commands. While nothing has been exported this is
+ * the inherited environ. After an export, the table is flattened into one block holding the
+ * pointer array and every "NAME=value" string; the block is rebuilt only when env_generation
+ * has moved on, so all launches in between share it.
+ *
+ * @return The null-terminated envp; do not modify or free it.
+ */
+char **env_snapshot()
+{
+    if (!env_loaded)
+    {
+        return environ;
+    }
+    if (env_snapshot_envp != NULL && env_snapshot_generation == env_generation)
+    {
+        return env_snapshot_envp;
+    }
+
+    size_t bytes = (env_vars.live + 1) * sizeof(char *);
+    for (int i = 0; i < env_vars.count; i++)
+    {
+        if (env_vars.entries[i].live)
+        {
+            bytes += strlen(env_vars.entries[i].name) + strlen(env_vars.entries[i].value) + 2;
+        }
+    }
+    char **envp = malloc(bytes);
+    if (envp == NULL)
+    {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    char *out = (char *)(envp + env_vars.live + 1);
+    int n = 0;
+    for (int i = 0; i < env_vars.count; i++)
+    {
+        VarEntry *entry = &env_vars.entries[i];
+        if (entry->live)
+        {
+            envp[n++] = out;
+            out += sprintf(out, "%s=%s", entry->name, entry->value) + 1;
+        }
+    }
+    envp[n] = NULL;
+
+    free(env_snapshot_envp);
+    env_snapshot_envp = envp;
+    env_snapshot_generation = env_generation;
+    stats.env_rebuilds++;
+    return envp;
+}
 
-    // Initialize any new entries to NULL if the history size has been increased.
-    for (int i = current_history_count; i < newSize; i++)
+/**
+ * Looks up a variable the shell maintains itself: '?' is the exit status of the last pipeline and
+ * 'PIPESTATUS' the space-separated statuses of its stages. The value is formatted into the line
+ * arena.
+ *
+ * @param name The variable name, without '$'.
+ * @param len Length of the name.
+ * @return The value, or NULL if the name is not a special variable.
+ */
+const char *special_variable(const char *name, size_t len)
+{
+    if (len == 1 && *name == '?')
+    {
+        char *value = arena_alloc(&line_arena, 12);
+        snprintf(value, 12, "%d", last_status);
+        return value;
+    }
+    if (len == 10 && strncmp(name, "PIPESTATUS", 10) == 0)
     {
-        history[i] = NULL;
+        char *value = arena_alloc(&line_arena, pipe_status_count * 4 + 1);
+        char *out = value;
+        *out = '\0';
+        for (int i = 0; i < pipe_status_count; i++)
+        {
+            out += sprintf(out, i > 0 ? " %d" : "%d", pipe_status[i]);
+        }
+        return value;
     }
+    return NULL;
 }
 
 /**
- * Executes a specific command from history based on its number.
+ * Iterates over all arguments in a command and substitutes any variables found.
+ * This function uses expand_word() to process each argument individually.
  *
- * @param command_number The number of the command in history to execute.
+ * @param argv Array of string arguments representing the command and its parameters.
  */
-void execute_history_command(int command_number)
+void substitute_variables_in_command(char *argv[])
 {
-    // Validate the command number.
-    if (command_number < 1 || command_number > current_history_count)
+    for (int i = 0; argv[i] != NULL; i++)
     {
-        printf("Invalid history command number.\n");
-        return;
+        expand_word(&argv[i], false); // Apply variable substitution to each argument.
     }
+}
 
-    // Duplicate the command to ensure it can be modified if needed.
-    char *cmd = strdup(history[current_history_count - command_number]);
+/**
+ * Changes the current working directory of the shell to the specified path.
+ *
+ * @param path The path to change the directory to. If the path is invalid, an error is reported.
+ * @return The result of chdir(): 0 on success, -1 on failure.
+ */
+int cmd_cd(char *path)
+{
+    // Attempt to change the directory. On failure, report the error.
+    int result = chdir(path);
+    if (result != 0)
+    {
+        perror("cd failed");
+        // Do not exit the program on failure, simply report the error.
+    }
+    return result;
+}
 
-    // Temporarily disable adding commands to history to prevent recursion.
-    bool oldHistoryState = add_to_history_enabled;
-    add_to_history_enabled = false;
-    parse_and_execute(cmd);                   // Parse and execute the duplicated command.
-    add_to_history_enabled = oldHistoryState; // Restore the history state.
+/**
+ * Exits the shell program. If additional arguments are provided, an error is reported and the exit is aborted.
+ *
+ * @param argv Array of arguments passed to the exit command. Only the first argument (the command itself) is expected.
+ */
+void cmd_exit(char *argv[])
+{
+    // Check for additional arguments and report an error if found.
+    if (argv[1] != NULL)
+    {
+        fprintf(stderr, "exit: does not take any arguments\n");
+        return; // Return to continue the shell loop, do not exit.
+    }
+    else
+    {
+        exit(last_status); // Exit with the status of the last pipeline, as sh does.
+    }
+}
 
-    free(cmd); // Clean up the duplicated command string.
+/**
+ * Controls the shell's command history. Can display the history, set its size, or execute a command from it.
+ *
+ * @param argv Array of arguments passed to the history command. Supports viewing, setting size, or executing commands.
+ */
+void cmd_history_control(char *argv[])
+{
+    // Display the command history if no additional arguments are provided.
+    if (argv[1] == NULL)
+    {
+        print_history();
+    }
+    // Set the history size if 'set' command is provided with a valid size.
+    else if (strcmp(argv[1], "set") == 0 && argv[2] != NULL)
+    {
+        int newSize = atoi(argv[2]); // Convert the size argument to an integer.
+        set_history_size(newSize);   // Set the new history size.
+    }
+    // Execute a specific command from the history if a command number is provided.
+    else
+    {
+        int command_number = atoi(argv[1]);      // Convert the command number argument to an integer.
+        execute_history_command(command_number); // Execute the specified command.
+    }
 }
 
 /**
- * Validates if the provided command and arguments are syntactically correct.
+ * Sets or unsets an environment variable. Only the shell's table changes; the process
+ * environment stays as it was inherited, and launches pick the change up through
+ * env_snapshot().
  *
- * @param argv Array of command arguments to validate.
- * @return True if the command is valid, False otherwise.
+ * @param name The name of the environment variable to set or unset.
+ * @param value The value to set the environment variable to, or NULL/empty string to unset.
+ * @return 0 on success, 1 after a usage error.
  */
-bool isValidCommand(char *argv[])
+int cmd_export(char *name, char *value)
 {
-    // Command cannot be empty.
-    if (argv[0] == NULL || strcmp(argv[0], "") == 0)
+    // Validate the command usage.
+    if (name == NULL)
     {
-        printf("Error: Command is empty.\n");
-        return false;
+        fprintf(stderr, "Usage: export VAR=value\n");
+        return 1;
     }
 
-    // Special validation for 'cd' command: must have exactly one argument.
-    if (strcmp(argv[0], "cd") == 0)
+    // Unset the environment variable if the value is NULL or an empty string.
+    if (value == NULL || strcmp(value, "") == 0)
+    {
+        var_table_unset(env_table(), name);
+    }
+    else
     {
-        if (argv[1] == NULL || argv[2] != NULL)
+        // Set or update the environment variable with the provided value.
+        VarEntry *entry = var_table_find(env_table(), name);
+        if (entry != NULL && strcmp(entry->value, value) == 0)
         {
-            printf("cd: wrong number of arguments. Usage: cd <directory>\n");
-            return false;
+            return 0; // Unchanged: keep the snapshot.
         }
+        var_table_set(&env_vars, name, value);
     }
-    // 'exit' command should not have any arguments.
-    else if (strcmp(argv[0], "exit") == 0 && argv[1] != NULL)
+    env_generation++;
+
+    // Cached command locations are only valid for the PATH they were found in.
+    if (strcmp(name, "PATH") == 0)
     {
-        printf("exit: does not take any arguments.\n");
-        return false;
+        path_cache_clear();
+    }
+    return 0;
+}
+
+/**
+ * Sets or unsets a local (shell-specific) variable.
+ *
+ * @param name The name of the local variable to set or unset.
+ * @param value The value to set the local variable to, or NULL/empty string to unset.
+ * @return 0 on success, 1 after a usage error.
+ */
+int cmd_local(char *name, char *value)
+{
+    // Validate the command usage.
+    if (name == NULL)
+    {
+        fprintf(stderr, "Usage: local VAR=value\n");
+        return 1;
+    }
+
+    // Unset the local variable if the value is NULL or an empty string.
+    if (value == NULL || strcmp(value, "") == 0)
+    {
+        var_table_unset(&local_vars, name);
     }
-    // 'export' and 'local' commands require a VAR=value format.
-    else if ((strcmp(argv[0], "export") == 0 || strcmp(argv[0], "local") == 0) &&
-             (argv[1] == NULL || argv[2] != NULL || strchr(argv[1], '=') == NULL))
+    else
     {
-        printf("%s: incorrect usage. Expected format: %s VAR=value\n", argv[0], argv[0]);
-        return false;
+        // Set or update the local variable.
+        set_local_var(name, value);
+    }
+    return 0;
+}
+
+/**
+ * Displays all local variables set within the shell, in the order they were first set.
+ */
+void cmd_vars()
+{
+    // Iterate through the list of local variables and print them.
+    for (int i = 0; i < local_vars.count; i++)
+    {
+        VarEntry *entry = &local_vars.entries[i];
+        if (entry->live)
+        {
+            printf("%s=%s\n", entry->name, entry->value); // Print variable name and value.
+        }
+    }
+}
+
+/**
+ * Lists, fills or resets the PATH lookup cache, like the bash builtin of the same name.
+ * 'hash' prints every cached command with its hit count, 'hash -r' forgets all of them,
+ * and 'hash name...' looks each name up and remembers it.
+ *
+ * @param argv Array of arguments passed to the hash command.
+ */
+void cmd_hash(char *argv[])
+{
+    // Reset the cache.
+    if (argv[1] != NULL && strcmp(argv[1], "-r") == 0)
+    {
+        path_cache_clear();
+        return;
     }
-    // 'history' command checks for correct usage with optional 'set' argument.
-    else if (strcmp(argv[0], "history") == 0 && argv[1] != NULL)
+
+    // Resolve and remember each named command.
+    if (argv[1] != NULL)
     {
-        if (strcmp(argv[1], "set") == 0)
+        for (int i = 1; argv[i] != NULL; i++)
         {
-            if (argv[2] == NULL || atoi(argv[2]) <= 0 || argv[3] != NULL)
+            path_cache_forget(argv[i]); // Force a fresh PATH search.
+            if (strchr(argv[i], '/') == NULL && resolve_command(argv[i]) != NULL)
             {
-                printf("history set: incorrect usage.\n");
-                return false;
+                path_cache_lookup(argv[i], false)->hits = 0;
+            }
+            else if (strchr(argv[i], '/') == NULL)
+            {
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
             }
         }
-        else
+        return;
+    }
+
+    // Display the cache contents.
+    bool empty = true;
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++)
+    {
+        for (PathCacheEntry *entry = path_cache[i]; entry != NULL; entry = entry->next)
         {
-            printf("history: incorrect usage. Usage: history [set <size>]\n");
-            return false;
+            if (empty)
+            {
+                printf("hits\tcommand\n");
+                empty = false;
+            }
+            printf("%4d\t%s\n", entry->hits, entry->path);
         }
     }
+    if (empty)
+    {
+        printf("hash: hash table empty\n");
+    }
+}
 
-    return true; // If all checks pass, the command is considered valid.
+/**
+ * Dispatch-table adapter for 'cd'.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_cd(char *argv[])
+{
+    return cmd_cd(argv[1]) == 0 ? 0 : 1; // Call the cd command handler with the directory path.
 }
 
 /**
- * Parses the input command and executes it. This function handles both built-in and external commands,
- * including support for piping and command history.
+ * Dispatch-table adapter for 'exit'.
  *
- * @param input The command line input to parse and execute.
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
  */
-void parse_and_execute(char *input)
+int builtin_exit(char *argv[])
 {
-    // Remove trailing newline, if present, to clean the input for processing.
-    if (input[strlen(input) - 1] == '\n')
-    {
-        input[strlen(input) - 1] = '\0';
-    }
+    cmd_exit(argv); // Call the exit command handler.
+    return 1;       // Only reached when exit refused to run.
+}
 
-    // Duplicate the input for safe modifications during parsing.
-    char *dupInp = strdup(input);
+/**
+ * Dispatch-table adapter for 'history'.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_history(char *argv[])
+{
+    cmd_history_control(argv); // Call the history command handler.
+    return 0;
+}
 
-    // Prepare to check if the command is a built-in command.
-    char tempInput[MAX_LINE_LENGTH];
-    strncpy(tempInput, input, MAX_LINE_LENGTH - 1);
-    tempInput[MAX_LINE_LENGTH - 1] = '\0';
+/**
+ * Dispatch-table adapter for 'export'; splits VAR=value at the first '='.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_export(char *argv[])
+{
+    char *name = strtok(argv[1], "=");
+    char *value = strtok(NULL, "");
+    return cmd_export(name, value); // Call the export command handler with name and value.
+}
 
-    // Extract the first word to identify built-in commands.
-    char *firstToken = strtok(tempInput, " \t\n");
-    bool isBuiltIn = false; // Flag to track if the command is built-in.
+/**
+ * Dispatch-table adapter for 'local'; splits VAR=value at the first '='.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_local(char *argv[])
+{
+    char *name = strtok(argv[1], "=");
+    char *value = strtok(NULL, "");
+    return cmd_local(name, value); // Call the local command handler with name and value.
+}
 
-    // Directly execute built-in commands, bypassing history addition for certain commands.
-    if (firstToken != NULL && isBuiltInCommand(firstToken))
-    {
-        isBuiltIn = true; // Mark as a built-in command.
-        char *argv[MAX_ARGS];
-        int background = 0;
-        process_input(input, argv, &background); // Process the command.
+/**
+ * Dispatch-table adapter for 'vars'.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_vars(char *argv[])
+{
+    (void)argv;
+    cmd_vars(); // Call the vars command handler.
+    return 0;
+}
+
+/**
+ * Dispatch-table adapter for 'hash'.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
+ */
+int builtin_hash(char *argv[])
+{
+    cmd_hash(argv); // Call the hash command handler.
+    return 0;
+}
 
-        if (strcmp(firstToken, "history") != 0 || (argv[1] != NULL))
+/**
+ * Lists the shell's jobs. Finished jobs are reported once and then dropped.
+ *
+ * @param argv Array of command and arguments (unused).
+ * @return Exit status of the command.
+ */
+int builtin_jobs(char *argv[])
+{
+    (void)argv;
+    sigset_t saved;
+    block_child_signals(&saved);
+    for (int i = 0; i < job_table_size; i++)
+    {
+        Job *job = job_table[i];
+        if (job != NULL && !job->batch)
         {
-            built_in_command(argv); // Execute if not a pure history view request.
+            job_print(job);
+            if (job_is_done(job))
+            {
+                job_remove(job);
+            }
         }
-        else if (strcmp(firstToken, "history") == 0)
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return 0;
+}
+
+/**
+ * Waits for the named jobs, or for every running background job when none is named. Stopped
+ * jobs are not waited for, since nothing would resume them.
+ *
+ * @param argv Array of command and job arguments ('%n' or a PID).
+ * @return Exit status of the last job waited for; 127 if a named job does not exist.
+ */
+int builtin_wait(char *argv[])
+{
+    int status = 0;
+    sigset_t saved;
+    block_child_signals(&saved);
+    if (argv[1] == NULL)
+    {
+        for (int i = 0; i < job_table_size; i++)
         {
-            print_history(); // Handle history printing separately.
+            Job *job = job_table[i];
+            if (job != NULL && job->background && !job->batch && !job_is_stopped(job))
+            {
+                job_wait(job);
+                if (job_is_done(job))
+                {
+                    status = job_status(job);
+                    job_remove(job);
+                }
+            }
         }
     }
-    else
+    for (int i = 1; argv[i] != NULL; i++)
     {
-        // Handle non-built-in commands, including piped commands.
-        char *commands[MAX_ARGS];
-        int num_cmds = 0, background = 0;
-        char *token = strtok(input, "|");
-
-        // Split the command by pipes, if any.
-        while (token != NULL && num_cmds < MAX_ARGS - 1)
+        Job *job = job_from_spec(argv[0], argv[i]);
+        if (job == NULL)
         {
-            commands[num_cmds++] = token;
-            token = strtok(NULL, "|");
+            status = 127;
+            continue;
         }
-
-        if (num_cmds == 1)
+        job_wait(job);
+        status = job_is_done(job) ? job_status(job) : 128 + SIGTSTP;
+        if (job_is_done(job))
         {
-            // Execute a single command without piping.
-            char *argv[MAX_ARGS];
-            process_input(commands[0], argv, &background);
-            execute_command(argv, background);
+            job_remove(job);
         }
-        else
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return status;
+}
+
+/**
+ * Moves a job to the foreground, resuming it if it is stopped, and waits for it.
+ *
+ * @param argv Array of command and an optional job argument.
+ * @return Exit status of the job; 1 if there is no such job.
+ */
+int builtin_fg(char *argv[])
+{
+    sigset_t saved;
+    block_child_signals(&saved);
+    Job *job = argv[1] != NULL ? job_from_spec(argv[0], argv[1]) : job_current(false);
+    if (job == NULL)
+    {
+        if (argv[1] == NULL)
         {
-            // Execute piped commands.
-            execute_piped_commands(commands, num_cmds, background);
+            printf("fg: no current job\n");
         }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        return 1;
     }
 
-    // Add the command to history if appropriate.
-    if (!isBuiltIn && strcmp(firstToken, "history") != 0)
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (job_control)
     {
-        add_to_history(dupInp);
+        tcsetpgrp(STDIN_FILENO, job->pgid); // Before SIGCONT, so it does not stop on terminal I/O.
     }
-
-    free(dupInp); // Free the duplicated input string.
+    if (job_is_stopped(job))
+    {
+        for (int p = 0; p < job->num_procs; p++)
+        {
+            job->procs[p].stopped = false;
+        }
+        job_signal(job, SIGCONT);
+    }
+    int status = job_wait_foreground(job);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return status;
 }
 
 /**
- * Checks if the given command is a built-in command of the shell.
+ * Resumes a stopped job in the background.
  *
- * @param command The command to check.
- * @return True if the command is built-in, False otherwise.
+ * @param argv Array of command and an optional job argument.
+ * @return Exit status of the command; 1 if there is no such job.
  */
-bool isBuiltInCommand(char *command)
+int builtin_bg(char *argv[])
 {
-    // Define an array of all built-in commands for comparison.
-    const char *builtInCommands[] = {"cd", "exit", "history", "export", "local", "vars"};
-    int builtInCommandsSize = sizeof(builtInCommands) / sizeof(builtInCommands[0]);
-
-    // Loop through the built-in commands to check for a match.
-    for (int i = 0; i < builtInCommandsSize; i++)
+    sigset_t saved;
+    block_child_signals(&saved);
+    Job *job = argv[1] != NULL ? job_from_spec(argv[0], argv[1]) : job_current(true);
+    if (job == NULL)
     {
-        if (strcmp(command, builtInCommands[i]) == 0)
+        if (argv[1] == NULL)
         {
-            return true; // Command is built-in.
+            printf("bg: no stopped job\n");
         }
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        return 1;
     }
 
-    return false; // Command is not built-in.
+    if (job_is_stopped(job))
+    {
+        for (int p = 0; p < job->num_procs; p++)
+        {
+            job->procs[p].stopped = false;
+        }
+        job_signal(job, SIGCONT);
+    }
+    job->background = true;
+    printf("[%d]  %s\n", job->id, job->command);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return 0;
 }
 
 /**
- * Executes a series of commands connected by pipes, allowing the output of one command to serve as input to the next.
- * It sets up pipes between commands and forks processes to execute each command in the pipeline.
+ * Starts a command as the coprocess: a background job whose standard input and output are pipes
+ * held by the shell. Their descriptors are published as COPROC_IN (write to it) and COPROC_OUT
+ * (read from it), with the PID in COPROC_PID, for use as in 'echo 1+1 >&$COPROC_IN'. 'coproc'
+ * alone closes the input, so the coprocess sees end of file while its output can still be read;
+ * starting a new coprocess closes both ends of the previous one. 'wait' collects it like any
+ * background job.
  *
- * @param commands Array of command strings that need to be executed in a pipeline.
- * @param num_cmds Number of commands in the commands array.
- * @param background Flag indicating whether the command should be executed in the background.
+ * @param argv Array of 'coproc' and the command to run, if any.
+ * @return 0 on success, 1 if the pipes cannot be created, 127 if the command does not start.
  */
-void execute_piped_commands(char **commands, int num_cmds, int background)
+int builtin_coproc(char *argv[])
 {
-    int pipefds[2 * (num_cmds - 1)]; // Array to store pipe file descriptors.
-    pid_t pid;
-    int fd_in = 0; // File descriptor for input redirection.
-
-    // Setup pipes and fork processes for each command in the pipeline.
-    for (int i = 0; i < num_cmds; ++i)
+    if (coproc_in >= 0)
     {
-        // Create pipes for all but the last command.
-        if (i < num_cmds - 1)
-        {
-            if (pipe(pipefds + i * 2) < 0)
-            {
-                perror("Couldn't Pipe");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        pid = fork();
-        if (pid == 0)
-        { // Child process
-            // Redirect input if necessary.
-            if (fd_in != 0)
-            {
-                dup2(fd_in, STDIN_FILENO);
-                close(fd_in);
-            }
-            // Redirect output for all but the last command.
-            if (i < num_cmds - 1)
-            {
-                dup2(pipefds[i * 2 + 1], STDOUT_FILENO);
-                close(pipefds[i * 2 + 1]);
-            }
-
-            // Close all other pipe ends in the child process.
-            for (int j = 0; j < 2 * num_cmds - 2; j++)
-            {
-                close(pipefds[j]);
-            }
-
-            // Process the command and execute.
-            char *argv[MAX_ARGS];
-            process_input(commands[i], argv, &background);
-            if (execvp(argv[0], argv) == -1)
-            {
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
-        }
-        else if (pid < 0)
-        { // Fork failed
-            perror("fork");
-            exit(EXIT_FAILURE);
-        }
-        else
-        { // Parent process
-            // Close the input end of the previous pipe.
-            if (fd_in != 0)
-            {
-                close(fd_in);
-            }
-            // Save the read end of the current pipe, if not the last command.
-            if (i < num_cmds - 1)
-            {
-                close(pipefds[i * 2 + 1]);
-                fd_in = pipefds[i * 2];
-            }
-        }
+        close(coproc_in);
+        coproc_in = -1;
+        var_table_unset(&local_vars, "COPROC_IN");
+    }
+    if (argv[1] == NULL)
+    {
+        return 0;
+    }
+    if (coproc_out >= 0)
+    {
+        close(coproc_out);
+        coproc_out = -1;
+        var_table_unset(&local_vars, "COPROC_OUT");
+        var_table_unset(&local_vars, "COPROC_PID");
     }
 
-    // Parent closes all pipes.
-    for (int i = 0; i < 2 * num_cmds - 2; i++)
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0)
+    {
+        perror("Couldn't Pipe");
+        return 1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0)
     {
-        close(pipefds[i]);
+        perror("Couldn't Pipe");
+        close(to_child[0]);
+        close(to_child[1]);
+        return 1;
     }
 
-    // Wait for all child processes to finish if not running in the background.
-    if (!background)
+    // Shown in job listings as typed, without the 'coproc'.
+    size_t len = 1;
+    for (int i = 1; argv[i] != NULL; i++)
     {
-        for (int i = 0; i < num_cmds; i++)
-        {
-            wait(NULL);
-        }
+        len += strlen(argv[i]) + 1;
     }
-    else
+    char *text = arena_alloc(&line_arena, len);
+    char *out = text;
+    for (int i = 1; argv[i] != NULL; i++)
     {
-        // Print the PID of the last command executed in the background.
-        printf("[PID %d running in background]\n", pid);
+        out += sprintf(out, i > 1 ? " %s" : "%s", argv[i]);
     }
+
+    LaunchSpec spec = {to_child[0], from_child[1], -1, {{0, 0, false}}, 0, job_control ? 0 : -1, NULL};
+    sigset_t saved;
+    block_child_signals(&saved); // The reaper must not see the child before its job exists.
+    const Builtin *builtin = find_builtin(argv[1]);
+    pid_t pid = builtin != NULL ? fork_builtin(builtin, argv + 1, &spec) : launch_process(argv + 1, &spec);
+    close(to_child[0]);
+    close(from_child[1]);
+    if (pid <= 0)
+    {
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        close(to_child[1]);
+        close(from_child[0]);
+        return 127;
+    }
+    Job *job = job_create(text, true, 1);
+    job_add_process(job, pid, argv[1]);
+    job_launched(job);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+
+    coproc_in = to_child[1];
+    coproc_out = from_child[0];
+    char number[16];
+    snprintf(number, sizeof(number), "%d", coproc_in);
+    set_local_var("COPROC_IN", number);
+    snprintf(number, sizeof(number), "%d", coproc_out);
+    set_local_var("COPROC_OUT", number);
+    snprintf(number, sizeof(number), "%d", pid);
+    set_local_var("COPROC_PID", number);
+    return 0;
 }
 
 /**
- * Prints the history of commands executed in the shell session up to the current moment.
- * This function iterates backward through the history array, displaying each command
- * along with its order number, starting from the most recent.
+ * Prints its arguments separated by spaces, followed by a newline unless the first argument is
+ * '-n'.
+ *
+ * @param argv Array of command and arguments.
+ * @return Exit status of the command.
  */
-void print_history()
+int builtin_echo(char *argv[])
 {
-    if (current_history_count == 0)
+    bool newline = true;
+    int i = 1;
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0)
     {
-        return; // Exit early if there are no commands in history.
+        newline = false;
+        i++;
     }
-    for (int i = current_history_count - 1; i >= 0; i--)
+    for (int first = i; argv[i] != NULL; i++)
     {
-        printf("%d) %s\n", current_history_count - i, history[i]); // Print each command in reverse order.
+        if (i > first)
+        {
+            putchar(' ');
+        }
+        fputs(argv[i], stdout);
+    }
+    if (newline)
+    {
+        putchar('\n');
     }
+    return ferror(stdout) ? 1 : 0;
 }
 
 /**
- * Sets or updates a local variable within the shell's environment.
- * If a variable with the given name already exists, its value is updated.
- * Otherwise, a new variable is created.
+ * Formats and prints its arguments like printf(1). The format is reused while arguments are
+ * left; missing arguments read as empty strings or zero.
  *
- * @param name The name of the variable to set or update.
- * @param value The value to assign to the variable.
+ * @param argv Array of command, format and arguments.
+ * @return Exit status of the command; 1 after a bad number or directive.
  */
-void set_local_var(char *name, char *value)
+int builtin_printf(char *argv[])
 {
-    // Search for existing variable with the given name.
-    for (int i = 0; i < localVarCount; ++i)
+    if (argv[1] == NULL)
     {
-        if (strcmp(localVars[i].name, name) == 0)
-        {
-            strncpy(localVars[i].value, value, MAX_LINE_LENGTH); // Update existing variable.
-            return;
-        }
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
     }
-
-    // Add new variable if not found.
-    if (localVarCount < MAX_LOCAL_VARS)
+    char **args = &argv[2];
+    int status = 0;
+    do
     {
-        strncpy(localVars[localVarCount].name, name, MAX_LINE_LENGTH);
-        strncpy(localVars[localVarCount].value, value, MAX_LINE_LENGTH);
-        localVarCount++; // Increment the count of local variables.
-    }
+        char **before = args;
+        status |= printf_format(argv[1], &args);
+        if (args == before)
+        {
+            break; // The format takes no arguments, so repeating it would never end.
+        }
+    } while (*args != NULL);
+    return status;
 }
 
 /**
- * Substitutes the value of a variable into the given argument if the argument starts with '$'.
- * The function first looks for the variable in the environment variables; if not found, it checks the shell's local variables.
- * If the variable is not found or its value is empty, the argument is replaced with an empty string.
+ * Prints one pass over a printf format, consuming arguments as conversions need them.
  *
- * @param arg Pointer to the string argument that potentially contains a variable to be substituted.
+ * @param format The format string.
+ * @param args In: next unused argument. Out: first argument not consumed.
+ * @return 0 on success, 1 after a bad number or directive.
  */
-void substitute_variable(char **arg)
+int printf_format(const char *format, char ***args)
 {
-    if ((*arg)[0] == '$')
+    int status = 0;
+    for (const char *p = format; *p != '\0'; p++)
     {
-        char *varName = *arg + 1;         // Exclude '$' from variable name.
-        char *varValue = getenv(varName); // Attempt to get value from environment variables.
+        if (*p == '\\')
+        {
+            p = printf_escape(p + 1);
+            continue;
+        }
+        if (*p != '%')
+        {
+            putchar(*p);
+            continue;
+        }
+        if (p[1] == '%')
+        {
+            putchar('%');
+            p++;
+            continue;
+        }
 
-        // Try local variables if environment variable not found.
-        if (varValue == NULL)
+        // Copy flags, width and precision into a spec for the C printf.
+        char spec[32] = "%";
+        size_t n = strspn(p + 1, "-+ #0");
+        n += strspn(p + 1 + n, "0123456789");
+        if (p[1 + n] == '.')
         {
-            for (int i = 0; i < localVarCount; i++)
-            {
-                if (strcmp(localVars[i].name, varName) == 0)
-                {
-                    varValue = localVars[i].value;
-                    break; // Found the local variable.
-                }
-            }
+            n++;
+            n += strspn(p + 1 + n, "0123456789");
+        }
+        if (n > sizeof(spec) - 5)
+        {
+            n = sizeof(spec) - 5;
         }
+        memcpy(spec + 1, p + 1, n);
+        char conversion = p[1 + n];
+        p += 1 + n;
 
-        // Substitute with empty string if variable not found or value is empty.
-        if (varValue == NULL || strcmp(varValue, "") == 0)
+        const char *arg = **args != NULL ? *(*args)++ : NULL;
+        char *end;
+        switch (conversion)
+        {
+        case 's':
+            strcat(spec, "s");
+            printf(spec, arg != NULL ? arg : "");
+            break;
+        case 'c':
+            strcat(spec, "c");
+            printf(spec, arg != NULL ? arg[0] : '\0');
+            break;
+        case 'd':
+        case 'i':
         {
-            *arg = strdup(""); // Replace with empty string.
+            long long value = arg != NULL ? strtoll(arg, &end, 0) : 0;
+            if (arg != NULL && (*arg == '\0' || *end != '\0'))
+            {
+                fprintf(stderr, "printf: %s: invalid number\n", arg);
+                status = 1;
+            }
+            strcat(spec, "lld");
+            printf(spec, value);
+            break;
         }
-        else
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
         {
-            *arg = strdup(varValue); // Substitute with variable's value.
+            unsigned long long value = arg != NULL ? strtoull(arg, &end, 0) : 0;
+            if (arg != NULL && (*arg == '\0' || *end != '\0'))
+            {
+                fprintf(stderr, "printf: %s: invalid number\n", arg);
+                status = 1;
+            }
+            char length[4] = {'l', 'l', conversion, '\0'};
+            strcat(spec, length);
+            printf(spec, value);
+            break;
+        }
+        default:
+            fprintf(stderr, "printf: %%%c: invalid directive\n", conversion);
+            return 1;
         }
     }
+    return status;
 }
 
 /**
- * Iterates over all arguments in a command and substitutes any variables found.
- * This function uses substitute_variable() to process each argument individually.
+ * Prints the character a printf backslash escape stands for: \n, \t, \\ and friends, or \nnn
+ * for an octal byte. Unknown escapes are printed as written.
  *
- * @param argv Array of string arguments representing the command and its parameters.
+ * @param p The character after the backslash.
+ * @return The last character of the escape sequence.
  */
-void substitute_variables_in_command(char *argv[])
+const char *printf_escape(const char *p)
 {
-    for (int i = 0; argv[i] != NULL; i++)
+    const char *from = "abfnrtv\\\"";
+    const char *to = "\a\b\f\n\r\t\v\\\"";
+    const char *match = *p != '\0' ? strchr(from, *p) : NULL;
+    if (match != NULL)
+    {
+        putchar(to[match - from]);
+        return p;
+    }
+    if (*p >= '0' && *p <= '7')
+    {
+        int value = *p - '0';
+        for (int digits = 1; digits < 3 && p[1] >= '0' && p[1] <= '7'; digits++)
+        {
+            value = value * 8 + (*++p - '0');
+        }
+        putchar(value);
+        return p;
+    }
+    putchar('\\');
+    if (*p == '\0')
     {
-        substitute_variable(&argv[i]); // Apply variable substitution to each argument.
+        return p - 1; // A trailing backslash is printed alone.
     }
+    putchar(*p);
+    return p;
 }
 
 /**
- * Changes the current working directory of the shell to the specified path.
+ * Succeeds without doing anything.
  *
- * @param path The path to change the directory to. If the path is invalid, an error is reported.
+ * @param argv Array of command and arguments (unused).
+ * @return Always 0.
  */
-void cmd_cd(char *path)
+int builtin_true(char *argv[])
 {
-    // Attempt to change the directory. On failure, report the error.
-    if (chdir(path) != 0)
-    {
-        perror("cd failed");
-        // Do not exit the program on failure, simply report the error.
-    }
+    (void)argv;
+    return 0;
 }
 
 /**
- * Exits the shell program. If additional arguments are provided, an error is reported and the exit is aborted.
+ * Fails without doing anything.
  *
- * @param argv Array of arguments passed to the exit command. Only the first argument (the command itself) is expected.
+ * @param argv Array of command and arguments (unused).
+ * @return Always 1.
  */
-void cmd_exit(char *argv[])
+int builtin_false(char *argv[])
 {
-    // Check for additional arguments and report an error if found.
-    if (argv[1] != NULL)
+    (void)argv;
+    return 1;
+}
+
+/**
+ * Evaluates a conditional expression, as 'test expr' or '[ expr ]'.
+ *
+ * @param argv Array of command and operands.
+ * @return 0 if the expression is true, 1 if it is false, 2 on a usage error.
+ */
+int builtin_test(char *argv[])
+{
+    int argc = 0;
+    while (argv[argc] != NULL)
     {
-        fprintf(stderr, "exit: does not take any arguments\n");
-        return; // Return to continue the shell loop, do not exit.
+        argc++;
     }
-    else
+    if (strcmp(argv[0], "[") == 0)
     {
-        exit(0); // Exit the shell with a normal exit status.
+        if (strcmp(argv[argc - 1], "]") != 0)
+        {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        argc--; // Drop the closing bracket.
     }
+    return test_expression(argc - 1, argv + 1);
 }
 
 /**
- * Controls the shell's command history. Can display the history, set its size, or execute a command from it.
+ * Evaluates test operands following the POSIX rules, which decide by the number of operands.
  *
- * @param argv Array of arguments passed to the history command. Supports viewing, setting size, or executing commands.
+ * @param argc Number of operands.
+ * @param argv The operands.
+ * @return 0 if true, 1 if false, 2 on a usage error.
  */
-void cmd_history_control(char *argv[])
+int test_expression(int argc, char *argv[])
 {
-    // Display the command history if no additional arguments are provided.
-    if (argv[1] == NULL)
+    int result;
+    switch (argc)
     {
-        print_history();
+    case 0:
+        return 1;
+    case 1:
+        return argv[0][0] != '\0' ? 0 : 1;
+    case 2:
+        if (strcmp(argv[0], "!") == 0)
+        {
+            result = test_expression(1, argv + 1);
+            return result == 2 ? 2 : !result;
+        }
+        return test_unary(argv[0], argv[1]);
+    case 3:
+        if (!test_is_binary(argv[1]) && strcmp(argv[0], "!") == 0)
+        {
+            result = test_expression(2, argv + 1); // '! op arg' with a unary op.
+            return result == 2 ? 2 : !result;
+        }
+        return test_binary(argv[0], argv[1], argv[2]);
+    case 4:
+        if (strcmp(argv[0], "!") == 0)
+        {
+            result = test_expression(3, argv + 1);
+            return result == 2 ? 2 : !result;
+        }
+        // fall through
+    default:
+        fprintf(stderr, "test: too many arguments\n");
+        return 2;
     }
-    // Set the history size if 'set' command is provided with a valid size.
-    else if (strcmp(argv[1], "set") == 0 && argv[2] != NULL)
+}
+
+/**
+ * Evaluates a unary test: string checks (-n, -z) and file checks (-e, -f, -d, -r, -w, -x, -s,
+ * -L/-h, -p, -S, -b, -c).
+ *
+ * @param op The operator.
+ * @param operand Its operand.
+ * @return 0 if true, 1 if false, 2 for an unknown operator.
+ */
+int test_unary(const char *op, const char *operand)
+{
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || strchr("nzefdrwxsLhpSbc", op[1]) == NULL)
     {
-        int newSize = atoi(argv[2]); // Convert the size argument to an integer.
-        set_history_size(newSize);   // Set the new history size.
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
     }
-    // Execute a specific command from the history if a command number is provided.
-    else
+
+    struct stat st;
+    bool result;
+    switch (op[1])
     {
-        int command_number = atoi(argv[1]);      // Convert the command number argument to an integer.
-        execute_history_command(command_number); // Execute the specified command.
+    case 'n':
+        result = operand[0] != '\0';
+        break;
+    case 'z':
+        result = operand[0] == '\0';
+        break;
+    case 'r':
+        result = access(operand, R_OK) == 0;
+        break;
+    case 'w':
+        result = access(operand, W_OK) == 0;
+        break;
+    case 'x':
+        result = access(operand, X_OK) == 0;
+        break;
+    case 'L':
+    case 'h':
+        result = lstat(operand, &st) == 0 && S_ISLNK(st.st_mode);
+        break;
+    default:
+        if (stat(operand, &st) != 0)
+        {
+            return 1;
+        }
+        result = op[1] == 'e' || (op[1] == 'f' && S_ISREG(st.st_mode)) || (op[1] == 'd' && S_ISDIR(st.st_mode)) ||
+                 (op[1] == 's' && st.st_size > 0) || (op[1] == 'p' && S_ISFIFO(st.st_mode)) ||
+                 (op[1] == 'S' && S_ISSOCK(st.st_mode)) || (op[1] == 'b' && S_ISBLK(st.st_mode)) ||
+                 (op[1] == 'c' && S_ISCHR(st.st_mode));
+        break;
     }
+    return result ? 0 : 1;
 }
 
 /**
- * Sets or unsets an environment variable.
+ * Evaluates a binary test: string comparison (=, ==, !=) or integer comparison (-eq, -ne, -lt,
+ * -le, -gt, -ge).
  *
- * @param name The name of the environment variable to set or unset.
- * @param value The value to set the environment variable to, or NULL/empty string to unset.
+ * @param left Left operand.
+ * @param op The operator.
+ * @param right Right operand.
+ * @return 0 if true, 1 if false, 2 for an unknown operator or a non-integer operand.
  */
-void cmd_export(char *name, char *value)
+int test_binary(const char *left, const char *op, const char *right)
 {
-    // Validate the command usage.
-    if (name == NULL)
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
     {
-        fprintf(stderr, "Usage: export VAR=value\n");
-        return;
+        return strcmp(left, right) == 0 ? 0 : 1;
+    }
+    if (strcmp(op, "!=") == 0)
+    {
+        return strcmp(left, right) != 0 ? 0 : 1;
     }
 
-    // Unset the environment variable if the value is NULL or an empty string.
-    if (value == NULL || strcmp(value, "") == 0)
+    int which = test_integer_op(op);
+    if (which < 0)
     {
-        if (unsetenv(name) != 0)
-        {
-            perror("unsetenv failed");
-        }
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
     }
-    else
+
+    char *end_left, *end_right;
+    long long a = strtoll(left, &end_left, 10);
+    long long b = strtoll(right, &end_right, 10);
+    if (*left == '\0' || *end_left != '\0' || *right == '\0' || *end_right != '\0')
     {
-        // Set or update the environment variable with the provided value.
-        if (setenv(name, value, 1) != 0)
-        {
-            perror("setenv failed");
-        }
+        fprintf(stderr, "test: integer expression expected\n");
+        return 2;
     }
+    bool results[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    return results[which] ? 0 : 1;
 }
 
 /**
- * Sets or unsets a local (shell-specific) variable.
+ * Tells whether a word is one of the operators test_binary() knows, without reporting anything.
  *
- * @param name The name of the local variable to set or unset.
- * @param value The value to set the local variable to, or NULL/empty string to unset.
+ * @param op The word.
+ * @return True for a string or integer comparison operator.
  */
-void cmd_local(char *name, char *value)
+bool test_is_binary(const char *op)
 {
-    // Unset the local variable if the value is NULL or an empty string.
-    if (value == NULL || strcmp(value, "") == 0)
-    {
-        // Find and remove the variable if it exists.
-        int found = -1;
-        for (int i = 0; i < localVarCount; i++)
-        {
-            if (strcmp(localVars[i].name, name) == 0)
-            {
-                found = i;
-                break;
-            }
-        }
-        if (found != -1)
-        {
-            // Remove the found variable by shifting subsequent variables up.
-            for (int i = found; i < localVarCount - 1; i++)
-            {
-                localVars[i] = localVars[i + 1];
-            }
-            localVarCount--; // Decrement the count of local variables.
-        }
-    }
-    else
+    return strcmp(op, "=") == 0 || strcmp(op, "==") == 0 || strcmp(op, "!=") == 0 || test_integer_op(op) >= 0;
+}
+
+/**
+ * Finds an integer comparison operator of test.
+ *
+ * @param op The word.
+ * @return Index of the operator in -eq, -ne, -lt, -le, -gt, -ge, or -1 if it is none of them.
+ */
+int test_integer_op(const char *op)
+{
+    const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++)
     {
-        // Set or update the local variable.
-        int found = -1;
-        for (int i = 0; i < localVarCount; i++)
-        {
-            if (strcmp(localVars[i].name, name) == 0)
-            {
-                found = i;
-                break;
-            }
-        }
-        if (found != -1)
-        {
-            // Update the value of an existing variable.
-            strncpy(localVars[found].value, value, MAX_LINE_LENGTH - 1);
-        }
-        else
+        if (strcmp(op, ops[i]) == 0)
         {
-            // Add a new local variable.
-            if (localVarCount < MAX_LOCAL_VARS)
-            {
-                strncpy(localVars[localVarCount].name, name, MAX_LINE_LENGTH - 1);
-                strncpy(localVars[localVarCount].value, value, MAX_LINE_LENGTH - 1);
-                localVarCount++; // Increment the count of local variables.
-            }
+            return i;
         }
     }
+    return -1;
 }
 
 /**
- * Displays all local variables set within the shell.
+ * Prints the current working directory.
+ *
+ * @param argv Array of command and arguments (unused).
+ * @return Exit status of the command.
  */
-void cmd_vars()
+int builtin_pwd(char *argv[])
 {
-    // Iterate through the list of local variables and print them.
-    for (int i = 0; i < localVarCount; i++)
+    (void)argv;
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
     {
-        printf("%s=%s\n", localVars[i].name, localVars[i].value); // Print variable name and value.
+        perror("pwd");
+        return 1;
     }
+    printf("%s\n", cwd);
+    return 0;
 }